@@ -0,0 +1,648 @@
+/* dosbench times the pieces of dos.c that every tool leans on (FAT
+   lookups, cluster addressing, decoding directory entries), and then
+   the tools themselves from start to finish, over the sample images
+   and some big FAT12, FAT16 and FAT32 images it makes for the
+   purpose.  Each result is one line of JSON on standard output, so
+   runs can be kept and compared. */
+
+#define _GNU_SOURCE	/* for SEEK_DATA and SEEK_HOLE */
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <libgen.h>
+
+#include "bootsect.h"
+#include "bpb.h"
+#include "direntry.h"
+#include "fat.h"
+#include "dos.h"
+
+#define RUNS_DEFAULT 5		/* runs of each tool, the median is reported */
+#define MICRO_SECONDS 0.25	/* how long each microbenchmark keeps going */
+#define COPY_IN_MAX (64 * 1024 * 1024)
+
+/* the images made with dos_mkimg: a shallow tree of small files and
+   one big one, with the contents left as holes, which keeps them quick
+   to make and to copy; only the metadata is real */
+struct sample {
+    const char *name;
+    const char *args[12];
+};
+
+static const struct sample samples[] = {
+    { "gen12.img", { "--fat=12", "--size=2M", "--cluster=512",
+		     "--depth=1", "--fanout=8", "--files=128",
+		     "--min-size=4K", "--max-size=4K", "--big=1M",
+		     "--sparse" } },
+    { "gen16.img", { "--fat=16", "--size=64M", "--cluster=2K",
+		     "--depth=1", "--fanout=32", "--files=2048",
+		     "--min-size=8K", "--max-size=8K", "--big=32M",
+		     "--sparse" } },
+    { "gen32.img", { "--fat=32", "--size=512M", "--cluster=4K",
+		     "--depth=1", "--fanout=64", "--files=8192",
+		     "--min-size=8K", "--max-size=8K", "--big=256M",
+		     "--sparse" } },
+};
+
+/* the sample images that come with the tools, if they are there */
+static const char *stock[] = {
+    "goodimage.img", "badimage1.img", "badimage2.img", "badimage3.img",
+    "badimage4.img", "badimage5.img",
+};
+
+static char *tooldir;		/* where dos_ls and friends are */
+static char *workdir;		/* scratch space for copies */
+static int runs = RUNS_DEFAULT;
+static volatile uintptr_t sink;	/* keeps the timed loops from going away */
+
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static char *join(const char *dir, const char *name)
+{
+    char *path = malloc(strlen(dir) + strlen(name) + 2);
+
+    if (path == NULL)
+    {
+	fprintf(stderr, "Out of memory\n");
+	exit(1);
+    }
+    sprintf(path, "%s/%s", dir, name);
+    return path;
+}
+
+
+/* copy_image copies an image to dst, keeping its holes, so that the
+   tools that write can be timed on a fresh copy every run */
+static int copy_image(const char *src, const char *dst)
+{
+    static uint8_t buf[1024 * 1024];
+    int in, out, rv = 0;
+    off_t data, hole, size;
+    ssize_t n;
+
+    in = open(src, O_RDONLY);
+    if (in < 0)
+    {
+	fprintf(stderr, "Could not open %s: %s\n", src, strerror(errno));
+	return -1;
+    }
+    out = open(dst, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (out < 0)
+    {
+	fprintf(stderr, "Could not create %s: %s\n", dst, strerror(errno));
+	close(in);
+	return -1;
+    }
+
+    size = lseek(in, 0, SEEK_END);
+    for (data = lseek(in, 0, SEEK_DATA); data >= 0 && data < size;
+	 data = lseek(in, hole, SEEK_DATA))
+    {
+	hole = lseek(in, data, SEEK_HOLE);
+	if (hole < 0)
+	    hole = size;
+	while (data < hole)
+	{
+	    size_t want = hole - data < (off_t)sizeof(buf)
+		? (size_t)(hole - data) : sizeof(buf);
+
+	    n = pread(in, buf, want, data);
+	    if (n <= 0 || pwrite(out, buf, n, data) != n)
+	    {
+		fprintf(stderr, "Could not copy %s\n", src);
+		rv = -1;
+		goto out;
+	    }
+	    data += n;
+	}
+    }
+    if (ftruncate(out, size) < 0)
+	rv = -1;
+
+out:
+    close(in);
+    close(out);
+    return rv;
+}
+
+/* make_host_file writes a file of size bytes for copy-in to read */
+static int make_host_file(const char *path, size_t size)
+{
+    static uint8_t buf[64 * 1024];
+    size_t i, n;
+    int fd;
+
+    for (i = 0; i < sizeof(buf); i++)
+	buf[i] = i * 7 + (i >> 8);
+    fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd < 0)
+    {
+	fprintf(stderr, "Could not create %s: %s\n", path, strerror(errno));
+	return -1;
+    }
+    for (i = 0; i < size; i += n)
+    {
+	n = size - i < sizeof(buf) ? size - i : sizeof(buf);
+	if (write(fd, buf, n) != (ssize_t)n)
+	{
+	    fprintf(stderr, "Could not write %s\n", path);
+	    close(fd);
+	    return -1;
+	}
+    }
+    close(fd);
+    return 0;
+}
+
+
+/* What the microbenchmarks and the tool runs need to know about an
+   image, found with one walk over it. */
+struct survey {
+    struct dosvol *vol;
+    uint32_t *dirs;		/* first cluster of every directory */
+    int ndirs, maxdirs;
+    char *big_path;		/* the biggest file, for cat and copy-out */
+    uint32_t big_size;
+    uint64_t free_bytes;
+};
+
+static int add_dir(struct survey *sv, uint32_t cluster)
+{
+    if (sv->ndirs == sv->maxdirs)
+    {
+	uint32_t *more;
+
+	sv->maxdirs = sv->maxdirs ? 2 * sv->maxdirs : 64;
+	more = realloc(sv->dirs, sv->maxdirs * sizeof(uint32_t));
+	if (more == NULL)
+	    return -1;
+	sv->dirs = more;
+    }
+    sv->dirs[sv->ndirs++] = cluster;
+    return 0;
+}
+
+static int survey_entry(struct walk_entry *e, void *arg)
+{
+    struct survey *sv = arg;
+    struct direntry *dirent = e->dirent;
+    uint32_t size = getulong(dirent->deFileSize);
+
+    if (dirent->deAttributes & ATTR_VOLUME)
+	return 0;
+    if (dirent->deAttributes & ATTR_DIRECTORY)
+    {
+	if (strcmp(e->name, ".") == 0 || strcmp(e->name, "..") == 0)
+	    return WALK_PRUNE;
+	return add_dir(sv, dirent_cluster(dirent, sv->vol));
+    }
+    if (sv->big_path == NULL || size > sv->big_size)
+    {
+	free(sv->big_path);
+	sv->big_path = strdup(e->path);
+	sv->big_size = size;
+    }
+    return 0;
+}
+
+static int survey(struct dosvol *vol, struct survey *sv)
+{
+    uint32_t c;
+
+    memset(sv, 0, sizeof(*sv));
+    sv->vol = vol;
+    for (c = CLUST_FIRST; c < vol->max_cluster; c++)
+	if (get_fat_entry(c, vol) == CLUST_FREE)
+	    sv->free_bytes += vol->cluster_size;
+    if (add_dir(sv, vol->root_cluster) < 0
+	|| dir_walk(vol->root_cluster, 0, survey_entry, sv, vol) < 0)
+    {
+	fprintf(stderr, "Could not walk the directory tree\n");
+	return -1;
+    }
+    return 0;
+}
+
+static void free_survey(struct survey *sv)
+{
+    free(sv->dirs);
+    free(sv->big_path);
+}
+
+
+/* Microbenchmarks run in this process, on a read only mapping of the
+   image, so set_fat_entry() only ever changes the decoded FAT.  Each
+   one repeats a pass over the image until MICRO_SECONDS are up. */
+
+typedef uint64_t (*micro_pass)(struct dosvol *, struct survey *);
+
+static uint64_t get_fat_pass(struct dosvol *vol, struct survey *sv)
+{
+    uintptr_t sum = 0;
+    uint32_t c;
+
+    for (c = CLUST_FIRST; c < vol->max_cluster; c++)
+	sum += get_fat_entry(c, vol);
+    sink = sum;
+    return vol->max_cluster - CLUST_FIRST;
+}
+
+static uint64_t set_fat_pass(struct dosvol *vol, struct survey *sv)
+{
+    uint32_t c;
+
+    for (c = CLUST_FIRST; c < vol->max_cluster; c++)
+	set_fat_entry(c, vol->fat[c], vol);
+    return vol->max_cluster - CLUST_FIRST;
+}
+
+static uint64_t cluster_addr_pass(struct dosvol *vol, struct survey *sv)
+{
+    uintptr_t sum = 0;
+    uint32_t c;
+
+    for (c = CLUST_FIRST; c < vol->max_cluster; c++)
+	sum += (uintptr_t)cluster_to_addr(c, vol);
+    sink = sum;
+    return vol->max_cluster - CLUST_FIRST;
+}
+
+static int count_entry(struct direntry *dirent, const char *name, void *arg)
+{
+    (*(uint64_t *)arg)++;
+    sink += (uintptr_t)name[0];
+    return 0;
+}
+
+static uint64_t dirent_name_pass(struct dosvol *vol, struct survey *sv)
+{
+    uint64_t n = 0;
+    int i;
+
+    for (i = 0; i < sv->ndirs; i++)
+	dir_read(sv->dirs[i], count_entry, &n, vol);
+    return n;
+}
+
+static void put_string(const char *s)
+{
+    putchar('"');
+    for (; *s != '\0'; s++)
+    {
+	if (*s == '"' || *s == '\\')
+	    printf("\\%c", *s);
+	else if ((unsigned char)*s < 0x20)
+	    printf("\\u%04x", *s);
+	else
+	    putchar(*s);
+    }
+    putchar('"');
+}
+
+static void put_head(const char *bench, const char *kind, const char *image,
+		     struct dosvol *vol)
+{
+    printf("{\"bench\":");
+    put_string(bench);
+    printf(",\"kind\":");
+    put_string(kind);
+    printf(",\"image\":");
+    put_string(image);
+    printf(",\"fat\":%d", vol->fat_type);
+}
+
+static void run_micro(const char *bench, micro_pass pass, const char *image,
+		      struct dosvol *vol, struct survey *sv)
+{
+    struct rusage before, after;
+    uint64_t ops = 0, n;
+    double start, elapsed;
+
+    getrusage(RUSAGE_SELF, &before);
+    start = now();
+    do
+    {
+	n = pass(vol, sv);
+	ops += n;
+	elapsed = now() - start;
+    } while (n > 0 && elapsed < MICRO_SECONDS);
+    getrusage(RUSAGE_SELF, &after);
+    if (ops == 0)
+	return;
+
+    put_head(bench, "micro", image, vol);
+    printf(",\"ops\":%llu,\"seconds\":%.6f,\"ns_per_op\":%.3f"
+	   ",\"minflt\":%ld,\"majflt\":%ld}\n",
+	   (unsigned long long)ops, elapsed, elapsed * 1e9 / ops,
+	   after.ru_minflt - before.ru_minflt,
+	   after.ru_majflt - before.ru_majflt);
+}
+
+static void micro(const char *image, struct dosvol *vol, struct survey *sv)
+{
+    run_micro("get_fat_entry", get_fat_pass, image, vol, sv);
+    run_micro("set_fat_entry", set_fat_pass, image, vol, sv);
+    run_micro("cluster_to_addr", cluster_addr_pass, image, vol, sv);
+    run_micro("dirent_name", dirent_name_pass, image, vol, sv);
+    fflush(stdout);
+}
+
+
+/* Tool runs fork and exec the real programs with their output thrown
+   away, and take the page faults from wait4().  The image the tools
+   write to is copied afresh before each run, outside the timing. */
+
+struct run {
+    double seconds;
+    long minflt, majflt;
+    int status;
+};
+
+static int run_tool(char **argv, struct run *r)
+{
+    struct rusage ru;
+    double start;
+    pid_t pid;
+    int status, null;
+
+    fflush(stdout);
+    start = now();
+    pid = fork();
+    if (pid < 0)
+    {
+	fprintf(stderr, "Could not fork: %s\n", strerror(errno));
+	return -1;
+    }
+    if (pid == 0)
+    {
+	null = open("/dev/null", O_WRONLY);
+	if (null >= 0)
+	{
+	    dup2(null, 1);
+	    dup2(null, 2);
+	}
+	execv(argv[0], argv);
+	_exit(127);
+    }
+    if (wait4(pid, &status, 0, &ru) < 0)
+    {
+	fprintf(stderr, "wait4: %s\n", strerror(errno));
+	return -1;
+    }
+    r->seconds = now() - start;
+    r->minflt = ru.ru_minflt;
+    r->majflt = ru.ru_majflt;
+    r->status = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+    return 0;
+}
+
+/* generate makes one of the samples at path with dos_mkimg */
+static int generate(const struct sample *s, const char *path)
+{
+    char *argv[sizeof(s->args) / sizeof(s->args[0]) + 3];
+    struct run r;
+    int n = 0, i;
+
+    argv[n++] = join(tooldir, "dos_mkimg");
+    for (i = 0; s->args[i] != NULL; i++)
+	argv[n++] = (char *)s->args[i];
+    argv[n++] = (char *)path;
+    argv[n] = NULL;
+    if (run_tool(argv, &r) < 0 || r.status != 0)
+    {
+	fprintf(stderr, "Could not make %s\n", path);
+	free(argv[0]);
+	return -1;
+    }
+    free(argv[0]);
+    return 0;
+}
+
+static int by_seconds(const void *a, const void *b)
+{
+    const struct run *x = a, *y = b;
+
+    return (x->seconds > y->seconds) - (x->seconds < y->seconds);
+}
+
+/* time_tool runs argv runs times, copying fresh to copy first if that
+   is set, and reports the median run */
+static void time_tool(const char *bench, char **argv, const char *image,
+		      struct dosvol *vol, uint64_t bytes,
+		      const char *fresh, const char *copy)
+{
+    struct run *r = calloc(runs, sizeof(struct run)), *med;
+    int i;
+
+    if (r == NULL)
+    {
+	fprintf(stderr, "Out of memory\n");
+	exit(1);
+    }
+    for (i = 0; i < runs; i++)
+    {
+	if ((fresh != NULL && copy_image(fresh, copy) < 0)
+	    || run_tool(argv, &r[i]) < 0)
+	{
+	    free(r);
+	    return;
+	}
+    }
+    qsort(r, runs, sizeof(struct run), by_seconds);
+    med = &r[runs / 2];
+
+    put_head(bench, "tool", image, vol);
+    printf(",\"runs\":%d,\"seconds\":%.6f,\"bytes\":%llu", runs, med->seconds,
+	   (unsigned long long)bytes);
+    if (bytes > 0)
+	printf(",\"mb_per_s\":%.2f", bytes / 1e6 / med->seconds);
+    printf(",\"minflt\":%ld,\"majflt\":%ld,\"status\":%d}\n",
+	   med->minflt, med->majflt, med->status);
+    fflush(stdout);
+    free(r);
+}
+
+static void tools(char *path, const char *image, struct dosvol *vol,
+		  struct survey *sv)
+{
+    char *ls = join(tooldir, "dos_ls");
+    char *cat = join(tooldir, "dos_cat");
+    char *cp = join(tooldir, "dos_cp");
+    char *scandisk = join(tooldir, "scandisk");
+    char *copy = join(workdir, "copy.img");
+    char *out = join(workdir, "out.dat");
+    char *in = join(workdir, "in.dat");
+    char *src = NULL;
+    uint64_t in_size;
+
+    time_tool("ls", (char *[]){ ls, path, NULL }, image, vol, 0, NULL, NULL);
+    time_tool("ls_json", (char *[]){ ls, "--format=json", path, NULL },
+	      image, vol, 0, NULL, NULL);
+
+    if (sv->big_path != NULL)
+    {
+	src = malloc(strlen(sv->big_path) + 3);
+	if (src == NULL)
+	{
+	    fprintf(stderr, "Out of memory\n");
+	    exit(1);
+	}
+	sprintf(src, "a:%s", sv->big_path);
+	time_tool("cat", (char *[]){ cat, path, sv->big_path, NULL },
+		  image, vol, sv->big_size, NULL, NULL);
+	time_tool("copy_out", (char *[]){ cp, path, src, out, NULL },
+		  image, vol, sv->big_size, NULL, NULL);
+	unlink(out);
+    }
+
+    /* fill about half the free space, but not for too long */
+    in_size = sv->free_bytes / 2;
+    if (in_size > COPY_IN_MAX)
+	in_size = COPY_IN_MAX;
+    if (in_size > 0 && make_host_file(in, in_size) == 0)
+    {
+	time_tool("copy_in", (char *[]){ cp, copy, in, "a:BENCHIN.DAT", NULL },
+		  image, vol, in_size, path, copy);
+	unlink(in);
+    }
+
+    time_tool("scandisk", (char *[]){ scandisk, copy, NULL },
+	      image, vol, 0, path, copy);
+    unlink(copy);
+
+    free(ls);
+    free(cat);
+    free(cp);
+    free(scandisk);
+    free(copy);
+    free(out);
+    free(in);
+    free(src);
+}
+
+/* bench_image runs everything over one image */
+static void bench_image(char *path)
+{
+    struct volopts opts;
+    struct dosvol *vol;
+    struct survey sv;
+    char *copy = strdup(path);
+    char *image = basename(copy);
+
+    /* always the mapping for the microbenchmarks: with the pread
+       backend, cluster_to_addr() would pin every cluster in turn */
+    volopts_init(&opts);
+    opts.backend = VOL_MMAP;
+    opts.flags |= VOL_RDONLY;
+    vol = open_volume_opts(path, &opts);
+    if (vol == NULL)
+    {
+	free(copy);
+	return;
+    }
+    if (survey(vol, &sv) == 0)
+    {
+	micro(image, vol, &sv);
+	tools(path, image, vol, &sv);
+    }
+    free_survey(&sv);
+    close_volume(vol);
+    free(copy);
+}
+
+
+static void usage(char *progname)
+{
+    fprintf(stderr, "usage: %s [-n runs] [-t tooldir] [-w workdir] [-s] "
+	    "[image ...]\n", progname);
+    fprintf(stderr, "\tbenchmarks the named images, or the sample images "
+	    "and generated\n\tFAT12, FAT16 and FAT32 ones (-s skips those)\n");
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    char template[] = "/tmp/dosbench.XXXXXX";
+    char *self = strdup(argv[0]);
+    int opt, skip = 0, made = 0, i;
+    unsigned j;
+
+    tooldir = dirname(self);
+    while ((opt = getopt(argc, argv, "n:t:w:s")) != -1)
+    {
+	switch (opt)
+	{
+	case 'n':
+	    runs = atoi(optarg);
+	    if (runs < 1)
+		usage(argv[0]);
+	    break;
+	case 't':
+	    tooldir = optarg;
+	    break;
+	case 'w':
+	    workdir = optarg;
+	    break;
+	case 's':
+	    skip = 1;
+	    break;
+	default:
+	    usage(argv[0]);
+	}
+    }
+
+    if (workdir == NULL)
+    {
+	workdir = mkdtemp(template);
+	if (workdir == NULL)
+	{
+	    fprintf(stderr, "Could not make a work directory: %s\n",
+		    strerror(errno));
+	    exit(1);
+	}
+	made = 1;
+    }
+
+    if (optind < argc)
+    {
+	for (i = optind; i < argc; i++)
+	    bench_image(argv[i]);
+    }
+    else
+    {
+	for (j = 0; j < sizeof(stock) / sizeof(stock[0]); j++)
+	    if (access(stock[j], R_OK) == 0)
+		bench_image((char *)stock[j]);
+	for (j = 0; !skip && j < sizeof(samples) / sizeof(samples[0]); j++)
+	{
+	    char *path = join(workdir, samples[j].name);
+
+	    if (generate(&samples[j], path) == 0)
+		bench_image(path);
+	    unlink(path);
+	    free(path);
+	}
+    }
+
+    if (made)
+	rmdir(workdir);
+    free(self);
+    return 0;
+}
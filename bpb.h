@@ -112,7 +112,7 @@ struct bpb710 {
 #define getushort(x)	(((u_int8_t *)(x))[0] + (((u_int8_t *)(x))[1] << 8))
 #define getulong(x)	(((u_int8_t *)(x))[0] + (((u_int8_t *)(x))[1] << 8) \
 			 + (((u_int8_t *)(x))[2] << 16)	\
-			 + (((u_int8_t *)(x))[3] << 24))
+			 + ((u_int32_t)((u_int8_t *)(x))[3] << 24))
 #define putushort(p, v)	(((u_int8_t *)(p))[0] = (v),	\
 			 ((u_int8_t *)(p))[1] = (v) >> 8)
 #define putulong(p, v)	(((u_int8_t *)(p))[0] = (v),	\
@@ -85,6 +85,26 @@ struct direntry {
 	u_int8_t	deFileSize[4];	/* size of file in bytes */
 };
 
+/*
+ * Win95 long filename entry.  A long name is stored in a run of these
+ * just before the short entry it belongs to, last part first, up to
+ * WIN_CHARS UCS-2 characters in each.
+ */
+struct winentry {
+	u_int8_t	weCnt;		/* sequence number of this part */
+#define	WIN_LAST	0x40		/* set on the last part of the name */
+#define	WIN_CNT		0x3f
+	u_int8_t	wePart1[10];	/* characters 1-5 */
+	u_int8_t	weAttributes;	/* always ATTR_WIN95LFN */
+	u_int8_t	weReserved1;
+	u_int8_t	weChksum;	/* checksum of the short name */
+	u_int8_t	wePart2[12];	/* characters 6-11 */
+	u_int8_t	weReserved2[2];
+	u_int8_t	wePart3[4];	/* characters 12-13 */
+};
+#define	WIN_CHARS	13		/* characters per winentry */
+#define	WIN_MAXLEN	255		/* longest long name */
+
 
 /*
  * This is the format of the contents of the deTime field in the direntry
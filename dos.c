@@ -7,21 +7,33 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <string.h>
+#include <ctype.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/time.h>
+#include <sys/resource.h>
 
 #include "bootsect.h"
 #include "bpb.h"
 #include "direntry.h"
 #include "fat.h"
 #include "dos.h"
+#include "probes.h"
 
 
-static int imagesize = 0;
+static int load_fat(struct dosvol *);
+static void flush_fat(struct dosvol *);
+static void free_fat(struct dosvol *);
+static void free_dirindexes(struct dosvol *);
+static void free_chainindexes(struct dosvol *);
+static void release_image(struct dosvol *);
 
-/* memory map the FAT-12  disk image file */
-uint8_t *mmap_file(char *filename, int *fd)
+/* open the disk image file for read/write, or just for reading with
+   VOL_RDONLY in flags, and find out how big it is.  Returns -1 if it
+   can't be opened. */
+static int open_image(char *filename, int flags, int *fd, size_t *size)
 {
     struct stat statbuf;
-    uint8_t *image_buf;
     char pathname[MAXPATHLEN+1];
 
 
@@ -31,6 +43,7 @@ uint8_t *mmap_file(char *filename, int *fd)
     if (filename[0] == '/') 
     {
 	strncpy(pathname, filename, MAXPATHLEN);
+	pathname[MAXPATHLEN] = '\0';
     } 
     else 
     {
@@ -38,7 +51,7 @@ uint8_t *mmap_file(char *filename, int *fd)
 	if (strlen(pathname) + strlen(filename) + 1 > MAXPATHLEN) 
 	{
 	    fprintf(stderr, "Filename too long\n");
-	    exit(1);
+	    return -1;
 	}
 	strcat(pathname, "/");
 	strcat(pathname, filename);
@@ -52,49 +65,862 @@ uint8_t *mmap_file(char *filename, int *fd)
     {
 	fprintf(stderr, "Cannot read disk image file %s:\n%s\n", 
 		pathname, strerror(errno));
-	exit(1);
+	return -1;
     }
-    imagesize = statbuf.st_size;
+    *size = statbuf.st_size;
 
 
-    /* Step 3: open the file for read/write */
+    /* Step 3: open the file for read/write, unless we only read it */
 
-    *fd = open(pathname, O_RDWR);
+    *fd = open(pathname, (flags & VOL_RDONLY) ? O_RDONLY : O_RDWR);
     if (*fd < 0) 
     {
 	fprintf(stderr, "Cannot read disk image file %s:\n%s\n", 
 		pathname, strerror(errno));
-	exit(1);
+	return -1;
     }
+    return 0;
+}
+
+/* memory map the FAT-12  disk image file.  With VOL_RDONLY in flags
+   the file is opened and mapped read only, as a private mapping, so
+   any number of readers can share an image nobody can write to; with
+   VOL_POPULATE as well, the whole image is read in up front.  Returns
+   NULL if the image can't be opened or mapped. */
+uint8_t *mmap_file(char *filename, int flags, int *fd, size_t *size)
+{
+    uint8_t *image_buf;
+    int prot = PROT_READ | PROT_WRITE, share = MAP_SHARED;
+
+    if (open_image(filename, flags, fd, size) < 0)
+	return NULL;
 
 
     /* Step 4: we memory map the file */
 
-    image_buf = mmap(NULL, imagesize, PROT_READ | PROT_WRITE, MAP_SHARED, *fd, 0);
+    if (flags & VOL_RDONLY)
+    {
+	prot = PROT_READ;
+	share = MAP_PRIVATE;
+#ifdef MAP_POPULATE
+	if (flags & VOL_POPULATE)
+	    share |= MAP_POPULATE;
+#endif
+    }
+    image_buf = mmap(NULL, *size, prot, share, *fd, 0);
     if (image_buf == MAP_FAILED) 
     {
 	fprintf(stderr, "Failed to memory map: \n%s\n", strerror(errno));
-	exit(1);
+	close(*fd);
+	return NULL;
     }
     return image_buf;
 }
 
 
-void unmmap_file(uint8_t *image, int *fd)
+void unmmap_file(uint8_t *image, size_t size, int fd)
+{
+    munmap(image, size);
+    close(fd);
+}
+
+
+/* The block layer.  Everything in the image is reached through one of
+   two backends, picked when the volume is opened.  The mmap backend
+   maps the whole image, and vol_map() is just pointer arithmetic.
+   The pread backend maps nothing, for images too big to map or on
+   storage where a page fault can stall for a long time:
+
+   - metadata (the boot sector, the FATs, directories) that the rest of
+     dos.c works on in place is read into a pinned block, which stays
+     put for as long as anyone holds it.  vol_map() takes a hold and
+     vol_release() gives it back; when the last hold goes, whatever
+     has changed is written back and the block is freed, so memory
+     follows what is in use rather than everything ever walked.  A
+     block nobody releases stays until the volume is closed;
+
+   - file data is read and written with vol_read() and vol_write().
+     Small reads go through an LRU cache of CACHE_BLOCK sized blocks,
+     whose total size is set when the volume is opened; big ones go
+     straight to the file.
+
+   Data reads and writes see through to any pinned block they overlap,
+   so the two never disagree. */
+
+#define CACHE_BLOCK (64 * 1024)
+#define PIN_BUCKETS 256		/* initial size of the pinned block tables */
+#define PIN_CHUNK_SHIFT 16	/* pinned memory is indexed in 64K chunks */
+
+struct pinned;
+
+/* one chunk of the memory a pinned block covers, in the address index */
+struct pinchunk {
+    uintptr_t chunk;		/* address >> PIN_CHUNK_SHIFT */
+    struct pinned *pin;
+    struct pinchunk *next;	/* in its hash bucket */
+};
+
+struct pinned {
+    off_t offset;
+    size_t len;
+    uint8_t *data;
+    uint8_t *orig;		/* data as it is on disk; NULL if read only */
+    uint32_t refs;		/* holds on the block */
+    struct pinned *next;	/* in its offset hash bucket */
+    struct pinned *newer, *older; /* every pinned block */
+    struct pinchunk *chunks;	/* its entries in the address index */
+    uint32_t nchunks;
+};
+
+struct cached {
+    off_t block;		/* offset / CACHE_BLOCK */
+    size_t len;			/* short at the end of the image */
+    uint8_t *data;
+    struct cached *next;	/* in its hash bucket */
+    struct cached *newer, *older;
+};
+
+struct blockdev {
+    pthread_mutex_t lock;
+    struct pinned **pins;	/* by offset */
+    struct pinchunk **addrs;	/* by address, for vol_offset() and holds */
+    struct pinned *pin_newest, *pin_oldest;
+    uint32_t npins, pin_buckets;
+    uint32_t nchunks, addr_buckets;
+    uint32_t data_pins;		/* pinned blocks in the data area */
+    struct cached **cache;
+    uint32_t cache_buckets;
+    uint32_t ncached, max_cached;
+    struct cached *newest, *oldest;
+};
+
+/* pread_full and pwrite_full keep going until all of len is done;
+   they return -1 if it can't be */
+static int pread_full(int fd, uint8_t *buf, size_t len, off_t offset)
+{
+    ssize_t n;
+
+    while (len > 0)
+    {
+	n = pread(fd, buf, len, offset);
+	STATS_ADD(syscalls, 1);
+	if (n < 0 && errno == EINTR)
+	    continue;
+	if (n <= 0)
+	    return -1;
+	buf += n;
+	len -= n;
+	offset += n;
+    }
+    return 0;
+}
+
+static int pwrite_full(int fd, const uint8_t *buf, size_t len, off_t offset)
+{
+    ssize_t n;
+
+    while (len > 0)
+    {
+	n = pwrite(fd, buf, len, offset);
+	STATS_ADD(syscalls, 1);
+	if (n < 0 && errno == EINTR)
+	    continue;
+	if (n <= 0)
+	    return -1;
+	buf += n;
+	len -= n;
+	offset += n;
+    }
+    return 0;
+}
+
+static uint32_t offset_hash(off_t offset)
+{
+    uint64_t h = (uint64_t)offset * 0x9e3779b97f4a7c15ULL;
+
+    return h >> 32;
+}
+
+static int blk_init(struct dosvol *vol, size_t cache_size)
+{
+    struct blockdev *b = calloc(1, sizeof(struct blockdev));
+
+    if (b == NULL)
+	return -1;
+    b->pin_buckets = PIN_BUCKETS;
+    b->pins = calloc(b->pin_buckets, sizeof(struct pinned *));
+    b->addr_buckets = PIN_BUCKETS;
+    b->addrs = calloc(b->addr_buckets, sizeof(struct pinchunk *));
+    b->max_cached = cache_size / CACHE_BLOCK;
+    for (b->cache_buckets = 16; b->cache_buckets < b->max_cached; )
+	b->cache_buckets *= 2;
+    b->cache = calloc(b->cache_buckets, sizeof(struct cached *));
+    if (b->pins == NULL || b->addrs == NULL || b->cache == NULL)
+    {
+	free(b->pins);
+	free(b->addrs);
+	free(b->cache);
+	free(b);
+	return -1;
+    }
+    pthread_mutex_init(&b->lock, NULL);
+    vol->blk = b;
+    return 0;
+}
+
+static struct pinned *find_pin(struct blockdev *b, off_t offset)
+{
+    struct pinned *pin = b->pins[offset_hash(offset) & (b->pin_buckets - 1)];
+
+    while (pin != NULL && pin->offset != offset)
+	pin = pin->next;
+    return pin;
+}
+
+static void grow_pins(struct blockdev *b)
+{
+    struct pinned **pins, *pin;
+    uint32_t buckets = b->pin_buckets * 2;
+
+    pins = calloc(buckets, sizeof(struct pinned *));
+    if (pins == NULL)
+	return;			/* the chains just get longer */
+    for (pin = b->pin_newest; pin != NULL; pin = pin->older)
+    {
+	uint32_t i = offset_hash(pin->offset) & (buckets - 1);
+
+	pin->next = pins[i];
+	pins[i] = pin;
+    }
+    free(b->pins);
+    b->pins = pins;
+    b->pin_buckets = buckets;
+}
+
+static void grow_addrs(struct blockdev *b)
+{
+    struct pinchunk **addrs;
+    struct pinned *pin;
+    uint32_t buckets = b->addr_buckets * 2, n;
+
+    addrs = calloc(buckets, sizeof(struct pinchunk *));
+    if (addrs == NULL)
+	return;
+    for (pin = b->pin_newest; pin != NULL; pin = pin->older)
+    {
+	for (n = 0; n < pin->nchunks; n++)
+	{
+	    struct pinchunk *c = &pin->chunks[n];
+	    uint32_t i = offset_hash(c->chunk) & (buckets - 1);
+
+	    c->next = addrs[i];
+	    addrs[i] = c;
+	}
+    }
+    free(b->addrs);
+    b->addrs = addrs;
+    b->addr_buckets = buckets;
+}
+
+/* pin_at finds the pinned block holding address p, or NULL.  Called
+   with the lock held. */
+static struct pinned *pin_at(struct blockdev *b, const uint8_t *p)
+{
+    uintptr_t chunk = (uintptr_t)p >> PIN_CHUNK_SHIFT;
+    struct pinchunk *c;
+
+    for (c = b->addrs[offset_hash(chunk) & (b->addr_buckets - 1)]; 
+	 c != NULL; c = c->next)
+    {
+	if (c->chunk == chunk && p >= c->pin->data 
+	    && p < c->pin->data + (c->pin->len ? c->pin->len : 1))
+	    return c->pin;
+    }
+    return NULL;
+}
+
+/* link_pin enters a new block in the offset and address indexes.
+   Called with the lock held; returns -1 if we run out of memory. */
+static int link_pin(struct dosvol *vol, struct pinned *pin)
+{
+    struct blockdev *b = vol->blk;
+    uintptr_t first = (uintptr_t)pin->data >> PIN_CHUNK_SHIFT;
+    uintptr_t last = ((uintptr_t)pin->data + (pin->len ? pin->len : 1) - 1) 
+	>> PIN_CHUNK_SHIFT;
+    uint32_t h, n;
+
+    pin->nchunks = last - first + 1;
+    pin->chunks = calloc(pin->nchunks, sizeof(struct pinchunk));
+    if (pin->chunks == NULL)
+	return -1;
+
+    /* a longer block for the same offset goes in front of the old one,
+       so it is the one found */
+    if (b->npins >= b->pin_buckets * 2)
+	grow_pins(b);
+    h = offset_hash(pin->offset) & (b->pin_buckets - 1);
+    pin->next = b->pins[h];
+    b->pins[h] = pin;
+
+    if (b->nchunks + pin->nchunks > b->addr_buckets * 2)
+	grow_addrs(b);
+    for (n = 0; n < pin->nchunks; n++)
+    {
+	struct pinchunk *c = &pin->chunks[n];
+
+	c->chunk = first + n;
+	c->pin = pin;
+	h = offset_hash(c->chunk) & (b->addr_buckets - 1);
+	c->next = b->addrs[h];
+	b->addrs[h] = c;
+    }
+    b->nchunks += pin->nchunks;
+
+    pin->older = b->pin_newest;
+    if (b->pin_newest != NULL)
+	b->pin_newest->newer = pin;
+    else
+	b->pin_oldest = pin;
+    b->pin_newest = pin;
+    b->npins++;
+    if ((uint64_t)pin->offset >= vol->data_offset && vol->data_offset != 0)
+	b->data_pins++;
+    return 0;
+}
+
+/* unlink_pin takes a block out of the indexes again.  Called with the
+   lock held. */
+static void unlink_pin(struct dosvol *vol, struct pinned *pin)
+{
+    struct blockdev *b = vol->blk;
+    struct pinned **link;
+    uint32_t n;
+
+    for (link = &b->pins[offset_hash(pin->offset) & (b->pin_buckets - 1)];
+	 *link != pin; link = &(*link)->next)
+	;
+    *link = pin->next;
+
+    for (n = 0; n < pin->nchunks; n++)
+    {
+	struct pinchunk *c = &pin->chunks[n], **clink;
+
+	for (clink = &b->addrs[offset_hash(c->chunk) & (b->addr_buckets - 1)];
+	     *clink != c; clink = &(*clink)->next)
+	    ;
+	*clink = c->next;
+    }
+    b->nchunks -= pin->nchunks;
+
+    if (pin->newer != NULL)
+	pin->newer->older = pin->older;
+    else
+	b->pin_newest = pin->older;
+    if (pin->older != NULL)
+	pin->older->newer = pin->newer;
+    else
+	b->pin_oldest = pin->newer;
+    b->npins--;
+    if ((uint64_t)pin->offset >= vol->data_offset && vol->data_offset != 0)
+	b->data_pins--;
+}
+
+static void free_pin(struct pinned *pin)
+{
+    free(pin->chunks);
+    free(pin->orig);
+    free(pin->data);
+    free(pin);
+}
+
+static void see_pins(struct dosvol *, off_t, uint8_t *, size_t, int);
+static void cache_drop(struct dosvol *, off_t, size_t);
+static int cache_read(struct dosvol *, off_t, uint8_t *, size_t);
+
+/* pin_writeback writes back the part of a pinned block that has
+   changed since it was read, and brings the cache and any other
+   pinned copy of those bytes up to date.  Called with the lock
+   held. */
+static void pin_writeback(struct dosvol *vol, struct pinned *pin)
+{
+    size_t len = pin->len, first, last;
+    struct pinned *other;
+
+    if (pin->orig == NULL || (size_t)pin->offset >= vol->size)
+	return;
+    if (len > vol->size - pin->offset)
+	len = vol->size - pin->offset;
+    if (memcmp(pin->data, pin->orig, len) == 0)
+	return;
+    for (first = 0; pin->data[first] == pin->orig[first]; first++)
+	;
+    for (last = len; pin->data[last - 1] == pin->orig[last - 1]; last--)
+	;
+    if (pwrite_full(vol->fd, pin->data + first, last - first, 
+		    pin->offset + first) < 0)
+    {
+	fprintf(stderr, "Can't write the disk image at offset %lld: %s\n",
+		(long long)(pin->offset + first), strerror(errno));
+	return;
+    }
+    memcpy(pin->orig + first, pin->data + first, last - first);
+    cache_drop(vol, pin->offset + first, last - first);
+    see_pins(vol, pin->offset + first, pin->data + first, last - first, 1);
+
+    /* and a shorter or longer block at the same offset */
+    for (other = find_pin(vol->blk, pin->offset); other != NULL; 
+	 other = other->next)
+    {
+	size_t n;
+
+	if (other == pin || other->offset != pin->offset || other->len <= first)
+	    continue;
+	n = (other->len < last ? other->len : last) - first;
+	memcpy(other->data + first, pin->data + first, n);
+	if (other->orig != NULL)
+	    memcpy(other->orig + first, pin->data + first, n);
+    }
+}
+
+/* blk_fill reads len bytes of the image at offset into buf, through
+   the cache if the read is small, and sees through to any pinned
+   blocks it overlaps.  Called with the lock held. */
+static int blk_fill(struct dosvol *vol, off_t offset, uint8_t *buf, 
+		    size_t len)
+{
+    int rv;
+
+    if (len >= CACHE_BLOCK || vol->blk->max_cached == 0)
+	rv = pread_full(vol->fd, buf, len, offset);
+    else
+	rv = cache_read(vol, offset, buf, len);
+    if (rv == 0)
+	see_pins(vol, offset, buf, len, 0);
+    return rv;
+}
+
+/* vol_map returns the address of len bytes of the image at offset,
+   and takes a hold on them.  With the pread backend the bytes are read
+   into a block of their own, which stays where it is until the last
+   hold on it is released (see vol_release()); every caller asks for
+   the same len at a given offset (a sector, a FAT, the root directory
+   or a cluster), so a block already there is shared.  Metadata can't
+   be worked on without it, so this gives up on the program if the
+   image can't be read. */
+uint8_t *vol_map(struct dosvol *vol, off_t offset, size_t len)
+{
+    struct blockdev *b = vol->blk;
+    struct pinned *pin;
+    size_t avail;
+
+    if (vol->image != NULL)
+	return vol->image + offset;
+
+    pthread_mutex_lock(&b->lock);
+    pin = find_pin(b, offset);
+    if (pin != NULL && pin->len >= len)
+    {
+	pin->refs++;
+	pthread_mutex_unlock(&b->lock);
+	return pin->data;
+    }
+
+    /* a longer block where there is already a shorter one: put the
+       shorter one's changes on disk first, so the longer one starts
+       out with them */
+    if (pin != NULL)
+	pin_writeback(vol, pin);
+
+    /* past the end of the image reads as zeroes */
+    avail = (size_t)offset < vol->size ? vol->size - offset : 0;
+    if (avail > len)
+	avail = len;
+    pin = calloc(1, sizeof(struct pinned));
+    if (pin == NULL || (pin->data = calloc(len ? len : 1, 1)) == NULL
+	|| (!(vol->flags & VOL_RDONLY) 
+	    && (pin->orig = malloc(len ? len : 1)) == NULL)
+	|| blk_fill(vol, offset, pin->data, avail) < 0)
+    {
+	fprintf(stderr, "Can't read the disk image at offset %lld: %s\n",
+		(long long)offset, strerror(errno));
+	exit(1);
+    }
+    pin->offset = offset;
+    pin->len = len;
+    pin->refs = 1;
+    if (pin->orig != NULL)
+	memcpy(pin->orig, pin->data, len);
+    if (link_pin(vol, pin) < 0)
+    {
+	fprintf(stderr, "Out of memory pinning the disk image\n");
+	exit(1);
+    }
+    pthread_mutex_unlock(&b->lock);
+    return pin->data;
+}
+
+/* vol_hold takes another hold on the block holding p, which vol_map()
+   handed out, so that it stays where it is; vol_release gives a hold
+   back, and once the last one is gone the block is written back if it
+   has changed, and freed.  Neither does anything with the mmap
+   backend, or for an address vol_map() didn't hand out. */
+void vol_hold(struct dosvol *vol, void *p)
+{
+    struct pinned *pin;
+
+    if (vol->image != NULL || p == NULL)
+	return;
+    pthread_mutex_lock(&vol->blk->lock);
+    pin = pin_at(vol->blk, p);
+    if (pin != NULL)
+	pin->refs++;
+    pthread_mutex_unlock(&vol->blk->lock);
+}
+
+void vol_release(struct dosvol *vol, void *p)
+{
+    struct pinned *pin;
+
+    if (vol->image != NULL || p == NULL)
+	return;
+    pthread_mutex_lock(&vol->blk->lock);
+    pin = pin_at(vol->blk, p);
+    if (pin != NULL && pin->refs > 0 && --pin->refs == 0)
+    {
+	pin_writeback(vol, pin);
+	unlink_pin(vol, pin);
+	free_pin(pin);
+    }
+    pthread_mutex_unlock(&vol->blk->lock);
+}
+
+/* vol_offset is the reverse of vol_map: where in the image the byte
+   at p came from */
+off_t vol_offset(struct dosvol *vol, uint8_t *p)
+{
+    struct pinned *pin;
+    off_t offset = -1;
+
+    if (vol->image != NULL)
+	return p - vol->image;
+
+    pthread_mutex_lock(&vol->blk->lock);
+    pin = pin_at(vol->blk, p);
+    if (pin != NULL)
+	offset = pin->offset + (p - pin->data);
+    pthread_mutex_unlock(&vol->blk->lock);
+    return offset;
+}
+
+/* see_pins copies between buf, holding len bytes of the image at
+   offset, and whichever pinned clusters it overlaps: into buf after a
+   read, or into the pinned copies after a write, which is then what
+   they have on disk too.  Called with the lock held. */
+static void see_pins(struct dosvol *vol, off_t offset, uint8_t *buf, 
+		     size_t len, int to_pins)
+{
+    struct blockdev *b = vol->blk;
+    uint32_t cluster, last;
+    off_t end = offset + len;
+
+    if (b->data_pins == 0 || end <= (off_t)vol->data_offset)
+	return;
+    cluster = offset < (off_t)vol->data_offset ? CLUST_FIRST 
+	: (offset - vol->data_offset) / vol->cluster_size + CLUST_FIRST;
+    last = (end - 1 - vol->data_offset) / vol->cluster_size + CLUST_FIRST;
+
+    for (; cluster <= last; cluster++)
+    {
+	off_t start = cluster_to_offset(cluster, vol), from, to;
+	struct pinned *pin;
+
+	for (pin = find_pin(b, start); pin != NULL; pin = pin->next)
+	{
+	    if (pin->offset != start)
+		continue;
+	    from = start > offset ? start : offset;
+	    to = start + (off_t)pin->len < end ? start + (off_t)pin->len : end;
+	    if (from >= to)
+		continue;
+	    if (to_pins)
+	    {
+		/* buf may be this very block, being written back */
+		memmove(pin->data + (from - start), buf + (from - offset), 
+			to - from);
+		if (pin->orig != NULL)
+		    memcpy(pin->orig + (from - start), 
+			   pin->data + (from - start), to - from);
+	    }
+	    else
+		memcpy(buf + (from - offset), pin->data + (from - start), 
+		       to - from);
+	}
+    }
+}
+
+/* cache_get returns the cache block with the given number, reading it
+   in (in place of the least recently used block, once the cache is
+   full) if it isn't there.  Called with the lock held. */
+static struct cached *cache_get(struct dosvol *vol, off_t block)
+{
+    struct blockdev *b = vol->blk;
+    uint32_t i = offset_hash(block) & (b->cache_buckets - 1);
+    struct cached *c, **link;
+    off_t offset = block * CACHE_BLOCK;
+
+    for (c = b->cache[i]; c != NULL; c = c->next)
+	if (c->block == block)
+	    break;
+
+    if (c == NULL)
+    {
+	if (b->ncached < b->max_cached)
+	{
+	    c = calloc(1, sizeof(struct cached));
+	    if (c == NULL || (c->data = malloc(CACHE_BLOCK)) == NULL)
+	    {
+		free(c);
+		return NULL;
+	    }
+	    b->ncached++;
+	}
+	else
+	{
+	    /* recycle the oldest */
+	    c = b->oldest;
+	    for (link = &b->cache[offset_hash(c->block) & (b->cache_buckets - 1)];
+		 *link != c; link = &(*link)->next)
+		;
+	    *link = c->next;
+	    b->oldest = c->newer;
+	    if (b->oldest != NULL)
+		b->oldest->older = NULL;
+	    else
+		b->newest = NULL;
+	}
+	c->block = block;
+	c->len = (size_t)offset < vol->size ? vol->size - offset : 0;
+	if (c->len > CACHE_BLOCK)
+	    c->len = CACHE_BLOCK;
+	if (pread_full(vol->fd, c->data, c->len, offset) < 0)
+	{
+	    free(c->data);
+	    free(c);
+	    b->ncached--;
+	    return NULL;
+	}
+	c->next = b->cache[i];
+	b->cache[i] = c;
+	c->older = b->newest;
+	c->newer = NULL;
+	if (b->newest != NULL)
+	    b->newest->newer = c;
+	b->newest = c;
+	if (b->oldest == NULL)
+	    b->oldest = c;
+	return c;
+    }
+
+    /* move it to the newest end */
+    if (c != b->newest)
+    {
+	if (c->older != NULL)
+	    c->older->newer = c->newer;
+	else
+	    b->oldest = c->newer;
+	c->newer->older = c->older;
+	c->older = b->newest;
+	c->newer = NULL;
+	b->newest->newer = c;
+	b->newest = c;
+    }
+    return c;
+}
+
+/* cache_drop forgets any cached copy of the blocks holding len bytes at
+   offset.  Called with the lock held. */
+static void cache_drop(struct dosvol *vol, off_t offset, size_t len)
+{
+    struct blockdev *b = vol->blk;
+    off_t block;
+
+    if (b->ncached == 0)
+	return;
+    for (block = offset / CACHE_BLOCK; block * CACHE_BLOCK < offset + (off_t)len;
+	 block++)
+    {
+	uint32_t i = offset_hash(block) & (b->cache_buckets - 1);
+	struct cached *c, **link;
+
+	for (link = &b->cache[i]; (c = *link) != NULL; link = &c->next)
+	    if (c->block == block)
+		break;
+	if (c == NULL)
+	    continue;
+	*link = c->next;
+	if (c->older != NULL)
+	    c->older->newer = c->newer;
+	else
+	    b->oldest = c->newer;
+	if (c->newer != NULL)
+	    c->newer->older = c->older;
+	else
+	    b->newest = c->older;
+	free(c->data);
+	free(c);
+	b->ncached--;
+    }
+}
+
+/* cache_read copies len bytes of the image at offset into buf through
+   the cache.  Called with the lock held. */
+static int cache_read(struct dosvol *vol, off_t offset, uint8_t *buf, 
+		      size_t len)
+{
+    size_t done, n;
+
+    for (done = 0; done < len; done += n)
+    {
+	off_t at = offset + done;
+	struct cached *c = cache_get(vol, at / CACHE_BLOCK);
+
+	if (c == NULL)
+	    return -1;
+	n = CACHE_BLOCK - at % CACHE_BLOCK;
+	if (n > len - done)
+	    n = len - done;
+	memcpy(buf + done, c->data + at % CACHE_BLOCK, n);
+    }
+    return 0;
+}
+
+/* vol_read copies len bytes of the image at offset into buf.  Returns
+   -1 if they can't be read. */
+int vol_read(struct dosvol *vol, off_t offset, void *buf, size_t len)
+{
+    struct blockdev *b = vol->blk;
+    int rv = 0;
+
+    if (offset < 0 || (size_t)offset > vol->size || len > vol->size - offset)
+	return -1;
+    if (vol->image != NULL)
+    {
+	memcpy(buf, vol->image + offset, len);
+	return 0;
+    }
+
+    if (len >= CACHE_BLOCK || b->max_cached == 0)
+    {
+	if (pread_full(vol->fd, buf, len, offset) < 0)
+	    return -1;
+	pthread_mutex_lock(&b->lock);
+    }
+    else
+    {
+	pthread_mutex_lock(&b->lock);
+	rv = cache_read(vol, offset, buf, len);
+    }
+    see_pins(vol, offset, buf, len, 0);
+    pthread_mutex_unlock(&b->lock);
+    return rv;
+}
+
+/* vol_write copies len bytes from buf into the image at offset.
+   Returns -1 if they can't be written. */
+int vol_write(struct dosvol *vol, off_t offset, const void *buf, size_t len)
+{
+    struct blockdev *b = vol->blk;
+
+    if (offset < 0 || (size_t)offset > vol->size || len > vol->size - offset)
+	return -1;
+    if (vol->flags & VOL_RDONLY)
+    {
+	errno = EROFS;
+	return -1;
+    }
+    if (vol->image != NULL)
+    {
+	memcpy(vol->image + offset, buf, len);
+	return 0;
+    }
+
+    if (pwrite_full(vol->fd, buf, len, offset) < 0)
+	return -1;
+    pthread_mutex_lock(&b->lock);
+    cache_drop(vol, offset, len);
+    see_pins(vol, offset, (uint8_t *)buf, len, 1);
+    pthread_mutex_unlock(&b->lock);
+    return 0;
+}
+
+/* blk_close writes back every block still pinned that has changed
+   since it was read, oldest first, and frees the backend */
+static void blk_close(struct dosvol *vol)
+{
+    struct blockdev *b = vol->blk;
+    struct pinned *pin, *next;
+
+    if (b == NULL)
+	return;
+
+    for (pin = b->pin_oldest; pin != NULL; pin = pin->newer)
+	pin_writeback(vol, pin);
+    for (pin = b->pin_oldest; pin != NULL; pin = next)
+    {
+	next = pin->newer;
+	free_pin(pin);
+    }
+
+    while (b->newest != NULL)
+    {
+	struct cached *c = b->newest;
+
+	b->newest = c->older;
+	free(c->data);
+	free(c);
+    }
+    free(b->pins);
+    free(b->addrs);
+    free(b->cache);
+    pthread_mutex_destroy(&b->lock);
+    free(b);
+    vol->blk = NULL;
+}
+
+
+/* log2 of n if n is a power of two, otherwise -1 */
+static int shift_of(uint32_t n)
 {
-    munmap(image, imagesize);
-    close(*fd);
+    int shift = 0;
+
+    if (n == 0 || (n & (n - 1)) != 0)
+	return -1;
+    while ((1u << shift) != n)
+	shift++;
+    return shift;
 }
 
 
-/* read the bootsector from the disk, and check that it is sane */
+/* read the bootsector from the disk, and check that it is sane.  The
+   decoded BPB and the volume geometry derived from it are stored in
+   vol.  Returns -1 if the geometry is unusable. */
 /* define DEBUG to see what the disk parameters actually are */
 
-struct bpb33* check_bootsector(uint8_t *image_buf)
+int check_bootsector(struct dosvol *vol)
 {
+    uint8_t *image_buf;
+    struct bpb710 *bpb_aligned = &vol->bpb;
     struct bootsector33* bootsect;
-    struct byte_bpb33* bpb;  /* BIOS parameter block */
-    struct bpb33* bpb_aligned;
+    struct byte_bpb710* bpb;  /* BIOS parameter block */
+    uint32_t total_sectors, fat_sectors, root_sectors, first_data;
+    uint32_t nclusters;
+
+    if (vol->size < sizeof(struct bootsector33))
+    {
+	fprintf(stderr, "Disk image is too small to hold a boot sector\n");
+	return -1;
+    }
+    image_buf = vol_map(vol, 0, sizeof(struct bootsector33));
 
 #ifdef DEBUG
     fprintf(stderr, "Size of BPB: %lu\n", sizeof(struct bootsector33));
@@ -134,12 +960,14 @@ struct bpb33* check_bootsector(uint8_t *image_buf)
 		bootsect->bsBootSectSig1);
     }
 
-    bpb = (struct byte_bpb33*)&(bootsect->bsBPB[0]);
+    bpb = (struct byte_bpb710*)&(bootsect->bsBPB[0]);
 
     /* bpb is a byte-based struct, because this data is unaligned.
        This makes it hard to access the multi-byte fields, so we copy
-       it to a slightly larger struct that is word-aligned */
-    bpb_aligned = malloc(sizeof(struct bpb33));
+       it to a slightly larger struct that is word-aligned.  The DOS
+       5.0 and FAT32 fields only mean anything when the 3.3 ones are
+       zero, so it is safe to read them from every image. */
+    memset(bpb_aligned, 0, sizeof(struct bpb710));
 
     bpb_aligned->bpbBytesPerSec = getushort(bpb->bpbBytesPerSec);
     bpb_aligned->bpbSecPerClust = bpb->bpbSecPerClust;
@@ -147,8 +975,20 @@ struct bpb33* check_bootsector(uint8_t *image_buf)
     bpb_aligned->bpbFATs = bpb->bpbFATs;
     bpb_aligned->bpbRootDirEnts = getushort(bpb->bpbRootDirEnts);
     bpb_aligned->bpbSectors = getushort(bpb->bpbSectors);
+    bpb_aligned->bpbMedia = bpb->bpbMedia;
     bpb_aligned->bpbFATsecs = getushort(bpb->bpbFATsecs);
-    bpb_aligned->bpbHiddenSecs = getushort(bpb->bpbHiddenSecs);
+    bpb_aligned->bpbHiddenSecs = getulong(bpb->bpbHiddenSecs);
+    bpb_aligned->bpbHugeSectors = getulong(bpb->bpbHugeSectors);
+    if (bpb_aligned->bpbFATsecs == 0)
+    {
+	/* FAT32 */
+	bpb_aligned->bpbBigFATsecs = getulong(bpb->bpbBigFATsecs);
+	bpb_aligned->bpbExtFlags = getushort(bpb->bpbExtFlags);
+	bpb_aligned->bpbFSVers = getushort(bpb->bpbFSVers);
+	bpb_aligned->bpbRootClust = getulong(bpb->bpbRootClust);
+	bpb_aligned->bpbFSInfo = getushort(bpb->bpbFSInfo);
+	bpb_aligned->bpbBackup = getushort(bpb->bpbBackup);
+    }
     
 
 #ifdef DEBUG
@@ -161,127 +1001,2336 @@ struct bpb33* check_bootsector(uint8_t *image_buf)
     fprintf(stderr, "Number of sectors per FAT: %d\n", bpb_aligned->bpbFATsecs);
     fprintf(stderr, "Number of hidden sectors: %d\n", bpb_aligned->bpbHiddenSecs);
 #endif
+    vol_release(vol, image_buf);
 
-    return bpb_aligned;
-}
+    if (bpb_aligned->bpbBytesPerSec == 0 || bpb_aligned->bpbSecPerClust == 0)
+    {
+	fprintf(stderr, "Boot sector has a zero sector or cluster size\n");
+	return -1;
+    }
 
-/* get_fat_entry returns the value from the FAT entry for
-   clusternum. */
-uint16_t get_fat_entry(uint16_t clusternum, 
-		       uint8_t *image_buf, struct bpb33* bpb)
-{
-    uint32_t offset;
-    uint16_t value;
-    uint8_t b1, b2;
-    
-    /* this involves some really ugly bit shifting.  This probably
-       only works on a little-endian machine. */
-    offset = bpb->bpbResSectors * bpb->bpbBytesPerSec * bpb->bpbSecPerClust 
-	+ (3 * (clusternum/2));
-    switch(clusternum % 2) 
-    {
-    case 0:
-	b1 = *(image_buf + offset);
-	b2 = *(image_buf + offset + 1);
-
-	/* mjh: little-endian CPUs are ugly! */
-	value = ((0x0f & b2) << 8) | b1;
-	break;
-    case 1:
-	b1 = *(image_buf + offset + 1);
-	b2 = *(image_buf + offset + 2);
-	value = b2 << 4 | ((0xf0 & b1) >> 4);
-	break;
+    /* work out where everything lives once, rather than on every
+       cluster lookup */
+    total_sectors = bpb_aligned->bpbSectors ? bpb_aligned->bpbSectors 
+	: bpb_aligned->bpbHugeSectors;
+    fat_sectors = bpb_aligned->bpbFATsecs ? bpb_aligned->bpbFATsecs 
+	: bpb_aligned->bpbBigFATsecs;
+    root_sectors = (bpb_aligned->bpbRootDirEnts * sizeof(struct direntry) 
+		    + bpb_aligned->bpbBytesPerSec - 1) 
+	/ bpb_aligned->bpbBytesPerSec;
+    first_data = bpb_aligned->bpbResSectors 
+	+ bpb_aligned->bpbFATs * fat_sectors + root_sectors;
+    if (first_data >= total_sectors)
+    {
+	fprintf(stderr, "Boot sector leaves no room for data\n");
+	return -1;
     }
-    return value;
-}
 
+    vol->fat_size = fat_sectors * bpb_aligned->bpbBytesPerSec;
+    vol->fat_offset = bpb_aligned->bpbResSectors * bpb_aligned->bpbBytesPerSec;
+    vol->root_offset = bpb_aligned->bpbBytesPerSec 
+	* (bpb_aligned->bpbResSectors + (bpb_aligned->bpbFATs * fat_sectors));
+    vol->data_offset = first_data * bpb_aligned->bpbBytesPerSec;
+    vol->cluster_size = 
+	bpb_aligned->bpbBytesPerSec * bpb_aligned->bpbSecPerClust;
 
-/* set_fat_entry sets the value of the FAT entry for clusternum to value. */
-void set_fat_entry(uint16_t clusternum, uint16_t value,
-		   uint8_t *image_buf, struct bpb33* bpb)
-{
-    uint32_t offset;
-    uint8_t *p1, *p2;
-    
-    /* this involves some really ugly bit shifting.  This probably
-       only works on a little-endian machine. */
-    offset = bpb->bpbResSectors * bpb->bpbBytesPerSec * bpb->bpbSecPerClust 
-	+ (3 * (clusternum/2));
-    switch(clusternum % 2) 
-    {
-    case 0:
-	p1 = image_buf + offset;
-	p2 = image_buf + offset + 1;
-	/* mjh: little-endian CPUs are really ugly! */
-	*p1 = (uint8_t)(0xff & value);
-	*p2 = (uint8_t)((0xf0 & (*p2)) | (0x0f & (value >> 8)));
-	break;
-    case 1:
-	p1 = image_buf + offset + 1;
-	p2 = image_buf + offset + 2;
-	*p1 = (uint8_t)((0x0f & (*p1)) | ((0x0f & value) << 4));
-	*p2 = (uint8_t)(0xff & (value >> 4));
-	break;
+    /* the FAT type is decided purely by how many clusters there are */
+    nclusters = (total_sectors - first_data) / bpb_aligned->bpbSecPerClust;
+    if (nclusters < 4085)
+    {
+	vol->fat_type = 12;
+	vol->fat_mask = FAT12_MASK;
     }
-}
+    else if (nclusters < 65525)
+    {
+	vol->fat_type = 16;
+	vol->fat_mask = FAT16_MASK;
+    }
+    else
+    {
+	vol->fat_type = 32;
+	vol->fat_mask = FAT32_MASK;
+	vol->root_cluster = bpb_aligned->bpbRootClust;
 
+	/* with mirroring off, only the active FAT is in use */
+	if (bpb_aligned->bpbExtFlags & FATMIRROR)
+	    vol->fat_offset += (bpb_aligned->bpbExtFlags & FATNUM) 
+		* vol->fat_size;
+    }
 
-int is_valid_cluster(uint16_t cluster, struct bpb33 *bpb)
-{
-    uint16_t max_cluster = (bpb->bpbSectors / bpb->bpbSecPerClust) & FAT12_MASK;
+    vol->max_cluster = nclusters + CLUST_FIRST;
+    if (vol->max_cluster > (vol->fat_mask & CLUST_LAST) + 1)
+	vol->max_cluster = (vol->fat_mask & CLUST_LAST) + 1;
 
-    if (cluster >= (FAT12_MASK & CLUST_FIRST) && 
-        cluster <= (FAT12_MASK & CLUST_LAST) &&
-        cluster < max_cluster)
-        return TRUE;
-    return FALSE;
+    /* the usual 512 byte sectors and power of two clusters let
+       cluster_to_addr() shift instead of multiply */
+    vol->sector_shift = shift_of(bpb_aligned->bpbBytesPerSec);
+    vol->cluster_shift = shift_of(vol->cluster_size);
+
+#ifdef DEBUG
+    fprintf(stderr, "FAT%d, %u clusters of %d bytes (shift %d)\n", 
+	    vol->fat_type, nclusters, vol->cluster_size, vol->cluster_shift);
+#endif
+    return 0;
 }
 
 
-/* is_end_of_file returns true if the FAT entry for cluster indicates
-   this is the last cluster in a file */
-int is_end_of_file(uint16_t cluster) 
+/* volopts_init fills in how open_volume() reaches the image from the
+   environment: DOSVOL_IO=pread picks the pread backend, DOSVOL_CACHE
+   its cache size in bytes (with an optional K, M or G), and
+   DOSVOL_POPULATE=1 has a read only mapping read in up front.  The
+   default is to map the image, for reading and writing. */
+void volopts_init(struct volopts *opts)
 {
-    if (cluster >= (FAT12_MASK & CLUST_EOFS) && 
-        cluster <= (FAT12_MASK & CLUST_EOFE)) 
-    {
-	return TRUE;
-    } 
-    else 
+    char *io = getenv("DOSVOL_IO");
+    char *cache = getenv("DOSVOL_CACHE");
+    char *end;
+
+    memset(opts, 0, sizeof(*opts));
+    opts->backend = VOL_MMAP;
+    opts->cache_size = VOL_CACHE_DEFAULT;
+    if (io != NULL && strcmp(io, "pread") == 0)
+	opts->backend = VOL_PREAD;
+    if (getenv("DOSVOL_POPULATE") != NULL 
+	&& strcmp(getenv("DOSVOL_POPULATE"), "1") == 0)
+	opts->flags |= VOL_POPULATE;
+    if (cache != NULL && *cache != '\0')
     {
-	return FALSE;
+	unsigned long long n = strtoull(cache, &end, 10);
+
+	switch (*end)
+	{
+	case 'G': case 'g': n <<= 10;	/* fall through */
+	case 'M': case 'm': n <<= 10;	/* fall through */
+	case 'K': case 'k': n <<= 10;
+	}
+	opts->cache_size = n;
     }
 }
 
+/* open_volume opens a disk image the way the environment says to (see
+   volopts_init), for reading and writing */
+struct dosvol *open_volume(char *filename)
+{
+    struct volopts opts;
+
+    volopts_init(&opts);
+    return open_volume_opts(filename, &opts);
+}
+
+/* open_volume_rdonly opens a disk image just for reading; nothing is
+   ever written back to it */
+struct dosvol *open_volume_rdonly(char *filename)
+{
+    struct volopts opts;
+
+    volopts_init(&opts);
+    opts.flags |= VOL_RDONLY;
+    return open_volume_opts(filename, &opts);
+}
+
+/* open_volume_opts opens a disk image through the backend in opts,
+   decodes its boot sector and FAT, and returns a handle that the rest
+   of dos.c works on.  Returns NULL if the image can't be opened. */
+struct dosvol *open_volume_opts(char *filename, struct volopts *opts)
+{
+    struct dosvol *vol;
+
+    vol = calloc(1, sizeof(struct dosvol));
+    if (vol == NULL)
+    {
+	fprintf(stderr, "Out of memory opening %s\n", filename);
+	return NULL;
+    }
+    vol->flags = opts->flags;
+
+    if (opts->backend == VOL_PREAD)
+    {
+	if (open_image(filename, opts->flags, &vol->fd, &vol->size) < 0)
+	{
+	    free(vol);
+	    return NULL;
+	}
+	if (blk_init(vol, opts->cache_size) < 0)
+	{
+	    fprintf(stderr, "Out of memory opening %s\n", filename);
+	    close(vol->fd);
+	    free(vol);
+	    return NULL;
+	}
+    }
+    else
+    {
+	vol->image = mmap_file(filename, opts->flags, &vol->fd, &vol->size);
+	if (vol->image == NULL)
+	{
+	    free(vol);
+	    return NULL;
+	}
+    }
+
+    /* decode the FAT once, so that chain walks don't have to */
+    if (check_bootsector(vol) < 0 || load_fat(vol) < 0)
+    {
+	release_image(vol);
+	free(vol);
+	return NULL;
+    }
+    DOS_PROBE4(volume_open, vol, filename, vol->size, vol->fat_type);
+    return vol;
+}
+
+
+/* release_image lets go of the image, through whichever backend it
+   was opened with */
+static void release_image(struct dosvol *vol)
+{
+    if (vol->image != NULL)
+	unmmap_file(vol->image, vol->size, vol->fd);
+    else
+    {
+	blk_close(vol);
+	close(vol->fd);
+    }
+}
+
+
+/* close_volume writes back any FAT changes and releases everything
+   open_volume allocated.  A read only volume is never written to, even
+   if the FAT was changed in memory. */
+void close_volume(struct dosvol *vol)
+{
+    DOS_PROBE1(volume_close, vol);
+    if (!(vol->flags & VOL_RDONLY))
+	flush_fat(vol);
+    free_fat(vol);
+    free_dirindexes(vol);
+    free_chainindexes(vol);
+    release_image(vol);
+    free(vol);
+}
+
 
-/* root_dir_addr returns the address in the mmapped disk image for the
-   start of the root directory, as indicated in the boot sector */
-uint8_t *root_dir_addr(uint8_t *image_buf, struct bpb33* bpb)
+/* format_volume makes filename an empty FAT filesystem of sectors 512
+   byte sectors, with sec_per_clust sectors to a cluster, and an
+   optional volume label.  The file is created if need be and cut or
+   grown to size; everything but the boot sector, FSInfo, the first FAT
+   entries and the label is left as a hole.  fat_type has to agree with
+   the cluster count, because that is how check_bootsector() tells the
+   types apart.  Returns -1 if it can't be done. */
+int format_volume(char *filename, int fat_type, uint32_t sectors,
+		  int sec_per_clust, const char *label)
 {
-    uint32_t offset;
-    offset = 
-	(bpb->bpbBytesPerSec 
-	 * (bpb->bpbResSectors + (bpb->bpbFATs * bpb->bpbFATsecs)));
-    return image_buf + offset;
+    /* media byte and end of chain marks for entries 0 and 1, and the
+       FAT32 root directory's cluster 2 */
+    static const uint8_t fat12_head[] = { 0xf8, 0xff, 0xff };
+    static const uint8_t fat16_head[] = { 0xf8, 0xff, 0xff, 0xff };
+    static const uint8_t fat32_head[] = { 0xf8, 0xff, 0xff, 0x0f,
+					  0xff, 0xff, 0xff, 0x0f,
+					  0xff, 0xff, 0xff, 0x0f };
+    uint32_t bps = 512;
+    uint32_t res = fat_type == 32 ? 32 : 1;
+    uint32_t nfats = 2;
+    uint32_t rootents = fat_type == 32 ? 0 : 512;
+    uint32_t rootsecs = rootents * sizeof(struct direntry) / bps;
+    uint32_t fatsecs = 1, nclusters, copy;
+    const uint8_t *head;
+    size_t headlen;
+    uint8_t boot[512];
+    struct bootsector710 *bs = (struct bootsector710 *)boot;
+    struct byte_bpb710 *bpb = (struct byte_bpb710 *)bs->bsBPB;
+    off_t data_offset;
+    int fd, ok = 1;
+
+    if (sec_per_clust <= 0 || sec_per_clust > 128
+	|| (sec_per_clust & (sec_per_clust - 1)) != 0)
+    {
+	fprintf(stderr, "%d sectors per cluster is not a power of two\n",
+		sec_per_clust);
+	return -1;
+    }
+
+    /* the FAT has to cover the clusters that are left over once it
+       and the root directory are taken out, so grow it until it does */
+    for (;;)
+    {
+	if (res + nfats * fatsecs + rootsecs >= sectors)
+	{
+	    fprintf(stderr, "%u sectors is too small for FAT%d\n",
+		    sectors, fat_type);
+	    return -1;
+	}
+	nclusters = (sectors - res - nfats * fatsecs - rootsecs)
+	    / sec_per_clust;
+	if (((uint64_t)(nclusters + CLUST_FIRST) * fat_type + 7) / 8
+	    <= (uint64_t)fatsecs * bps)
+	    break;
+	fatsecs++;
+    }
+    if ((fat_type == 12 && nclusters >= 4085)
+	|| (fat_type == 16 && (nclusters < 4085 || nclusters >= 65525))
+	|| (fat_type == 32 && nclusters < 65525)
+	|| (fat_type != 12 && fat_type != 16 && fat_type != 32))
+    {
+	fprintf(stderr, "%u clusters can't be FAT%d\n", nclusters, fat_type);
+	return -1;
+    }
+
+    fd = open(filename, O_RDWR | O_CREAT | O_TRUNC, 0666);
+    if (fd < 0)
+    {
+	fprintf(stderr, "Could not create %s: %s\n", filename,
+		strerror(errno));
+	return -1;
+    }
+    if (ftruncate(fd, (off_t)sectors * bps) < 0)
+    {
+	fprintf(stderr, "Could not size %s: %s\n", filename, strerror(errno));
+	close(fd);
+	return -1;
+    }
+
+    memset(boot, 0, sizeof(boot));
+    bs->bsJump[0] = 0xeb;
+    bs->bsJump[1] = 0x3c;
+    bs->bsJump[2] = 0x90;
+    memcpy(bs->bsOEMName, "DOSVOL  ", 8);
+    putushort(bpb->bpbBytesPerSec, bps);
+    bpb->bpbSecPerClust = sec_per_clust;
+    putushort(bpb->bpbResSectors, res);
+    bpb->bpbFATs = nfats;
+    putushort(bpb->bpbRootDirEnts, rootents);
+    bpb->bpbMedia = 0xf8;
+    putushort(bpb->bpbSecPerTrack, 32);
+    putushort(bpb->bpbHeads, 64);
+    if (sectors < 65536 && fat_type != 32)
+	putushort(bpb->bpbSectors, sectors);
+    else
+	putulong(bpb->bpbHugeSectors, sectors);
+    if (fat_type == 32)
+    {
+	putulong(bpb->bpbBigFATsecs, fatsecs);
+	putulong(bpb->bpbRootClust, CLUST_FIRST);
+	putushort(bpb->bpbFSInfo, 1);
+	head = fat32_head;
+	headlen = sizeof(fat32_head);
+    }
+    else
+    {
+	putushort(bpb->bpbFATsecs, fatsecs);
+	head = fat_type == 12 ? fat12_head : fat16_head;
+	headlen = fat_type == 12 ? sizeof(fat12_head) : sizeof(fat16_head);
+    }
+    bs->bsBootSectSig0 = BOOTSIG0;
+    bs->bsBootSectSig1 = BOOTSIG1;
+    ok = pwrite_full(fd, boot, sizeof(boot), 0) == 0;
+
+    if (ok && fat_type == 32)
+    {
+	struct fsinfo fsi;
+
+	/* one cluster, the root directory, is in use */
+	memset(&fsi, 0, sizeof(fsi));
+	memcpy(fsi.fsisig1, "RRaA", 4);
+	memcpy(fsi.fsisig2, "rrAa", 4);
+	putulong(fsi.fsinfree, nclusters - 1);
+	putulong(fsi.fsinxtfree, CLUST_FIRST + 1);
+	fsi.fsisig3[2] = fsi.fsisig4[2] = BOOTSIG0;
+	fsi.fsisig3[3] = fsi.fsisig4[3] = BOOTSIG1;
+	ok = pwrite_full(fd, (uint8_t *)&fsi, sizeof(fsi), bps) == 0;
+    }
+
+    for (copy = 0; ok && copy < nfats; copy++)
+	ok = pwrite_full(fd, head, headlen,
+			 (off_t)(res + copy * fatsecs) * bps) == 0;
+
+    data_offset = (off_t)(res + nfats * fatsecs) * bps;
+    if (ok && label != NULL && *label != '\0')
+    {
+	struct direntry dirent;
+	size_t len = strlen(label);
+
+	/* the label runs on from the name into the extension */
+	memset(&dirent, 0, sizeof(dirent));
+	memset(dirent.deName, ' ', sizeof(dirent.deName));
+	memset(dirent.deExtension, ' ', sizeof(dirent.deExtension));
+	memcpy(dirent.deName, label, len > 8 ? 8 : len);
+	if (len > 8)
+	    memcpy(dirent.deExtension, label + 8, len > 11 ? 3 : len - 8);
+	dirent.deAttributes = ATTR_VOLUME;
+	ok = pwrite_full(fd, (uint8_t *)&dirent, sizeof(dirent),
+			 data_offset) == 0;
+    }
+
+    if (!ok)
+	fprintf(stderr, "Could not write %s: %s\n", filename, strerror(errno));
+    if (close(fd) < 0)
+	ok = 0;
+    return ok ? 0 : -1;
 }
 
 
-/* cluster_to_addr returns the memory location where the memory mapped
-   cluster actually starts */
-uint8_t *cluster_to_addr(uint16_t cluster, uint8_t *image_buf, 
-			 struct bpb33* bpb)
+/* The FAT is decoded once into vol->fat when the volume is opened,
+   and every lookup is served from there.  set_fat_entry() only
+   touches the cache and marks the pair of entries it changed as dirty
+   (a pair is the natural unit for FAT-12, which packs two entries
+   into three bytes); flush_fat() encodes the dirty pairs back into
+   every copy of the FAT on disk. */
+
+/* fat_write stores value into entry n of the on-disk FAT at fat */
+static void fat_write(struct dosvol *vol, uint8_t *fat, uint32_t n, 
+		      uint32_t value)
 {
     uint8_t *p;
-    p = root_dir_addr(image_buf, bpb);
-    if (cluster != MSDOSFSROOT) 
+
+    switch (vol->fat_type)
+    {
+    case 12:
+	/* this involves some really ugly bit shifting.  This probably
+	   only works on a little-endian machine. */
+	p = fat + 3 * (n/2);
+	if (n % 2 == 0)
+	{
+	    /* mjh: little-endian CPUs are really ugly! */
+	    p[0] = (uint8_t)(0xff & value);
+	    p[1] = (uint8_t)((0xf0 & p[1]) | (0x0f & (value >> 8)));
+	}
+	else
+	{
+	    p[1] = (uint8_t)((0x0f & p[1]) | ((0x0f & value) << 4));
+	    p[2] = (uint8_t)(0xff & (value >> 4));
+	}
+	break;
+    case 16:
+	putushort(fat + 2 * n, value);
+	break;
+    default:
+	value = (getulong(fat + 4 * n) & ~FAT32_MASK) | (value & FAT32_MASK);
+	putulong(fat + 4 * n, value);
+	break;
+    }
+}
+
+
+static int load_fat(struct dosvol *vol)
+{
+    uint8_t *base, *fat;
+    uint32_t i;
+
+    if (vol->fat_offset + vol->fat_size > vol->size)
+    {
+	fprintf(stderr, "FAT extends past the end of the disk image\n");
+	return -1;
+    }
+    fat = base = vol_map(vol, vol->fat_offset, vol->fat_size);
+
+    /* round down to a whole number of pairs */
+    vol->fat_entries = (vol->fat_size * 8 / vol->fat_type) & ~1u;
+    vol->fat = malloc(vol->fat_entries * sizeof(uint32_t));
+    vol->fat_dirty = calloc(vol->fat_entries / 2 + 1, 1);
+    if (vol->fat == NULL || vol->fat_dirty == NULL)
+    {
+	fprintf(stderr, "Out of memory decoding the FAT\n");
+	free_fat(vol);
+	vol_release(vol, base);
+	return -1;
+    }
+
+    switch (vol->fat_type)
+    {
+    case 12:
+	/* unpack two entries from every three bytes */
+	for (i = 0; i < vol->fat_entries; i += 2, fat += 3)
+	{
+	    vol->fat[i] = ((0x0f & fat[1]) << 8) | fat[0];
+	    vol->fat[i+1] = fat[2] << 4 | ((0xf0 & fat[1]) >> 4);
+	}
+	break;
+    case 16:
+	for (i = 0; i < vol->fat_entries; i++, fat += 2)
+	    vol->fat[i] = getushort(fat);
+	break;
+    default:
+	for (i = 0; i < vol->fat_entries; i++, fat += 4)
+	    vol->fat[i] = getulong(fat) & FAT32_MASK;
+	break;
+    }
+    vol_release(vol, base);
+
+    vol->dirty_lo = vol->fat_entries / 2;
+    vol->dirty_hi = 0;
+    return 0;
+}
+
+
+/* flush_fat writes any entries changed by set_fat_entry back into
+   every copy of the FAT in the disk image */
+static void flush_fat(struct dosvol *vol)
+{
+    uint32_t pair, copy, ncopies;
+    uint8_t *fat;
+    int changed = 0;
+
+    if (vol->fat == NULL)
+	return;
+
+    /* FAT32 can turn mirroring off, in which case fat_offset already
+       points at the one active copy */
+    ncopies = vol->bpb.bpbFATs;
+    if (vol->fat_type == 32 && (vol->bpb.bpbExtFlags & FATMIRROR))
+	ncopies = 1;
+
+    if (vol->dirty_lo > vol->dirty_hi)
+	return;
+    for (copy = 0; copy < ncopies; copy++)
+    {
+	off_t offset = vol->fat_offset + (off_t)copy * vol->fat_size;
+
+	if (offset + vol->fat_size > vol->size)
+	    break;
+	fat = vol_map(vol, offset, vol->fat_size);
+	for (pair = vol->dirty_lo; pair <= vol->dirty_hi; pair++)
+	{
+	    if (!vol->fat_dirty[pair])
+		continue;
+	    fat_write(vol, fat, 2*pair, vol->fat[2*pair]);
+	    fat_write(vol, fat, 2*pair + 1, vol->fat[2*pair + 1]);
+	    changed = 1;
+	}
+	vol_release(vol, fat);
+    }
+    for (pair = vol->dirty_lo; pair <= vol->dirty_hi; pair++)
+	vol->fat_dirty[pair] = 0;
+    vol->dirty_lo = vol->fat_entries / 2;
+    vol->dirty_hi = 0;
+
+    /* the FAT32 free cluster count is only a hint, so mark it unknown
+       rather than keep track of it */
+    if (changed && vol->fat_type == 32 && vol->bpb.bpbFSInfo != 0)
+    {
+	off_t offset = (off_t)vol->bpb.bpbFSInfo * vol->bpb.bpbBytesPerSec;
+	struct fsinfo *fsi;
+	uint32_t unknown = 0xffffffff;
+
+	if (offset + sizeof(struct fsinfo) <= vol->size)
+	{
+	    fsi = (struct fsinfo *)vol_map(vol, offset, sizeof(struct fsinfo));
+	    if (memcmp(fsi->fsisig1, "RRaA", 4) == 0)
+		putulong(fsi->fsinfree, unknown);
+	    vol_release(vol, fsi);
+	}
+    }
+}
+
+
+static void free_fat(struct dosvol *vol)
+{
+    free(vol->fat);
+    free(vol->fat_dirty);
+    free(vol->freemap);
+    vol->fat = NULL;
+    vol->fat_dirty = NULL;
+    vol->freemap = NULL;
+    vol->fat_entries = 0;
+}
+
+
+/* get_fat_entry returns the value from the FAT entry for
+   clusternum. */
+uint32_t get_fat_entry(uint32_t clusternum, struct dosvol *vol)
+{
+    STATS_ADD(fat_reads, 1);
+    if (clusternum < vol->fat_entries)
+	return vol->fat[clusternum];
+
+    /* past the end of the FAT - treat it as the end of the chain */
+    return vol->fat_mask & CLUST_EOFS;
+}
+
+
+/* set_fat_entry sets the value of the FAT entry for clusternum to
+   value.  The change reaches the disk image when the volume is
+   closed. */
+void set_fat_entry(uint32_t clusternum, uint32_t value, struct dosvol *vol)
+{
+    uint32_t pair;
+
+    STATS_ADD(fat_writes, 1);
+    if (clusternum >= vol->fat_entries)
+    {
+	fprintf(stderr, "FAT entry %u is out of range\n", clusternum);
+	return;
+    }
+
+    vol->fat[clusternum] = value & vol->fat_mask;
+    vol->fat_generation++;	/* chain indexes may now be stale */
+
+    /* keep the free cluster bitmap in step, if we've built it */
+    if (vol->freemap != NULL && clusternum < vol->max_cluster)
+    {
+	if (vol->fat[clusternum] == CLUST_FREE)
+	    vol->freemap[clusternum / 64] |= 1ULL << (clusternum % 64);
+	else
+	    vol->freemap[clusternum / 64] &= ~(1ULL << (clusternum % 64));
+    }
+
+    pair = clusternum / 2;
+    vol->fat_dirty[pair] = 1;
+    if (pair < vol->dirty_lo)
+	vol->dirty_lo = pair;
+    if (pair > vol->dirty_hi)
+	vol->dirty_hi = pair;
+}
+
+
+/* The free cluster bitmap is built from the decoded FAT the first
+   time something is allocated, and set_fat_entry() keeps it up to
+   date from then on.  Searching it a 64-bit word at a time is what
+   keeps allocation from being a scan of the whole FAT per cluster. */
+
+static int build_freemap(struct dosvol *vol)
+{
+    uint32_t words = (vol->max_cluster + 63) / 64;
+    uint32_t i;
+
+    vol->freemap = calloc(words ? words : 1, sizeof(uint64_t));
+    if (vol->freemap == NULL)
+	return -1;
+
+    for (i = CLUST_FIRST; i < vol->max_cluster && i < vol->fat_entries; i++)
+	if (vol->fat[i] == CLUST_FREE)
+	    vol->freemap[i / 64] |= 1ULL << (i % 64);
+
+    vol->free_hint = CLUST_FIRST;
+    return 0;
+}
+
+
+/* find_free returns the first free cluster at or after from, or 0 if
+   there isn't one */
+static uint32_t find_free(struct dosvol *vol, uint32_t from)
+{
+    uint32_t words = (vol->max_cluster + 63) / 64;
+    uint32_t w = from / 64;
+    uint64_t bits;
+
+    if (from >= vol->max_cluster)
+	return 0;
+
+    /* ignore the clusters before from in the first word */
+    bits = vol->freemap[w] & (~0ULL << (from % 64));
+    while (bits == 0)
+    {
+	if (++w >= words)
+	    return 0;
+	bits = vol->freemap[w];
+    }
+    return w * 64 + __builtin_ctzll(bits);
+}
+
+
+/* find_used returns the first cluster at or after from that is not
+   free, or to if they all are up to there.  to is at most
+   max_cluster; it keeps a short allocation from scanning all of a
+   long free run. */
+static uint32_t find_used(struct dosvol *vol, uint32_t from, uint32_t to)
+{
+    uint32_t words = (to + 63) / 64;
+    uint32_t w = from / 64;
+    uint64_t bits;
+
+    if (from >= to)
+	return to;
+
+    bits = ~vol->freemap[w] & (~0ULL << (from % 64));
+    while (bits == 0)
+    {
+	if (++w >= words)
+	    return to;
+	bits = ~vol->freemap[w];
+    }
+    from = w * 64 + __builtin_ctzll(bits);
+    return from < to ? from : to;
+}
+
+
+/* reserve marks n clusters from cluster onwards as the end of a
+   chain, taking them out of the free map */
+static void reserve(struct dosvol *vol, uint32_t cluster, uint32_t n)
+{
+    uint32_t i;
+
+    for (i = 0; i < n; i++)
+	set_fat_entry(cluster + i, vol->fat_mask & CLUST_EOFS, vol);
+}
+
+
+/* alloc_run reserves up to want free clusters, preferring a run of
+   consecutive ones.  The search carries on from where the previous
+   one stopped, wrapping round to the start of the volume.  Each
+   cluster handed out is marked as the end of a chain in the FAT, so
+   the caller only needs to link them up.  Returns the first cluster
+   and stores the length of the run in *got, or returns 0 if the
+   volume is full. */
+uint32_t alloc_run(struct dosvol *vol, uint32_t want, uint32_t *got)
+{
+    uint32_t cluster, n = 0;
+
+    *got = 0;
+    if (vol->freemap == NULL && build_freemap(vol) < 0)
+    {
+	fprintf(stderr, "Out of memory building the free cluster map\n");
+	return 0;
+    }
+
+    cluster = find_free(vol, vol->free_hint);
+    if (cluster == 0)
+	cluster = find_free(vol, CLUST_FIRST);
+    if (cluster == 0)
+	return 0;
+
+    n = find_used(vol, cluster, want < vol->max_cluster - cluster 
+		  ? cluster + want : vol->max_cluster) - cluster;
+    reserve(vol, cluster, n);
+
+    vol->free_hint = cluster + n;
+    *got = n;
+    return cluster;
+}
+
+
+/* alloc_extent reserves want consecutive clusters, taking them from
+   the smallest free run that is big enough so the big runs are kept
+   for big files.  If no run is long enough it hands out the longest
+   one there is, and the caller asks again for the rest.  Like
+   alloc_run, it returns the first cluster and stores the number of
+   clusters in *got, or returns 0 if the volume is full. */
+uint32_t alloc_extent(struct dosvol *vol, uint32_t want, uint32_t *got)
+{
+    uint32_t cluster, end;
+    uint32_t best = 0, best_len = 0;
+    uint32_t longest = 0, longest_len = 0;
+
+    *got = 0;
+    if (vol->freemap == NULL && build_freemap(vol) < 0)
+    {
+	fprintf(stderr, "Out of memory building the free cluster map\n");
+	return 0;
+    }
+
+    /* visit every run of free clusters once */
+    for (cluster = find_free(vol, CLUST_FIRST); cluster != 0; 
+	 cluster = find_free(vol, end))
+    {
+	end = find_used(vol, cluster, vol->max_cluster);
+	if (end - cluster >= want && (best == 0 || end - cluster < best_len))
+	{
+	    best = cluster;
+	    best_len = end - cluster;
+	    if (best_len == want)
+		break;		/* can't do better than an exact fit */
+	}
+	if (end - cluster > longest_len)
+	{
+	    longest = cluster;
+	    longest_len = end - cluster;
+	}
+    }
+
+    if (best == 0)
+    {
+	best = longest;
+	want = longest_len;
+    }
+    if (best == 0)
+	return 0;
+
+    reserve(vol, best, want);
+    *got = want;
+    return best;
+}
+
+
+/* get_extents resolves the cluster chain starting at cluster into runs
+   of physically consecutive clusters, stopping at the end of the
+   chain or once max_clusters clusters have been found.  The runs are
+   returned in a malloc'd array in *extents, which the caller frees,
+   and the number of runs is returned.  Returns -1 if we run out of
+   memory. */
+int get_extents(uint32_t cluster, uint32_t max_clusters, 
+		struct dosvol *vol, struct extent **extents)
+{
+    struct extent *ext = NULL, *tmp;
+    int n = 0, space = 0;
+    uint32_t found = 0, start = cluster;
+
+    /* a chain can't be longer than the volume, even if the FAT has a
+       loop in it */
+    if (max_clusters == 0 || max_clusters > vol->max_cluster)
+	max_clusters = vol->max_cluster;
+
+    DOS_PROBE2(chain_start, vol, start);
+    while (is_valid_cluster(cluster, vol) && found < max_clusters)
+    {
+	if (n > 0 && ext[n-1].start + ext[n-1].count == cluster)
+	{
+	    /* physically follows the previous cluster */
+	    ext[n-1].count++;
+	}
+	else
+	{
+	    if (n == space)
+	    {
+		space = space ? space * 2 : 16;
+		tmp = realloc(ext, space * sizeof(struct extent));
+		if (tmp == NULL)
+		{
+		    free(ext);
+		    return -1;
+		}
+		ext = tmp;
+	    }
+	    ext[n].start = cluster;
+	    ext[n].count = 1;
+	    n++;
+	}
+	found++;
+	cluster = get_fat_entry(cluster, vol);
+    }
+    STATS_ADD(cluster_hops, found);
+    DOS_PROBE3(chain_end, vol, start, found);
+
+    *extents = ext;
+    return n;
+}
+
+
+/* is_end_of_file returns true if the FAT entry for cluster indicates
+   this is the last cluster in a file */
+int is_end_of_file(uint32_t cluster, struct dosvol *vol) 
+{
+    if (cluster >= (vol->fat_mask & CLUST_EOFS) && 
+        cluster <= (vol->fat_mask & CLUST_EOFE)) 
+    {
+	return TRUE;
+    } 
+    else 
+    {
+	return FALSE;
+    }
+}
+
+
+/* The chain index.  Finding the cluster that holds a byte in the
+   middle of a file means following the chain from its start, one FAT
+   lookup per cluster.  Instead, the first seek into a chain records
+   every CHAIN_STRIDE'th cluster it passes in a sparse index, cached
+   on the volume by the chain's first cluster, so a later seek is one
+   array lookup plus at most CHAIN_STRIDE - 1 hops.  The index is only
+   built as far as a seek has gone, and is thrown away whenever the
+   FAT changes. */
+
+#define CHAIN_STRIDE 64		/* clusters between index marks */
+#define CHAININDEX_SLOTS 64	/* chains cached per volume */
+
+struct chainindex {
+    uint32_t start;		/* first cluster of the chain */
+    uint32_t generation;	/* vol->fat_generation it was built at */
+    uint32_t *marks;		/* marks[i] is CHAIN_STRIDE * i hops on */
+    uint32_t nmarks, space;
+    int complete;		/* the chain ends before the next mark */
+};
+
+/* get_chainindex returns the cached index of the chain starting at
+   cluster, starting a new one if it isn't cached or is stale.  Chains
+   share a small direct mapped table, so a new chain evicts whatever
+   was in its slot.  Returns NULL if we run out of memory. */
+static struct chainindex *get_chainindex(uint32_t cluster, 
+					 struct dosvol *vol)
+{
+    struct chainindex *index;
+    uint32_t slot;
+
+    if (vol->chainindex == NULL)
+    {
+	vol->chainindex = calloc(CHAININDEX_SLOTS, 
+				 sizeof(struct chainindex *));
+	if (vol->chainindex == NULL)
+	    return NULL;
+    }
+
+    slot = (cluster * 2654435761u) >> 26;	/* top 6 bits */
+    index = vol->chainindex[slot];
+    if (index != NULL && index->nmarks > 0 && index->start == cluster 
+	&& index->generation == vol->fat_generation)
+	return index;
+
+    if (index == NULL)
+    {
+	index = calloc(1, sizeof(struct chainindex));
+	if (index == NULL)
+	    return NULL;
+	vol->chainindex[slot] = index;
+    }
+
+    /* get the marks before the index claims the chain, so a failure
+       can't leave it matching with nothing in it */
+    if (index->space == 0)
+    {
+	index->marks = malloc(16 * sizeof(uint32_t));
+	if (index->marks == NULL)
+	    return NULL;
+	index->space = 16;
+    }
+    index->start = cluster;
+    index->generation = vol->fat_generation;
+    index->nmarks = 0;
+    index->complete = 0;
+    index->marks[index->nmarks++] = cluster;
+    return index;
+}
+
+/* extend_chainindex follows the chain on from the last mark until
+   there is a mark for want, or the chain ends.  A chain can't be
+   longer than the volume, which stops us going round a loop in the
+   FAT forever. */
+static int extend_chainindex(struct chainindex *index, uint32_t want,
+			     struct dosvol *vol)
+{
+    uint32_t cluster, i, *tmp;
+    uint32_t limit = vol->max_cluster / CHAIN_STRIDE + 1;
+
+    while (index->nmarks <= want && !index->complete)
     {
-	/* move to the end of the root directory */
-	p += bpb->bpbRootDirEnts * sizeof(struct direntry);
+	if (index->nmarks >= limit)
+	{
+	    index->complete = 1;
+	    break;
+	}
+
+	cluster = index->marks[index->nmarks - 1];
+	for (i = 0; i < CHAIN_STRIDE && is_valid_cluster(cluster, vol); i++)
+	    cluster = get_fat_entry(cluster, vol);
+	STATS_ADD(cluster_hops, i);
+	if (!is_valid_cluster(cluster, vol))
+	{
+	    index->complete = 1;
+	    break;
+	}
 
-	/* move forward the right number of clusters */
-	p += bpb->bpbBytesPerSec * bpb->bpbSecPerClust * (cluster - CLUST_FIRST);
+	if (index->nmarks == index->space)
+	{
+	    tmp = realloc(index->marks, 
+			  index->space * 2 * sizeof(uint32_t));
+	    if (tmp == NULL)
+		return -1;
+	    index->marks = tmp;
+	    index->space *= 2;
+	}
+	index->marks[index->nmarks++] = cluster;
     }
-    return p;
+    return 0;
 }
 
+/* chain_seek returns the cluster n hops along the chain that starts
+   at cluster, or CLUST_FREE if the chain ends first.  Short seeks
+   just walk the chain; longer ones go through the chain index. */
+uint32_t chain_seek(uint32_t cluster, uint32_t n, struct dosvol *vol)
+{
+    struct chainindex *index;
+    uint32_t mark;
+
+    if (!is_valid_cluster(cluster, vol))
+	return CLUST_FREE;
+
+    if (n >= CHAIN_STRIDE)
+    {
+	index = get_chainindex(cluster, vol);
+	if (index != NULL && extend_chainindex(index, n / CHAIN_STRIDE, 
+					       vol) == 0)
+	{
+	    mark = n / CHAIN_STRIDE;
+	    if (mark >= index->nmarks)
+		return CLUST_FREE;
+	    cluster = index->marks[mark];
+	    n -= mark * CHAIN_STRIDE;
+	}
+	/* otherwise fall back on walking the whole way */
+    }
+
+    while (n > 0 && is_valid_cluster(cluster, vol))
+    {
+	cluster = get_fat_entry(cluster, vol);
+	STATS_ADD(cluster_hops, 1);
+	n--;
+    }
+    return is_valid_cluster(cluster, vol) ? cluster : CLUST_FREE;
+}
+
+/* get_range resolves the part of a file holding length bytes from
+   offset into runs of consecutive clusters, like get_extents().  The
+   first run starts with the cluster holding offset, so the range
+   begins offset % cluster_size bytes into it.  The chain is only
+   followed as far as the range needs.  Returns the number of runs,
+   which is 0 if the chain ends before offset, or -1 if we run out of
+   memory. */
+int get_range(uint32_t cluster, uint32_t offset, uint32_t length,
+	      struct dosvol *vol, struct extent **extents)
+{
+    uint32_t skip, lead;
+
+    if (vol->cluster_shift >= 0)
+	skip = offset >> vol->cluster_shift;
+    else
+	skip = offset / vol->cluster_size;
+    lead = offset - skip * vol->cluster_size;
+
+    *extents = NULL;
+    cluster = chain_seek(cluster, skip, vol);
+    if (cluster == CLUST_FREE || length == 0)
+	return 0;
+    return get_extents(cluster, clusters_for_size((uint64_t)lead + length, vol),
+		       vol, extents);
+}
+
+/* free_chainindexes releases the volume's cached chain indexes */
+static void free_chainindexes(struct dosvol *vol)
+{
+    uint32_t i;
+
+    if (vol->chainindex == NULL)
+	return;
+    for (i = 0; i < CHAININDEX_SLOTS; i++)
+    {
+	if (vol->chainindex[i] != NULL)
+	{
+	    free(vol->chainindex[i]->marks);
+	    free(vol->chainindex[i]);
+	}
+    }
+    free(vol->chainindex);
+    vol->chainindex = NULL;
+}
+
+
+/* The directory index.  Finding a name by scanning the directory costs
+   a pass over every entry, for every component of every path looked
+   up.  dir_lookup() instead hashes a directory the first time it is
+   asked about it, keyed by the upper-cased 8.3 name and by the long
+   name if there is one, and answers every later lookup in that
+   directory from the hash.  The indexes hang off the volume, found by
+   the directory's first cluster.  Anything that adds an entry to a
+   directory must tell dir_insert() about it, and anything else that
+   changes a directory must call dir_invalidate() for it.  None of this
+   is thread safe. */
+
+#define DIRINDEX_BUCKETS 64	/* initial size of vol->dirindex */
+#define KEY_MAX (WIN_MAXLEN * 3)	/* longest key, in UTF-8 bytes */
+
+struct dirslot {
+    uint32_t hash;
+    uint32_t name;		/* offset of the key in names */
+    struct direntry *dirent;	/* NULL if the slot is empty */
+};
+
+struct dirindex {
+    uint32_t cluster;		/* first cluster of the directory */
+    struct dirindex *next;	/* next index in the same bucket */
+    struct dirslot *slots;
+    uint32_t mask;		/* number of slots - 1 */
+    uint32_t used;		/* slots in use */
+    char *names;		/* the keys, end to end */
+    size_t namelen, namespace;	/* bytes of names used and allocated */
+};
+
+/* the keys of a directory while its index is being built; each holds
+   its entry in place */
+struct dirkeys {
+    struct dirslot *keys;
+    uint32_t nkeys, keyspace;
+    char *names;
+    size_t namelen, namespace;
+    struct dosvol *vol;
+};
+
+static uint32_t name_hash(const char *name, size_t len)
+{
+    uint32_t hash = 2166136261u;	/* FNV-1a */
+
+    while (len-- > 0)
+    {
+	hash ^= (uint8_t)*name++;
+	hash *= 16777619;
+    }
+    return hash;
+}
+
+/* fold_name turns a name into a key: trailing dots and spaces go, as
+   they do when DOS makes a name, and ASCII letters are upper-cased.
+   It returns the length of the key, or 0 if there is no valid key */
+static size_t fold_name(const char *name, size_t len, char *key)
+{
+    size_t i;
+
+    /* except for the "." and ".." entries themselves */
+    if (!((len == 1 || len == 2) && strncmp(name, "..", len) == 0))
+	while (len > 0 && (name[len - 1] == '.' || name[len - 1] == ' '))
+	    len--;
+    if (len > KEY_MAX)
+	return 0;
+    for (i = 0; i < len; i++)
+	key[i] = (name[i] >= 'a' && name[i] <= 'z') ? name[i] - 'a' + 'A' 
+	    : name[i];
+    key[len] = '\0';
+    return len;
+}
+
+/* short_name writes the 8.3 name of dirent as NAME.EXT, or NAME if the
+   extension is blank, lower-casing the parts NT says to */
+static size_t short_name(struct direntry *dirent, char *name)
+{
+    size_t n = 8, e = 3, len, i;
+
+    while (n > 0 && dirent->deName[n - 1] == ' ')
+	n--;
+    while (e > 0 && dirent->deExtension[e - 1] == ' ')
+	e--;
+    memcpy(name, dirent->deName, n);
+    if (n > 0 && (uint8_t)name[0] == SLOT_E5)
+	name[0] = (char)SLOT_DELETED;
+    if (dirent->deLowerCase & LCASE_BASE)
+	for (i = 0; i < n; i++)
+	    name[i] = tolower((uint8_t)name[i]);
+    len = n;
+    if (e > 0)
+    {
+	name[len++] = '.';
+	memcpy(name + len, dirent->deExtension, e);
+	if (dirent->deLowerCase & LCASE_EXT)
+	    for (i = len; i < len + e; i++)
+		name[i] = tolower((uint8_t)name[i]);
+	len += e;
+    }
+    name[len] = '\0';
+    return len;
+}
+
+/* short_key writes the key for the 8.3 name of dirent */
+static size_t short_key(struct direntry *dirent, char *key)
+{
+    size_t len = short_name(dirent, key);
+
+    return fold_name(key, len, key);
+}
+
+/* short_name_sum is the checksum of the 8.3 name that every part of
+   its long name carries */
+static uint8_t short_name_sum(struct direntry *dirent)
+{
+    uint8_t sum = 0;
+    int i;
+
+    for (i = 0; i < 8; i++)
+	sum = ((sum & 1) << 7) + (sum >> 1) + dirent->deName[i];
+    for (i = 0; i < 3; i++)
+	sum = ((sum & 1) << 7) + (sum >> 1) + dirent->deExtension[i];
+    return sum;
+}
+
+/* long_name converts the UCS-2 long name in chars to UTF-8, stopping
+   at WIN_MAXLEN characters */
+static size_t long_name(uint16_t *chars, int nchars, char *name)
+{
+    size_t len = 0;
+    int i;
+
+    if (nchars > WIN_MAXLEN)
+	nchars = WIN_MAXLEN;
+    for (i = 0; i < nchars && chars[i] != 0 && chars[i] != 0xffff; i++)
+    {
+	uint16_t c = chars[i];
+
+	if (c < 0x80)
+	{
+	    name[len++] = c;
+	}
+	else if (c < 0x800)
+	{
+	    name[len++] = 0xc0 | (c >> 6);
+	    name[len++] = 0x80 | (c & 0x3f);
+	}
+	else
+	{
+	    name[len++] = 0xe0 | (c >> 12);
+	    name[len++] = 0x80 | ((c >> 6) & 0x3f);
+	    name[len++] = 0x80 | (c & 0x3f);
+	}
+    }
+    name[len] = '\0';
+    return len;
+}
+
+/* read_entries does the work of dir_read(), below */
+static int read_entries(uint32_t cluster, dir_visitor visit, void *arg, 
+			struct dosvol *vol)
+{
+    uint16_t lname[(WIN_CNT + 1) * WIN_CHARS];
+    int lfn_next = 0;		/* sequence number of the part expected next */
+    int lfn_parts = 0;		/* parts in the long name being collected */
+    uint8_t lfn_sum = 0;
+    char name[KEY_MAX + 1];
+    uint32_t walked = 0;
+    int rv;
+
+    if (cluster == MSDOSFSROOT)
+	cluster = vol->root_cluster;
+
+    for (;;)
+    {
+	struct direntry *base, *dirent;
+	uint32_t entries, i;
+	int done = 0;
+
+	if (cluster == MSDOSFSROOT)
+	{
+	    base = (struct direntry*)root_dir_addr(vol);
+	    entries = vol->bpb.bpbRootDirEnts;
+	}
+	else
+	{
+	    if (!is_valid_cluster(cluster, vol) || walked++ >= vol->max_cluster)
+		return 0;
+	    base = (struct direntry*)cluster_to_addr(cluster, vol);
+	    entries = vol->cluster_size / sizeof(struct direntry);
+	}
+
+	rv = 0;
+	for (i = 0, dirent = base; i < entries; i++, dirent++)
+	{
+	    STATS_ADD(dirents, 1);
+	    if (dirent->deName[0] == SLOT_EMPTY)
+	    {
+		done = 1;
+		break;
+	    }
+	    if (dirent->deName[0] == SLOT_DELETED)
+	    {
+		lfn_next = 0;
+		continue;
+	    }
+	    if ((dirent->deAttributes & ATTR_WIN95LFN) == ATTR_WIN95LFN)
+	    {
+		struct winentry *we = (struct winentry*)dirent;
+		int seq = we->weCnt & WIN_CNT;
+		uint16_t *p;
+		int j;
+
+		if (we->weCnt & WIN_LAST)
+		{
+		    lfn_next = seq;
+		    lfn_parts = seq;
+		    lfn_sum = we->weChksum;
+		}
+		if (seq == 0 || seq != lfn_next || we->weChksum != lfn_sum)
+		{
+		    lfn_next = 0;
+		    lfn_parts = 0;
+		    continue;
+		}
+		p = lname + (seq - 1) * WIN_CHARS;
+		for (j = 0; j < 5; j++)
+		    *p++ = we->wePart1[2*j] | we->wePart1[2*j + 1] << 8;
+		for (j = 0; j < 6; j++)
+		    *p++ = we->wePart2[2*j] | we->wePart2[2*j + 1] << 8;
+		for (j = 0; j < 2; j++)
+		    *p++ = we->wePart3[2*j] | we->wePart3[2*j + 1] << 8;
+		/* after part 1, lfn_next is 0 and lfn_parts says a whole
+		   name is waiting for its short entry */
+		lfn_next = seq - 1;
+		continue;
+	    }
+
+	    if (lfn_next == 0 && lfn_parts > 0 && 
+		lfn_sum == short_name_sum(dirent) &&
+		long_name(lname, lfn_parts * WIN_CHARS, name) > 0)
+		rv = visit(dirent, name, arg);
+	    else
+	    {
+		short_name(dirent, name);
+		rv = visit(dirent, name, arg);
+	    }
+	    if (rv != 0)
+	    {
+		done = 1;
+		break;
+	    }
+	    lfn_next = 0;
+	    lfn_parts = 0;
+	}
+
+	/* the visitor takes a hold on any entry it keeps */
+	vol_release(vol, base);
+	if (done || cluster == MSDOSFSROOT)
+	    return rv;
+	cluster = get_fat_entry(cluster, vol);
+	STATS_ADD(cluster_hops, 1);
+    }
+}
+
+/* dir_read calls visit for every entry of the directory starting at
+   cluster, up to the end-of-directory marker, with the entry's long
+   name if it has a valid one and its 8.3 name if not.  Deleted entries
+   and the parts of long names aren't visited; volume labels and the
+   "." and ".." entries are.  If visit returns non-zero, dir_read stops
+   and returns that. */
+int dir_read(uint32_t cluster, dir_visitor visit, void *arg, 
+	     struct dosvol *vol)
+{
+    int rv;
+
+    DOS_PROBE2(dir_start, vol, cluster);
+    rv = read_entries(cluster, visit, arg, vol);
+    DOS_PROBE3(dir_end, vol, cluster, rv);
+    return rv;
+}
+
+static int add_key(struct dirkeys *k, const char *key, size_t len, 
+		   struct direntry *dirent)
+{
+    if (k->nkeys == k->keyspace)
+    {
+	void *tmp;
+
+	k->keyspace = k->keyspace ? k->keyspace * 2 : 32;
+	tmp = realloc(k->keys, k->keyspace * sizeof(struct dirslot));
+	if (tmp == NULL)
+	    return -1;
+	k->keys = tmp;
+    }
+    if (k->namelen + len + 1 > k->namespace)
+    {
+	void *tmp;
+
+	while (k->namelen + len + 1 > k->namespace)
+	    k->namespace = k->namespace ? k->namespace * 2 : 512;
+	tmp = realloc(k->names, k->namespace);
+	if (tmp == NULL)
+	    return -1;
+	k->names = tmp;
+    }
+    k->keys[k->nkeys].hash = name_hash(key, len);
+    k->keys[k->nkeys].name = k->namelen;
+    k->keys[k->nkeys].dirent = dirent;
+    k->nkeys++;
+    vol_hold(k->vol, dirent);
+    memcpy(k->names + k->namelen, key, len + 1);
+    k->namelen += len + 1;
+    return 0;
+}
+
+/* index_entry is the dir_read() visitor that collects an entry's keys:
+   its 8.3 name, and its long name if that is different */
+static int index_entry(struct direntry *dirent, const char *name, void *arg)
+{
+    struct dirkeys *k = arg;
+    char key[KEY_MAX + 1], lkey[KEY_MAX + 1];
+    size_t len, llen;
+
+    len = short_key(dirent, key);
+    if (len > 0 && add_key(k, key, len, dirent) < 0)
+	return -1;
+    llen = fold_name(name, strlen(name), lkey);
+    if (llen > 0 && (llen != len || memcmp(lkey, key, len) != 0) &&
+	add_key(k, lkey, llen, dirent) < 0)
+	return -1;
+    return 0;
+}
+
+/* build_dirindex hashes the keys of one directory.  A name that is in
+   the directory twice resolves to the first of them, as it would for a
+   scan. */
+static struct dirindex *build_dirindex(uint32_t cluster, struct dosvol *vol)
+{
+    struct dirkeys k;
+    struct dirindex *index;
+    uint32_t size = 8, i;
+
+    memset(&k, 0, sizeof(k));
+    k.vol = vol;
+    index = calloc(1, sizeof(struct dirindex));
+    if (index == NULL || dir_read(cluster, index_entry, &k, vol) < 0)
+	goto fail;
+
+    while (size < 2 * k.nkeys)
+	size *= 2;
+    index->slots = calloc(size, sizeof(struct dirslot));
+    if (index->slots == NULL)
+	goto fail;
+    index->cluster = cluster;
+    index->mask = size - 1;
+    index->names = k.names;
+    index->namelen = k.namelen;
+    index->namespace = k.namespace;
+
+    for (i = 0; i < k.nkeys; i++)
+    {
+	uint32_t h = k.keys[i].hash & index->mask;
+
+	while (index->slots[h].dirent != NULL)
+	{
+	    if (index->slots[h].hash == k.keys[i].hash &&
+		strcmp(k.names + index->slots[h].name, 
+		       k.names + k.keys[i].name) == 0)
+		break;
+	    h = (h + 1) & index->mask;
+	}
+	if (index->slots[h].dirent == NULL)
+	{
+	    index->slots[h] = k.keys[i];
+	    index->used++;
+	}
+	else
+	    vol_release(vol, k.keys[i].dirent);
+    }
+    free(k.keys);
+    return index;
+
+ fail:
+    fprintf(stderr, "Out of memory indexing a directory\n");
+    if (index != NULL)
+	free(index->slots);
+    for (i = 0; i < k.nkeys; i++)
+	vol_release(vol, k.keys[i].dirent);
+    free(index);
+    free(k.keys);
+    free(k.names);
+    return NULL;
+}
+
+/* free_dirindex frees an index, and gives back its holds on the
+   entries */
+static void free_dirindex(struct dirindex *index, struct dosvol *vol)
+{
+    uint32_t i;
+
+    for (i = 0; i <= index->mask; i++)
+	if (index->slots[i].dirent != NULL)
+	    vol_release(vol, index->slots[i].dirent);
+    free(index->slots);
+    free(index->names);
+    free(index);
+}
+
+/* dirindex_bucket returns the link that points at the index for
+   cluster, or at the NULL ending its bucket if there isn't one */
+static struct dirindex **dirindex_bucket(uint32_t cluster, 
+					 struct dosvol *vol)
+{
+    struct dirindex **link;
+
+    link = &vol->dirindex[(cluster * 2654435761u) & 
+			  (vol->dirindex_buckets - 1)];
+    while (*link != NULL && (*link)->cluster != cluster)
+	link = &(*link)->next;
+    return link;
+}
+
+/* get_dirindex finds the index for the directory starting at cluster,
+   building it if this is the first time it has been asked for */
+static struct dirindex *get_dirindex(uint32_t cluster, struct dosvol *vol)
+{
+    struct dirindex **link;
+    struct dirindex *index;
+
+    if (vol->dirindex == NULL)
+    {
+	vol->dirindex = calloc(DIRINDEX_BUCKETS, sizeof(struct dirindex*));
+	if (vol->dirindex == NULL)
+	    return NULL;
+	vol->dirindex_buckets = DIRINDEX_BUCKETS;
+    }
+
+    link = dirindex_bucket(cluster, vol);
+    if (*link != NULL)
+	return *link;
+
+    /* keep the chains short: double the buckets once there are
+       two indexes to a bucket */
+    if (vol->dirindex_count >= 2 * vol->dirindex_buckets)
+    {
+	struct dirindex **old = vol->dirindex;
+	uint32_t n = vol->dirindex_buckets, i;
+
+	vol->dirindex = calloc(2 * n, sizeof(struct dirindex*));
+	if (vol->dirindex != NULL)
+	{
+	    vol->dirindex_buckets = 2 * n;
+	    for (i = 0; i < n; i++)
+	    {
+		while (old[i] != NULL)
+		{
+		    index = old[i];
+		    old[i] = index->next;
+		    link = dirindex_bucket(index->cluster, vol);
+		    index->next = NULL;
+		    *link = index;
+		}
+	    }
+	    free(old);
+	}
+	else
+	{
+	    vol->dirindex = old;
+	}
+	link = dirindex_bucket(cluster, vol);
+    }
+
+    index = build_dirindex(cluster, vol);
+    if (index == NULL)
+	return NULL;
+    *link = index;
+    vol->dirindex_count++;
+    return index;
+}
+
+/* dir_lookup finds name, len bytes long and matched without regard to
+   case, in the directory starting at cluster.  It returns the short
+   entry for the name, or NULL. */
+struct direntry *dir_lookup(uint32_t cluster, const char *name, size_t len,
+			    struct dosvol *vol)
+{
+    char key[KEY_MAX + 1];
+    struct dirindex *index;
+    uint32_t hash, h;
+
+    /* ".." in a top level directory says 0 even on FAT32 */
+    if (cluster == MSDOSFSROOT)
+	cluster = vol->root_cluster;
+
+    len = fold_name(name, len, key);
+    if (len == 0)
+	return NULL;
+    index = get_dirindex(cluster, vol);
+    if (index == NULL)
+	return NULL;
+
+    hash = name_hash(key, len);
+    for (h = hash & index->mask; index->slots[h].dirent != NULL; 
+	 h = (h + 1) & index->mask)
+    {
+	if (index->slots[h].hash == hash &&
+	    strcmp(index->names + index->slots[h].name, key) == 0)
+	    return index->slots[h].dirent;
+    }
+    return NULL;
+}
+
+/* path_lookup resolves a path of names separated by '/' or '\' from
+   the root directory, returning the entry for the last name, or NULL.
+   If dir is not NULL it is set to the first cluster of the directory
+   that holds (or would hold) the last name, or to CLUST_EOFE if a
+   directory on the way there doesn't exist. */
+struct direntry *path_lookup(const char *path, uint32_t *dir, 
+			     struct dosvol *vol)
+{
+    uint32_t cluster = vol->root_cluster;
+    struct direntry *dirent;
+    size_t len;
+
+    for (;;)
+    {
+	while (*path == '/' || *path == '\\')
+	    path++;
+	len = strcspn(path, "/\\");
+	dirent = dir_lookup(cluster, path, len, vol);
+	path += len;
+	while (*path == '/' || *path == '\\')
+	    path++;
+	if (*path == '\0')
+	    break;
+
+	if (dirent == NULL || (dirent->deAttributes & ATTR_DIRECTORY) == 0)
+	{
+	    cluster = CLUST_EOFE;
+	    dirent = NULL;
+	    break;
+	}
+	cluster = dirent_cluster(dirent, vol);
+	if (cluster == MSDOSFSROOT)
+	    cluster = vol->root_cluster;
+    }
+
+    if (dir != NULL)
+	*dir = cluster;
+    return dirent;
+}
+
+/* dir_insert adds the 8.3 name of a new entry in the directory
+   starting at cluster to its index, if it has one.  An index that has
+   filled up is dropped instead, to be rebuilt bigger when next
+   needed. */
+void dir_insert(uint32_t cluster, struct direntry *dirent, 
+		struct dosvol *vol)
+{
+    char key[KEY_MAX + 1];
+    struct dirindex *index;
+    uint32_t hash, h;
+    size_t len;
+
+    if (vol->dirindex == NULL)
+	return;
+    if (cluster == MSDOSFSROOT)
+	cluster = vol->root_cluster;
+    index = *dirindex_bucket(cluster, vol);
+    if (index == NULL)
+	return;
+
+    len = short_key(dirent, key);
+    if (len == 0)
+	return;
+    if (2 * (index->used + 1) > index->mask + 1 ||
+	index->namelen + len + 1 > index->namespace)
+    {
+	char *names = NULL;
+	size_t space = index->namespace * 2 + len + 1;
+
+	if (2 * (index->used + 1) <= index->mask + 1)
+	    names = realloc(index->names, space);
+	if (names == NULL)
+	{
+	    dir_invalidate(cluster, vol);
+	    return;
+	}
+	index->names = names;
+	index->namespace = space;
+    }
+
+    hash = name_hash(key, len);
+    for (h = hash & index->mask; index->slots[h].dirent != NULL; 
+	 h = (h + 1) & index->mask)
+    {
+	/* an earlier entry with the same name keeps it */
+	if (index->slots[h].hash == hash &&
+	    strcmp(index->names + index->slots[h].name, key) == 0)
+	    return;
+    }
+    index->slots[h].hash = hash;
+    index->slots[h].name = index->namelen;
+    index->slots[h].dirent = dirent;
+    index->used++;
+    vol_hold(vol, dirent);
+    memcpy(index->names + index->namelen, key, len + 1);
+    index->namelen += len + 1;
+}
+
+/* dir_invalidate forgets the index of the directory starting at
+   cluster, so the next lookup there sees its current contents */
+void dir_invalidate(uint32_t cluster, struct dosvol *vol)
+{
+    struct dirindex **link;
+    struct dirindex *index;
+
+    if (vol->dirindex == NULL)
+	return;
+    if (cluster == MSDOSFSROOT)
+	cluster = vol->root_cluster;
+    link = dirindex_bucket(cluster, vol);
+    if (*link == NULL)
+	return;
+    index = *link;
+    *link = index->next;
+    free_dirindex(index, vol);
+    vol->dirindex_count--;
+}
+
+/* write the values into a directory entry */
+void write_dirent(struct direntry *dirent, char *filename, 
+		  uint32_t start_cluster, uint32_t size)
+{
+    char *p, *p2;
+    char *uppername;
+    int len, i;
+
+    /* clean out anything old that used to be here */
+    memset(dirent, 0, sizeof(struct direntry));
+
+    /* extract just the filename part */
+    uppername = strdup(filename);
+    p2 = uppername;
+    for (i = 0; i < strlen(filename); i++) 
+    {
+	if (p2[i] == '/' || p2[i] == '\\') 
+	{
+	    uppername = p2+i+1;
+	}
+    }
+
+    /* convert filename to upper case */
+    for (i = 0; i < strlen(uppername); i++) 
+    {
+	uppername[i] = toupper(uppername[i]);
+    }
+
+    /* set the file name and extension */
+    memset(dirent->deName, ' ', 8);
+    p = strchr(uppername, '.');
+    memcpy(dirent->deExtension, "___", 3);
+    if (p == NULL) 
+    {
+	fprintf(stderr, "No filename extension given - defaulting to .___\n");
+    }
+    else 
+    {
+	*p = '\0';
+	p++;
+	len = strlen(p);
+	if (len > 3) len = 3;
+	memcpy(dirent->deExtension, p, len);
+    }
+
+    if (strlen(uppername)>8) 
+    {
+	uppername[8]='\0';
+    }
+    memcpy(dirent->deName, uppername, strlen(uppername));
+    free(p2);
+
+    /* set the attributes and file size */
+    dirent->deAttributes = ATTR_NORMAL;
+    set_dirent_cluster(dirent, start_cluster);
+    putulong(dirent->deFileSize, size);
+
+    /* could also set time and date here if we really
+       cared... */
+}
+
+
+/* create_dirent finds a free slot in the directory, and write the
+   directory entry.  Returns -1 if there is no room for it. */
+
+int create_dirent(struct direntry *dirent, char *filename, 
+		  uint32_t start_cluster, uint32_t size,
+		  struct dosvol *vol)
+{
+    uint32_t dir_cluster = addr_to_cluster((uint8_t*)dirent, vol);
+    uint32_t cluster = dir_cluster, walked = 0, entries, i;
+    uint32_t next, got;
+    struct direntry *mapped = NULL;	/* a cluster we mapped ourselves */
+
+    if (cluster == MSDOSFSROOT)
+	entries = vol->bpb.bpbRootDirEnts;
+    else
+	entries = vol->cluster_size / sizeof(struct direntry);
+
+    while (1) 
+    {
+	for (i = 0; i < entries; i++, dirent++)
+	{
+	    if (dirent->deName[0] == SLOT_EMPTY) 
+	    {
+		/* we found an empty slot at the end of the directory */
+		write_dirent(dirent, filename, start_cluster, size);
+		dir_insert(dir_cluster, dirent, vol);
+
+		/* make sure the next dirent is set to be empty, just in
+		   case it wasn't before */
+		if (i + 1 < entries)
+		{
+		    dirent++;
+		    memset((uint8_t*)dirent, 0, sizeof(struct direntry));
+		    dirent->deName[0] = SLOT_EMPTY;
+		}
+		vol_release(vol, mapped);
+		return 0;
+	    }
+
+	    if (dirent->deName[0] == SLOT_DELETED) 
+	    {
+		/* we found a deleted entry - we can just overwrite it */
+		write_dirent(dirent, filename, start_cluster, size);
+		dir_insert(dir_cluster, dirent, vol);
+		vol_release(vol, mapped);
+		return 0;
+	    }
+	}
+
+	/* on to the next cluster of the directory.  The FAT-12 and
+	   FAT-16 root directory can't grow, but any other directory
+	   gets another cluster when it runs out */
+	if (cluster == MSDOSFSROOT || ++walked >= vol->max_cluster)
+	    break;
+	next = get_fat_entry(cluster, vol);
+	STATS_ADD(cluster_hops, 1);
+	if (!is_valid_cluster(next, vol))
+	{
+	    next = alloc_run(vol, 1, &got);
+	    if (next == 0)
+		break;
+	    set_fat_entry(cluster, next, vol);
+	    cluster = next;
+	    dirent = (struct direntry*)cluster_to_addr(cluster, vol);
+	    memset(dirent, 0, vol->cluster_size);
+	}
+	else
+	{
+	    cluster = next;
+	    dirent = (struct direntry*)cluster_to_addr(cluster, vol);
+	}
+	vol_release(vol, mapped);
+	mapped = dirent;
+    }
+
+    vol_release(vol, mapped);
+    fprintf(stderr, "The directory is full\n");
+    return -1;
+}
+
+/* free_dirindexes releases every directory index of the volume */
+static void free_dirindexes(struct dosvol *vol)
+{
+    uint32_t i;
+
+    if (vol->dirindex == NULL)
+	return;
+    for (i = 0; i < vol->dirindex_buckets; i++)
+    {
+	while (vol->dirindex[i] != NULL)
+	{
+	    struct dirindex *index = vol->dirindex[i];
+
+	    vol->dirindex[i] = index->next;
+	    free_dirindex(index, vol);
+	}
+    }
+    free(vol->dirindex);
+    vol->dirindex = NULL;
+}
+
+
+/* The directory walker.  dir_walk() goes through a whole tree depth
+   first, visiting each entry before the entries under it, the same
+   order a recursive walk would, but with its stack on the heap: each
+   directory on the way down is read into a frame, and the walk picks
+   up its place in the frame after finishing a subdirectory.  The
+   first cluster of every directory entered is remembered, so a
+   directory that points back at one of its ancestors (or anywhere
+   else already walked) is visited as an entry but not entered
+   again. */
+
+struct walk_item {
+    struct direntry *dirent;
+    uint32_t cluster;		/* its first cluster, for sorting */
+    size_t name;		/* offset of the name in the frame's names */
+};
+
+struct walk_frame {
+    struct walk_item *items;
+    uint32_t nitems, space, next;
+    char *names;
+    size_t namelen, namespace;
+    size_t pathlen;		/* length of the path to this directory */
+    struct dosvol *vol;
+    int failed;			/* ran out of memory reading it */
+};
+
+/* walk_collect is the dir_read() visitor that reads a directory into
+   a frame */
+static int walk_collect(struct direntry *dirent, const char *name, 
+			void *arg)
+{
+    struct walk_frame *f = arg;
+    size_t len = strlen(name) + 1;
+
+    if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0)
+	return 0;
+
+    if (f->nitems == f->space)
+    {
+	void *tmp;
+
+	f->space = f->space ? f->space * 2 : 32;
+	tmp = realloc(f->items, f->space * sizeof(struct walk_item));
+	if (tmp == NULL)
+	    return f->failed = -1;
+	f->items = tmp;
+    }
+    if (f->namelen + len > f->namespace)
+    {
+	void *tmp;
+
+	while (f->namelen + len > f->namespace)
+	    f->namespace = f->namespace ? f->namespace * 2 : 512;
+	tmp = realloc(f->names, f->namespace);
+	if (tmp == NULL)
+	    return f->failed = -1;
+	f->names = tmp;
+    }
+    f->items[f->nitems].dirent = dirent;
+    f->items[f->nitems].cluster = dirent_cluster(dirent, f->vol);
+    f->items[f->nitems].name = f->namelen;
+    memcpy(f->names + f->namelen, name, len);
+    f->namelen += len;
+    f->nitems++;
+    vol_hold(f->vol, dirent);
+    return 0;
+}
+
+/* free_frame frees a frame, and gives back its holds on the entries */
+static void free_frame(struct walk_frame *f)
+{
+    uint32_t i;
+
+    for (i = 0; i < f->nitems; i++)
+	vol_release(f->vol, f->items[i].dirent);
+    free(f->items);
+    free(f->names);
+}
+
+/* the order of a directory's entries in cluster order mode; entries
+   with the same first cluster (empty files) stay in directory order */
+static int walk_cluster_order(const void *a, const void *b)
+{
+    const struct walk_item *x = a, *y = b;
+
+    if (x->cluster != y->cluster)
+	return x->cluster < y->cluster ? -1 : 1;
+    return x->dirent < y->dirent ? -1 : x->dirent > y->dirent;
+}
+
+/* The physical order sweep.  A walk reads directories in tree order,
+   which on a cold image means seeking back and forth across it.
+   dir_sweep() reads the same directories lowest cluster first instead:
+   the directories still to be read wait in a min-heap keyed by first
+   cluster, so the reads move forward through the image as far as the
+   tree allows, with the kernel asked to read SWEEP_WINDOW bytes ahead
+   of wherever the sweep has got to.  A walk afterwards then finds
+   every directory already in memory. */
+
+#define SWEEP_WINDOW (8 * 1024 * 1024)
+
+struct sweep {
+    uint32_t *heap;		/* directories still to read */
+    uint32_t n, space;
+    uint64_t *seen;		/* one bit per cluster, set once queued */
+    struct dosvol *vol;
+    int failed;
+};
+
+static int sweep_push(struct sweep *s, uint32_t cluster)
+{
+    uint32_t i, parent;
+
+    if (s->n == s->space)
+    {
+	void *tmp;
+
+	s->space = s->space ? s->space * 2 : 64;
+	tmp = realloc(s->heap, s->space * sizeof(uint32_t));
+	if (tmp == NULL)
+	    return -1;
+	s->heap = tmp;
+    }
+    for (i = s->n++; i > 0; i = parent)
+    {
+	parent = (i - 1) / 2;
+	if (s->heap[parent] <= cluster)
+	    break;
+	s->heap[i] = s->heap[parent];
+    }
+    s->heap[i] = cluster;
+    return 0;
+}
+
+static uint32_t sweep_pop(struct sweep *s)
+{
+    uint32_t top = s->heap[0], last = s->heap[--s->n];
+    uint32_t i = 0, child;
+
+    while ((child = 2 * i + 1) < s->n)
+    {
+	if (child + 1 < s->n && s->heap[child + 1] < s->heap[child])
+	    child++;
+	if (last <= s->heap[child])
+	    break;
+	s->heap[i] = s->heap[child];
+	i = child;
+    }
+    s->heap[i] = last;
+    return top;
+}
+
+/* sweep_entry is the dir_read() visitor that queues subdirectories */
+static int sweep_entry(struct direntry *dirent, const char *name, 
+		       void *arg)
+{
+    struct sweep *s = arg;
+    uint32_t cluster = dirent_cluster(dirent, s->vol);
+
+    if ((dirent->deAttributes & (ATTR_DIRECTORY | ATTR_VOLUME)) 
+	!= ATTR_DIRECTORY || strcmp(name, ".") == 0 || strcmp(name, "..") == 0)
+	return 0;
+    if (!is_valid_cluster(cluster, s->vol) 
+	|| (s->seen[cluster / 64] & (1ULL << (cluster % 64))))
+	return 0;
+    s->seen[cluster / 64] |= 1ULL << (cluster % 64);
+    if (sweep_push(s, cluster) < 0)
+	return s->failed = -1;
+    return 0;
+}
+
+/* dir_sweep reads every directory in the tree under the directory
+   starting at cluster (MSDOSFSROOT for the root) in ascending cluster
+   order.  It is only a way of warming the cache, so it doesn't matter
+   if it stops early; returns -1 if it ran out of memory. */
+int dir_sweep(uint32_t cluster, struct dosvol *vol)
+{
+    struct sweep s;
+    off_t offset, advised = 0;
+
+    memset(&s, 0, sizeof(s));
+    s.vol = vol;
+    s.seen = calloc(vol->max_cluster / 64 + 1, sizeof(uint64_t));
+    if (s.seen == NULL)
+	return -1;
+
+    if (cluster == MSDOSFSROOT)
+	cluster = vol->root_cluster;
+    if (cluster == MSDOSFSROOT)
+	dir_read(MSDOSFSROOT, sweep_entry, &s, vol);	/* fixed root */
+    else if (is_valid_cluster(cluster, vol))
+    {
+	s.seen[cluster / 64] |= 1ULL << (cluster % 64);
+	s.failed = sweep_push(&s, cluster);
+    }
+
+    while (s.n > 0 && !s.failed)
+    {
+	cluster = sweep_pop(&s);
+	offset = cluster_to_offset(cluster, vol);
+	if (offset + vol->cluster_size > advised)
+	{
+	    /* the sweep has caught up with the last window */
+	    advise_image(offset, SWEEP_WINDOW, MADV_WILLNEED, vol);
+	    advised = offset + SWEEP_WINDOW;
+	}
+	dir_read(cluster, sweep_entry, &s, vol);
+    }
+
+    free(s.heap);
+    free(s.seen);
+    return s.failed;
+}
+
+/* advise_image passes on a hint about len bytes of the image at
+   offset to the kernel, widened to whole pages and clipped to the
+   image.  Without a mapping, the hint is about the file instead. */
+void advise_image(off_t offset, size_t len, int advice, struct dosvol *vol)
+{
+    uintptr_t page = sysconf(_SC_PAGESIZE);
+    off_t start = offset & ~(off_t)(page - 1);
+
+    if (offset < 0 || (size_t)offset >= vol->size)
+	return;
+    if (len > vol->size - offset)
+	len = vol->size - offset;
+    if (vol->image != NULL)
+	madvise(vol->image + start, offset + len - start, advice);
+    else if (advice == MADV_WILLNEED || advice == MADV_SEQUENTIAL)
+	posix_fadvise(vol->fd, start, offset + len - start, 
+		      advice == MADV_WILLNEED ? POSIX_FADV_WILLNEED 
+		      : POSIX_FADV_SEQUENTIAL);
+    else
+	return;
+    STATS_ADD(syscalls, 1);
+}
+
+/* dir_walk calls visit for every entry in the tree under the directory
+   starting at cluster (MSDOSFSROOT for the root), except for the "."
+   and ".." entries.  The visitor gets the entry's name, its path from
+   the top of the walk, and its depth (0 for the entries of the top
+   directory).  If it returns WALK_PRUNE, a directory isn't entered;
+   if it returns anything negative, the walk stops and returns that.
+   With WALK_CLUSTER_ORDER in flags, each directory's entries are
+   visited in order of their first cluster rather than in directory
+   order, to keep the reads that follow moving forward through the
+   image; with WALK_PHYSICAL, dir_sweep() reads the directories in
+   physical order before the walk starts.  Returns -1 if we run out
+   of memory. */
+int dir_walk(uint32_t cluster, int flags, walk_visitor visit, void *arg,
+	     struct dosvol *vol)
+{
+    struct walk_frame *stack = NULL, *f;
+    int depth = 0, space = 0, rv = 0, ret, enter = 1;
+    uint64_t *visited;
+    char *path = NULL;
+    size_t pathspace = 0, pathlen = 0, len = 0;
+    struct walk_entry e;
+
+    if (flags & WALK_PHYSICAL)
+	dir_sweep(cluster, vol);
+
+    visited = calloc(vol->max_cluster / 64 + 1, sizeof(uint64_t));
+    if (visited == NULL)
+	return -1;
+    if (cluster == MSDOSFSROOT)
+	cluster = vol->root_cluster;
+    if (is_valid_cluster(cluster, vol))
+	visited[cluster / 64] |= 1ULL << (cluster % 64);
+
+    for (;;)
+    {
+	struct walk_item *item;
+
+	if (enter)
+	{
+	    /* enter the directory at cluster: read it into a new frame */
+	    if (depth == space)
+	    {
+		void *tmp;
+
+		space = space ? space * 2 : 16;
+		tmp = realloc(stack, space * sizeof(struct walk_frame));
+		if (tmp == NULL)
+		{
+		    rv = -1;
+		    break;
+		}
+		stack = tmp;
+	    }
+	    f = &stack[depth++];
+	    memset(f, 0, sizeof(*f));
+	    /* the path of the entry that led here, if any */
+	    f->pathlen = depth > 1 ? pathlen + 1 + len : 0;
+	    f->vol = vol;
+	    dir_read(cluster, walk_collect, f, vol);
+	    if (f->failed)
+	    {
+		depth--;
+		free_frame(f);
+		rv = -1;
+		break;
+	    }
+	    if (flags & WALK_CLUSTER_ORDER)
+	    {
+		qsort(f->items, f->nitems, sizeof(struct walk_item), 
+		      walk_cluster_order);
+	    }
+	    enter = 0;
+	}
+
+	if (depth == 0)
+	    break;
+	f = &stack[depth - 1];
+	if (f->next == f->nitems)
+	{
+	    /* done with this directory; back up to its parent */
+	    free_frame(f);
+	    depth--;
+	    continue;
+	}
+
+	/* the next entry: put its path together */
+	item = &f->items[f->next++];
+	pathlen = f->pathlen;
+	len = strlen(f->names + item->name);
+	if (pathlen + len + 2 > pathspace)
+	{
+	    void *tmp;
+
+	    pathspace = (pathlen + len + 2) * 2;
+	    tmp = realloc(path, pathspace);
+	    if (tmp == NULL)
+	    {
+		rv = -1;
+		break;
+	    }
+	    path = tmp;
+	}
+	path[pathlen] = '/';
+	memcpy(path + pathlen + 1, f->names + item->name, len + 1);
+
+	e.dirent = item->dirent;
+	e.name = path + pathlen + 1;
+	e.path = path;
+	e.depth = depth - 1;
+	ret = visit(&e, arg);
+	if (ret < 0)
+	{
+	    rv = ret;
+	    break;
+	}
+	if (ret == WALK_PRUNE 
+	    || (item->dirent->deAttributes & ATTR_VOLUME) != 0
+	    || (item->dirent->deAttributes & ATTR_DIRECTORY) == 0)
+	    continue;
+
+	cluster = dirent_cluster(item->dirent, vol);
+	if (is_valid_cluster(cluster, vol) 
+	    && !(visited[cluster / 64] & (1ULL << (cluster % 64))))
+	{
+	    visited[cluster / 64] |= 1ULL << (cluster % 64);
+	    enter = 1;
+	}
+    }
+
+    while (depth > 0)
+    {
+	depth--;
+	free_frame(&stack[depth]);
+    }
+    free(stack);
+    free(path);
+    free(visited);
+    return rv;
+}
+
+
+/* Statistics for --stats.  stats_start() turns them on, and they are
+   reported as one line of JSON on stderr when the process exits,
+   however it exits.  The counters are per thread (a worker calls
+   stats_thread() to get its own) and are added up for the report; the
+   phases are marked by the main thread with stats_phase(), and each
+   gets its wall clock time, CPU time and page faults. */
+
+#define MAX_PHASES 16
+
+struct phase {
+    const char *name;
+    double wall, cpu;		/* at the start, then how long it took */
+    long minflt, majflt;	/* likewise */
+};
+
+static struct {
+    pthread_mutex_t lock;
+    const char *tool;
+    struct dosstats *threads;	/* every thread's counters */
+    struct phase total;
+    struct phase phases[MAX_PHASES];
+    int nphases;
+    int open;			/* the last phase hasn't ended */
+} stats = { PTHREAD_MUTEX_INITIALIZER };
+
+__thread struct dosstats *dos_stats;
+
+static void stats_now(struct phase *p)
+{
+    struct timespec ts;
+    struct rusage ru;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    getrusage(RUSAGE_SELF, &ru);
+    p->wall = ts.tv_sec + ts.tv_nsec / 1e9;
+    p->cpu = ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6
+	+ ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+    p->minflt = ru.ru_minflt;
+    p->majflt = ru.ru_majflt;
+}
+
+/* stats_end turns p's starting point into how long it has run */
+static void stats_end(struct phase *p)
+{
+    struct phase now;
+
+    stats_now(&now);
+    p->wall = now.wall - p->wall;
+    p->cpu = now.cpu - p->cpu;
+    p->minflt = now.minflt - p->minflt;
+    p->majflt = now.majflt - p->majflt;
+}
+
+static void stats_print(const char *key, struct phase *p)
+{
+    fprintf(stderr, "\"%s\":\"%s\",\"wall_s\":%.6f,\"cpu_s\":%.6f"
+	    ",\"minflt\":%ld,\"majflt\":%ld", key, p->name, p->wall, p->cpu,
+	    p->minflt, p->majflt);
+}
+
+static void stats_report(void)
+{
+    struct dosstats sum;
+    struct dosstats *t;
+    int i;
+
+    if (stats.open)
+	stats_end(&stats.phases[stats.nphases - 1]);
+    stats_end(&stats.total);
+
+    memset(&sum, 0, sizeof(sum));
+    pthread_mutex_lock(&stats.lock);
+    for (t = stats.threads; t != NULL; t = t->next)
+    {
+	sum.fat_reads += t->fat_reads;
+	sum.fat_writes += t->fat_writes;
+	sum.cluster_hops += t->cluster_hops;
+	sum.dirents += t->dirents;
+	sum.bytes_copied += t->bytes_copied;
+	sum.syscalls += t->syscalls;
+    }
+    pthread_mutex_unlock(&stats.lock);
+
+    fputc('{', stderr);
+    stats_print("tool", &stats.total);
+    fprintf(stderr, ",\"fat_reads\":%llu,\"fat_writes\":%llu"
+	    ",\"cluster_hops\":%llu,\"dirents\":%llu,\"bytes_copied\":%llu"
+	    ",\"syscalls\":%llu,\"phases\":[",
+	    (unsigned long long)sum.fat_reads,
+	    (unsigned long long)sum.fat_writes,
+	    (unsigned long long)sum.cluster_hops,
+	    (unsigned long long)sum.dirents,
+	    (unsigned long long)sum.bytes_copied,
+	    (unsigned long long)sum.syscalls);
+    for (i = 0; i < stats.nphases; i++)
+    {
+	fputs(i > 0 ? ",{" : "{", stderr);
+	stats_print("phase", &stats.phases[i]);
+	fputc('}', stderr);
+    }
+    fputs("]}\n", stderr);
+}
+
+/* stats_start turns the statistics on for the rest of the process,
+   which is tool, and starts counting on the calling thread */
+void stats_start(const char *tool)
+{
+    if (stats.tool != NULL)
+	return;
+    stats.tool = tool;
+    stats.total.name = tool;
+    stats_now(&stats.total);
+    stats_thread();
+    atexit(stats_report);
+}
+
+/* stats_thread gives the calling thread counters of its own, if the
+   statistics are on */
+void stats_thread(void)
+{
+    struct dosstats *t;
+
+    if (stats.tool == NULL || dos_stats != NULL)
+	return;
+    t = calloc(1, sizeof(struct dosstats));
+    if (t == NULL)
+	return;			/* this thread just won't be counted */
+    pthread_mutex_lock(&stats.lock);
+    t->next = stats.threads;
+    stats.threads = t;
+    pthread_mutex_unlock(&stats.lock);
+    dos_stats = t;
+}
+
+/* stats_phase ends the current phase, if any, and starts the one
+   called name */
+void stats_phase(const char *name)
+{
+    if (stats.tool == NULL)
+	return;
+    if (stats.open)
+	stats_end(&stats.phases[stats.nphases - 1]);
+    stats.open = 0;
+    if (stats.nphases == MAX_PHASES)
+	return;
+    stats.phases[stats.nphases].name = name;
+    stats_now(&stats.phases[stats.nphases++]);
+    stats.open = 1;
+}
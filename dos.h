@@ -9,24 +9,254 @@
 #define FALSE (0)
 #endif
 
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+#include "bpb.h"
+#include "direntry.h"
+#include "fat.h"
+
+/* an open disk image, as returned by open_volume() */
+struct dosvol {
+    uint8_t *image;		/* the memory mapped disk image, or NULL */
+    size_t size;		/* size of the image in bytes */
+    int fd;			/* descriptor the image is mapped from */
+    int flags;			/* VOL_RDONLY and so on, from volopts */
+    struct blockdev *blk;	/* the pread backend, if image is NULL */
+    struct bpb710 bpb;		/* decoded BIOS parameter block */
+
+    int fat_type;		/* 12, 16 or 32 */
+    uint32_t fat_mask;		/* FAT12_MASK, FAT16_MASK or FAT32_MASK */
+    uint32_t fat_offset;	/* byte offset of the (active) FAT */
+    uint32_t fat_size;		/* bytes in one copy of the FAT */
+    uint32_t root_offset;	/* byte offset of the root directory */
+    uint32_t data_offset;	/* byte offset of cluster 2 */
+    uint32_t root_cluster;	/* FAT32 root directory, or MSDOSFSROOT */
+    uint32_t cluster_size;	/* bytes per cluster */
+    uint32_t max_cluster;	/* one past the highest usable cluster */
+    int sector_shift;		/* log2 of the sector size, or -1 */
+    int cluster_shift;		/* log2 of the cluster size, or -1 */
+
+    uint32_t *fat;		/* decoded copy of the FAT */
+    uint32_t fat_entries;	/* number of entries in fat */
+    uint8_t *fat_dirty;		/* one flag per packed pair of entries */
+    uint32_t dirty_lo, dirty_hi; /* range of pairs that may be dirty */
+
+    uint64_t *freemap;		/* one bit per cluster, set if free */
+    uint32_t free_hint;		/* where alloc_run() looks next */
+
+    struct dirindex **dirindex;	/* name indexes of visited directories */
+    uint32_t dirindex_buckets;	/* size of dirindex, a power of two */
+    uint32_t dirindex_count;	/* directories indexed */
+
+    struct chainindex **chainindex; /* skip indexes of file chains */
+    uint32_t fat_generation;	/* bumped by every set_fat_entry() */
+};
+
+struct dirindex;
+struct chainindex;
+struct blockdev;
+
+/* how open_volume_opts() reaches the image */
+#define VOL_MMAP 0		/* map it all */
+#define VOL_PREAD 1		/* pread and pwrite, through a cache */
+#define VOL_CACHE_DEFAULT (64 * 1024 * 1024)
+
+/* volopts flags, also taken by mmap_file() */
+#define VOL_RDONLY 0x1		/* open and map it read only */
+#define VOL_POPULATE 0x2	/* read a read only mapping in up front */
+
+struct volopts {
+    int backend;		/* VOL_MMAP or VOL_PREAD */
+    size_t cache_size;		/* bytes of data cache for VOL_PREAD */
+    int flags;			/* VOL_RDONLY, VOL_POPULATE */
+};
+
+/* a run of physically consecutive clusters in a chain */
+struct extent {
+    uint32_t start;		/* first cluster of the run */
+    uint32_t count;		/* number of clusters in the run */
+};
+
 /* prototypes for functions in dos.c */
 
-#include <stdint.h>
+uint8_t *mmap_file(char *, int, int *, size_t *);
+void unmmap_file(uint8_t *, size_t, int);
+
+int check_bootsector(struct dosvol *);
+
+void volopts_init(struct volopts *);
+struct dosvol *open_volume(char *);
+struct dosvol *open_volume_rdonly(char *);
+struct dosvol *open_volume_opts(char *, struct volopts *);
+void close_volume(struct dosvol *);
+int format_volume(char *, int, uint32_t, int, const char *);
+
+uint8_t *vol_map(struct dosvol *, off_t, size_t);
+off_t vol_offset(struct dosvol *, uint8_t *);
+void vol_hold(struct dosvol *, void *);
+void vol_release(struct dosvol *, void *);
+int vol_read(struct dosvol *, off_t, void *, size_t);
+int vol_write(struct dosvol *, off_t, const void *, size_t);
+
+uint32_t get_fat_entry(uint32_t, struct dosvol *);
+
+void set_fat_entry(uint32_t, uint32_t, struct dosvol *);
+
+int is_end_of_file(uint32_t, struct dosvol *);
+
+int get_extents(uint32_t, uint32_t, struct dosvol *, struct extent **);
+uint32_t chain_seek(uint32_t, uint32_t, struct dosvol *);
+int get_range(uint32_t, uint32_t, uint32_t, struct dosvol *, 
+	      struct extent **);
+
+/* called by dir_read() for each entry of a directory, with its name */
+typedef int (*dir_visitor)(struct direntry *, const char *, void *);
+
+int dir_read(uint32_t, dir_visitor, void *, struct dosvol *);
+struct direntry *dir_lookup(uint32_t, const char *, size_t, struct dosvol *);
+struct direntry *path_lookup(const char *, uint32_t *, struct dosvol *);
+void dir_insert(uint32_t, struct direntry *, struct dosvol *);
+void dir_invalidate(uint32_t, struct dosvol *);
+void write_dirent(struct direntry *, char *, uint32_t, uint32_t);
+int create_dirent(struct direntry *, char *, uint32_t, uint32_t, 
+		  struct dosvol *);
+
+/* what dir_walk() tells its visitor about each entry of the tree */
+struct walk_entry {
+    struct direntry *dirent;
+    const char *name;		/* long name, or 8.3 name */
+    const char *path;		/* "/"-separated, from the top of the walk */
+    int depth;			/* 0 for entries of the top directory */
+};
+
+/* a walk visitor returns 0, WALK_PRUNE not to enter a directory, or
+   something negative to stop the walk */
+typedef int (*walk_visitor)(struct walk_entry *, void *);
+
+#define WALK_PRUNE 1
+#define WALK_CLUSTER_ORDER 0x1	/* visit entries in first cluster order */
+#define WALK_PHYSICAL 0x2	/* read the directories in physical order first */
+
+int dir_walk(uint32_t, int, walk_visitor, void *, struct dosvol *);
+int dir_sweep(uint32_t, struct dosvol *);
+void advise_image(off_t, size_t, int, struct dosvol *);
+
+uint32_t alloc_run(struct dosvol *, uint32_t, uint32_t *);
+uint32_t alloc_extent(struct dosvol *, uint32_t, uint32_t *);
+
+/* what --stats counts.  Each thread counts into a set of its own, so
+   with the statistics off a count costs one test of a thread local
+   pointer. */
+struct dosstats {
+    uint64_t fat_reads;		/* get_fat_entry() calls */
+    uint64_t fat_writes;	/* set_fat_entry() calls */
+    uint64_t cluster_hops;	/* links followed along chains */
+    uint64_t dirents;		/* directory slots looked at */
+    uint64_t bytes_copied;	/* file data moved in or out */
+    uint64_t syscalls;		/* reads, writes and hints issued */
+    struct dosstats *next;	/* the other threads' sets */
+};
+
+extern __thread struct dosstats *dos_stats;
+
+#define STATS_ADD(counter, n) \
+    do { if (dos_stats != NULL) dos_stats->counter += (n); } while (0)
+
+void stats_start(const char *);
+void stats_thread(void);
+void stats_phase(const char *);
+
+/* The geometry lookups below run inside every directory and chain
+   walk, so they live here where they can be inlined, and only use
+   the offsets check_bootsector() worked out. */
+
+static inline int is_valid_cluster(uint32_t cluster, struct dosvol *vol)
+{
+    return cluster >= CLUST_FIRST && cluster < vol->max_cluster;
+}
+
+/* root_dir_addr returns the address in the mmapped disk image for the
+   start of the root directory, as indicated in the boot sector */
+static inline uint8_t *root_dir_addr(struct dosvol *vol)
+{
+    if (vol->image != NULL)
+	return vol->image + vol->root_offset;
+    return vol_map(vol, vol->root_offset, 
+		   (size_t)vol->bpb.bpbRootDirEnts * sizeof(struct direntry));
+}
+
+/* cluster_to_offset returns the byte offset in the disk image where
+   cluster starts */
+static inline off_t cluster_to_offset(uint32_t cluster, struct dosvol *vol)
+{
+    if (cluster == MSDOSFSROOT) 
+	return vol->root_offset;
+
+    /* move forward the right number of clusters from the end of the
+       root directory */
+    if (vol->cluster_shift >= 0)
+	return vol->data_offset 
+	    + ((off_t)(cluster - CLUST_FIRST) << vol->cluster_shift);
+    return vol->data_offset 
+	+ (off_t)vol->cluster_size * (cluster - CLUST_FIRST);
+}
 
-uint8_t *mmap_file(char *, int *);
-void unmmap_file(uint8_t *, int *);
+/* cluster_to_addr returns the memory location where the memory mapped
+   cluster actually starts.  Without a mapping, that is a copy of just
+   the one cluster, so only the mmap backend can run off its end. */
+static inline uint8_t *cluster_to_addr(uint32_t cluster, struct dosvol *vol)
+{
+    if (vol->image != NULL)
+	return vol->image + cluster_to_offset(cluster, vol);
+    if (cluster == MSDOSFSROOT)
+	return root_dir_addr(vol);
+    return vol_map(vol, cluster_to_offset(cluster, vol), vol->cluster_size);
+}
 
-struct bpb33* check_bootsector(uint8_t *);
+/* addr_to_cluster returns the cluster holding address p in the disk
+   image; anything before the data area is the root directory */
+static inline uint32_t addr_to_cluster(uint8_t *p, struct dosvol *vol)
+{
+    size_t offset = vol_offset(vol, p);
 
-uint16_t get_fat_entry(uint16_t, uint8_t *, struct bpb33 *);
+    if (offset < vol->data_offset)
+	return MSDOSFSROOT;
+    if (vol->cluster_shift >= 0)
+	return ((offset - vol->data_offset) >> vol->cluster_shift) 
+	    + CLUST_FIRST;
+    return (offset - vol->data_offset) / vol->cluster_size + CLUST_FIRST;
+}
 
-void set_fat_entry(uint16_t, uint16_t, uint8_t *, struct bpb33 *);
+/* clusters_for_size returns how many clusters a file of size bytes
+   occupies.  The sum is 64 bits wide, as a FAT32 file can be within a
+   cluster of 4G. */
+static inline uint32_t clusters_for_size(uint64_t size, struct dosvol *vol)
+{
+    if (vol->cluster_shift >= 0)
+	return (size + vol->cluster_size - 1) >> vol->cluster_shift;
+    return (size + vol->cluster_size - 1) / vol->cluster_size;
+}
 
-int is_end_of_file(uint16_t);
-int is_valid_cluster(uint16_t, struct bpb33 *);
+/* dirent_cluster returns the starting cluster of a directory entry;
+   only FAT32 uses the high half */
+static inline uint32_t dirent_cluster(struct direntry *dirent, 
+				      struct dosvol *vol)
+{
+    uint32_t cluster = getushort(dirent->deStartCluster);
 
-uint8_t *root_dir_addr(uint8_t *, struct bpb33 *);
+    if (vol->fat_type == 32)
+	cluster |= (uint32_t)getushort(dirent->deHighClust) << 16;
+    return cluster;
+}
 
-uint8_t *cluster_to_addr(uint16_t, uint8_t *, struct bpb33 *);
+/* set_dirent_cluster stores the starting cluster of a directory entry */
+static inline void set_dirent_cluster(struct direntry *dirent, 
+				      uint32_t cluster)
+{
+    putushort(dirent->deStartCluster, cluster & 0xffff);
+    putushort(dirent->deHighClust, cluster >> 16);
+}
 
 #endif // __DOS_H__
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE	/* for splice and vmsplice */
 #include <stdio.h>
 #include <unistd.h>
 #include <stdlib.h>
@@ -6,24 +7,28 @@
 #include <fcntl.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
+#include <stdint.h>
 #include <string.h>
+#include <getopt.h>
 
 #include "bootsect.h"
 #include "bpb.h"
 #include "direntry.h"
 #include "fat.h"
 #include "dos.h"
+#include "probes.h"
 
 
-uint16_t get_dirent(struct direntry *dirent, char *buffer)
+uint32_t get_dirent(struct direntry *dirent, char *buffer, struct dosvol *vol)
 {
-    uint16_t followclust = 0;
+    uint32_t followclust = 0;
     memset(buffer, 0, MAXFILENAME);
 
     int i;
     char name[9];
     char extension[4];
-    uint16_t file_cluster;
+    uint32_t file_cluster;
     name[8] = ' ';
     extension[3] = ' ';
     memcpy(name, &(dirent->deName[0]), 8);
@@ -77,7 +82,7 @@ uint16_t get_dirent(struct direntry *dirent, char *buffer)
 	if ((dirent->deAttributes & ATTR_HIDDEN) != ATTR_HIDDEN)
         {
             strcpy(buffer, name);
-            file_cluster = getushort(dirent->deStartCluster);
+            file_cluster = dirent_cluster(dirent, vol);
             followclust = file_cluster;
         }
     }
@@ -99,157 +104,377 @@ uint16_t get_dirent(struct direntry *dirent, char *buffer)
 }
 
 
-struct direntry *follow_dir(char *searchpath, uint16_t cluster, 
-		            uint8_t *image_buf, struct bpb33* bpb)
+/* find_file looks the path up through the volume's directory index,
+   so each component costs one hash probe */
+struct direntry *find_file(char *searchpath, struct dosvol *vol)
 {
-    char *next_path_component = index(searchpath, '/');
-    int entry_len = strlen(searchpath);
-    if (next_path_component != NULL)
-    {
-        entry_len = next_path_component - searchpath;
-        *next_path_component = '\0';
-        next_path_component++;
-    }
+    return path_lookup(searchpath, NULL, vol);
+}
 
-    struct direntry *rv = NULL;
 
-    while (is_valid_cluster(cluster, bpb))
-    {
-        struct direntry *dirent = (struct direntry*)cluster_to_addr(cluster, image_buf, bpb);
+/* how many fragments go out in one writev() */
+#define IOV_BATCH 64
 
-        int numDirEntries = (bpb->bpbBytesPerSec * bpb->bpbSecPerClust) / sizeof(struct direntry);
-        int i = 0;
-	for ( ; i < numDirEntries; i++)
-	{
-            char buffer[MAXFILENAME]; 
-            uint16_t followclust = get_dirent(dirent, buffer);
+/* pieces at least this long are spliced into a pipe rather than
+   copied */
+#define SPLICE_MIN (64 * 1024)
 
-            if (strncasecmp(searchpath, buffer, strlen(searchpath)) == 0)
-            {
-                if (next_path_component)
-                {
-                    if (followclust)
-                        rv = follow_dir(buffer, followclust, image_buf, bpb);
-                }
-                else
-                {
-                    rv = dirent; 
-                }
-            }
+/* the file goes out in pieces of at most CAT_CHUNK bytes, with the
+   kernel asked to read READAHEAD bytes ahead of the piece being
+   written */
+#define CAT_CHUNK (1024 * 1024)
+#define READAHEAD (8 * 1024 * 1024)
 
-            if (rv)
-                break;
-
-            dirent++;
-	}
+/* where the output goes, and how */
+struct catout {
+    int fd;
+    int pipe;			/* fd is a pipe, so try splice/vmsplice */
+    int no_splice, no_vmsplice;	/* set once either has failed */
+    struct iovec iov[IOV_BATCH];
+    int niov;
+    uint8_t *bounce;		/* CAT_CHUNK bytes, without a mapping */
+};
+
+/* cat_flush writes out the fragments gathered so far, picking up
+   again where writev stopped if it comes back short */
+static int cat_flush(struct catout *out)
+{
+    struct iovec *iov = out->iov;
+    int niov = out->niov;
+    ssize_t written;
 
-	cluster = get_fat_entry(cluster, image_buf, bpb);
+    out->niov = 0;
+    while (niov > 0)
+    {
+        written = writev(out->fd, iov, niov);
+        STATS_ADD(syscalls, 1);
+        if (written < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            fprintf(stderr, "Write failed: %s\n", strerror(errno));
+            return -1;
+        }
+        STATS_ADD(bytes_copied, written);
+        while (niov > 0 && (size_t)written >= iov[0].iov_len)
+        {
+            written -= iov[0].iov_len;
+            iov++;
+            niov--;
+        }
+        if (niov > 0)
+        {
+            iov[0].iov_base = (uint8_t *)iov[0].iov_base + written;
+            iov[0].iov_len -= written;
+        }
     }
-
-    return rv;
+    return 0;
 }
 
-
-struct direntry *traverse_root(char *searchpath, uint8_t *image_buf, struct bpb33* bpb)
+/* cat_pipe moves len bytes at offset in the image into the pipe
+   without copying them: splice from the image file if the kernel can,
+   or else vmsplice from the mapping.  Returns how many bytes it moved;
+   the caller copies whatever is left. */
+static size_t cat_pipe(struct catout *out, uint8_t *p, off_t offset, 
+                       size_t len, struct dosvol *vol)
 {
-    uint16_t cluster = 0;
-    struct direntry *rv = NULL;
+    size_t done = 0;
+#ifdef __linux__
+    ssize_t n;
 
-    struct direntry *dirent = (struct direntry*)cluster_to_addr(cluster, image_buf, bpb);
+    while (done < len && !out->no_splice)
+    {
+        n = splice(vol->fd, &offset, out->fd, NULL, len - done, 
+                   SPLICE_F_MORE);
+        STATS_ADD(syscalls, 1);
+        if (n > 0)
+            done += n;
+        else if (n < 0 && errno == EINTR)
+            continue;
+        else
+            out->no_splice = 1;
+    }
 
-    char *next_path_component = index(searchpath, '/');
-    int root_entry_len = strlen(searchpath);
-    if (next_path_component != NULL)
+    while (done < len && p != NULL && !out->no_vmsplice)
     {
-        root_entry_len = next_path_component - searchpath;
-        *next_path_component = '\0';
-        next_path_component++;
+        struct iovec iov;
+
+        iov.iov_base = p + done;
+        iov.iov_len = len - done;
+        n = vmsplice(out->fd, &iov, 1, 0);
+        STATS_ADD(syscalls, 1);
+        if (n > 0)
+            done += n;
+        else if (n < 0 && errno == EINTR)
+            continue;
+        else
+            out->no_vmsplice = 1;
     }
+#endif
+    STATS_ADD(bytes_copied, done);
+    return done;
+}
 
-    char buffer[MAXFILENAME];
+/* cat_copy sends len bytes of the image at offset to the output by
+   way of the bounce buffer, for when the image isn't mapped */
+static int cat_copy(struct catout *out, off_t offset, size_t len, 
+                    struct dosvol *vol)
+{
+    size_t n;
 
-    int i = 0;
-    for ( ; i < bpb->bpbRootDirEnts; i++)
+    if (cat_flush(out) < 0)
+        return -1;
+    if (out->bounce == NULL && (out->bounce = malloc(CAT_CHUNK)) == NULL)
     {
-        uint16_t followclust = get_dirent(dirent, buffer);
-
-        if (strncasecmp(searchpath, buffer, strlen(searchpath)) == 0)
+        fprintf(stderr, "Out of memory\n");
+        return -1;
+    }
+    for (; len > 0; len -= n, offset += n)
+    {
+        n = len > CAT_CHUNK ? CAT_CHUNK : len;
+        if (vol_read(vol, offset, out->bounce, n) < 0)
         {
-            if (!next_path_component)
-                rv = dirent;
-            else if (is_valid_cluster(followclust, bpb))
-                rv = follow_dir(next_path_component, followclust, image_buf, bpb);
+            fprintf(stderr, "Can't read the disk image: %s\n", 
+                    strerror(errno));
+            return -1;
         }
-
-        if (rv)
-            break;
-
-        dirent++;
+        out->iov[0].iov_base = out->bounce;
+        out->iov[0].iov_len = n;
+        out->niov = 1;
+        if (cat_flush(out) < 0)
+            return -1;
     }
-
-    return rv;
+    return 0;
 }
 
-
-struct direntry *find_file(char *searchpath, uint8_t *image_buf, struct bpb33 *bpb)
+/* cat_write sends len bytes of the image, at p and offset, to the
+   output: spliced if it is big and the output is a pipe, otherwise
+   gathered up for writev.  p is NULL if the image isn't mapped. */
+static int cat_write(struct catout *out, uint8_t *p, off_t offset, 
+                     size_t len, struct dosvol *vol)
 {
-    /* strip any leading '/' from search path */
-    while (*searchpath == '/' && *searchpath != '\0') searchpath++;
-    return traverse_root(searchpath, image_buf, bpb);
-}
+    size_t done;
 
+    if (out->pipe && len >= SPLICE_MIN)
+    {
+        /* keep the output in order */
+        if (cat_flush(out) < 0)
+            return -1;
+        done = cat_pipe(out, p, offset, len, vol);
+        if (p != NULL)
+            p += done;
+        offset += done;
+        len -= done;
+        if (len == 0)
+            return 0;
+    }
+    if (p == NULL)
+        return cat_copy(out, offset, len, vol);
+
+    out->iov[out->niov].iov_base = p;
+    out->iov[out->niov].iov_len = len;
+    out->niov++;
+    if (out->niov == IOV_BATCH)
+        return cat_flush(out);
+    return 0;
+}
 
-void do_cat(struct direntry *dirent, uint8_t *image_buf, struct bpb33 *bpb)
+/* do_cat streams length bytes of the file from offset to stdout.  The
+   chain is resolved into runs of consecutive clusters up front, only
+   as far as the range needs, starting from the cluster holding offset
+   (which the volume's chain index finds without walking the whole
+   chain); the runs go out in big pieces, with the kernel told about
+   the next READAHEAD bytes before they are needed.  Returns -1 if the
+   output fails. */
+int do_cat(struct direntry *dirent, uint32_t offset, uint32_t length,
+           struct dosvol *vol)
 {
-    uint16_t cluster = getushort(dirent->deStartCluster);
-    uint32_t bytes_remaining = getulong(dirent->deFileSize);
-    uint16_t cluster_size = bpb->bpbBytesPerSec * bpb->bpbSecPerClust;
+    uint32_t cluster = dirent_cluster(dirent, vol);
+    uint32_t size = getulong(dirent->deFileSize);
+    uint32_t bytes_remaining;
+    struct extent *extents;
+    struct catout out;
+    struct stat st;
+    int nextents, e, ra = 0;
+    size_t lead;		/* where the range starts in extents[0] */
+    size_t ra_off;		/* how far into extents[ra] is advised */
+    size_t ra_bytes = 0;	/* bytes from here that have been advised */
+    size_t len, done, n;
+    uint8_t *p;
 
     char buffer[MAXFILENAME];
-    get_dirent(dirent, buffer);
+    get_dirent(dirent, buffer, vol);
+
+    fprintf(stderr, "doing cat for %s, size %d\n", buffer, size);
 
-    fprintf(stderr, "doing cat for %s, size %d\n", buffer, bytes_remaining);
+    /* clip the range to the file */
+    if (offset > size)
+        offset = size;
+    bytes_remaining = size - offset;
+    if (length < bytes_remaining)
+        bytes_remaining = length;
+    if (bytes_remaining == 0)
+        return 0;
 
-    while (is_valid_cluster(cluster, bpb))
+    nextents = get_range(cluster, offset, bytes_remaining, vol, &extents);
+    if (nextents < 0)
     {
-        /* map the cluster number to the data location */
-        uint8_t *p = cluster_to_addr(cluster, image_buf, bpb);
+        fprintf(stderr, "Out of memory reading the FAT chain\n");
+        return -1;
+    }
+    lead = offset % vol->cluster_size;
+    ra_off = lead;
+
+    memset(&out, 0, sizeof(out));
+    out.fd = STDOUT_FILENO;
+    out.pipe = fstat(out.fd, &st) == 0 && S_ISFIFO(st.st_mode);
+
+    for (e = 0; e < nextents && bytes_remaining > 0; e++)
+    {
+        /* start the first run at offset, and trim the last run to the
+           end of the range */
+        len = (size_t)extents[e].count * vol->cluster_size - lead;
+        if (len > bytes_remaining)
+            len = bytes_remaining;
+        /* without a mapping, cat_write() reads the image itself */
+        p = vol->image != NULL 
+            ? cluster_to_addr(extents[e].start, vol) + lead : NULL;
+
+        for (done = 0; done < len; done += n)
+        {
+            n = len - done > CAT_CHUNK ? CAT_CHUNK : len - done;
 
-        uint32_t nbytes = bytes_remaining > cluster_size ? cluster_size : bytes_remaining;
+            /* keep READAHEAD bytes advised beyond this piece, a
+               window at a time */
+            while (ra < nextents && ra_bytes < n + READAHEAD)
+            {
+                size_t ra_len = (size_t)extents[ra].count * vol->cluster_size
+                    - ra_off;
+                off_t ra_at = cluster_to_offset(extents[ra].start, vol) 
+                    + ra_off;
+
+                if (ra_len > READAHEAD)
+                    ra_len = READAHEAD;
+                advise_image(ra_at, ra_len, MADV_SEQUENTIAL, vol);
+                advise_image(ra_at, ra_len, MADV_WILLNEED, vol);
+                ra_bytes += ra_len;
+                ra_off += ra_len;
+                if (ra_off == (size_t)extents[ra].count * vol->cluster_size)
+                {
+                    ra++;
+                    ra_off = 0;
+                }
+            }
+
+            if (cat_write(&out, p != NULL ? p + done : NULL, 
+                          cluster_to_offset(extents[e].start, vol) 
+                          + lead + done,
+                          n, vol) < 0)
+            {
+                free(extents);
+                free(out.bounce);
+                return -1;
+            }
+            ra_bytes = ra_bytes > n ? ra_bytes - n : 0;
+        }
+        bytes_remaining -= len;
+        lead = 0;
+    }
+    free(extents);
+    free(out.bounce);
+    if (cat_flush(&out) < 0)
+        return -1;
 
-        fwrite(p, 1, nbytes, stdout);
-        bytes_remaining -= nbytes;
-    
-        cluster = get_fat_entry(cluster, image_buf, bpb);
+    if (bytes_remaining > 0)
+    {
+        /* the chain ended before the file did */
+        fprintf(stderr, "Bad file termination\n");
     }
+    return 0;
 }
 
 
 void usage(char *progname)
 {
-    fprintf(stderr, "usage: %s <imagename> <filename>\n", progname);
+    fprintf(stderr, "usage: %s [--offset bytes] [--length bytes] [--stats] "
+            "<imagename> <filename>\n", progname);
     exit(1);
 }
 
 
+/* parse_bytes reads a byte count for --offset or --length; anything
+   past the 4GB limit of a FAT file is as good as the end of it */
+static int parse_bytes(const char *arg, uint32_t *bytes)
+{
+    unsigned long long value;
+    char *end;
+
+    errno = 0;
+    value = strtoull(arg, &end, 0);
+    if (end == arg || *end != '\0' || arg[0] == '-')
+        return -1;
+    if (errno == ERANGE || value > UINT32_MAX)
+        value = UINT32_MAX;
+    *bytes = value;
+    return 0;
+}
+
+
 int main(int argc, char** argv)
 {
-    uint8_t *image_buf;
-    int fd;
-    struct bpb33* bpb;
-    if (argc != 3)
+    static const struct option options[] = {
+        { "offset", required_argument, NULL, 'o' },
+        { "length", required_argument, NULL, 'l' },
+        { "stats", no_argument, NULL, 'S' },
+        { NULL, 0, NULL, 0 }
+    };
+    struct dosvol *vol;
+    uint32_t offset = 0, length = UINT32_MAX;
+    int opt;
+
+    while ((opt = getopt_long(argc, argv, "o:l:", options, NULL)) != -1)
+    {
+        switch (opt)
+        {
+        case 'o':
+            if (parse_bytes(optarg, &offset) < 0)
+                usage(argv[0]);
+            break;
+        case 'l':
+            if (parse_bytes(optarg, &length) < 0)
+                usage(argv[0]);
+            break;
+        case 'S':
+            stats_start("dos_cat");
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (argc - optind != 2)
     {
 	usage(argv[0]);
     }
 
-    image_buf = mmap_file(argv[1], &fd);
-    bpb = check_bootsector(image_buf);
+    stats_phase("open");
+    vol = open_volume_rdonly(argv[optind]);
+    if (vol == NULL)
+	exit(1);
 
-    struct direntry *dirent = find_file(argv[2], image_buf, bpb);
+    int rv = 0;
+    stats_phase("cat");
+    struct direntry *dirent = find_file(argv[optind + 1], vol);
     if (dirent)
-        do_cat(dirent, image_buf, bpb);
+    {
+        uint32_t size = getulong(dirent->deFileSize);
+
+        DOS_PROBE3(copy_start, vol, argv[optind + 1], size);
+        rv = do_cat(dirent, offset, length, vol);
+        DOS_PROBE4(copy_end, vol, argv[optind + 1], size, rv);
+    }
 
-    unmmap_file(image_buf, &fd);
+    stats_phase("close");
+    close_volume(vol);
 
-    return 0;
+    return rv < 0 ? 1 : 0;
 }
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE	/* for copy_file_range */
 #include <stdio.h>
 #include <unistd.h>
 #include <stdlib.h>
@@ -6,245 +7,294 @@
 #include <fcntl.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
 #include <string.h>
 #include <assert.h>
 #include <ctype.h>
+#include <limits.h>
+#include <pthread.h>
+#include <getopt.h>
 
 #include "bootsect.h"
 #include "bpb.h"
 #include "direntry.h"
 #include "fat.h"
 #include "dos.h"
+#include "probes.h"
 
 
-/* get_name retrieves the filename from a directory entry */
+/* how many runs of clusters copy_out_file hands to one writev() */
+#define IOV_BATCH 64
 
-void get_name(char *fullname, struct direntry *dirent) 
-{
-    char name[9];
-    char extension[4];
-    int i;
-
-    name[8] = ' ';
-    extension[3] = ' ';
-    memcpy(name, &(dirent->deName[0]), 8);
-    memcpy(extension, dirent->deExtension, 3);
-
-    /* names are space padded - remove the padding */
-    for (i = 8; i > 0; i--) 
-    {
-	if (name[i] == ' ') 
-	    name[i] = '\0';
-	else 
-	    break;
-    }
-
-    /* extensions aren't normally space padded - but remove the
-       padding anyway if it's there */
-    for (i = 3; i > 0; i--) 
-    {
-	if (extension[i] == ' ') 
-	    extension[i] = '\0';
-	else 
-	    break;
-    }
-    fullname[0]='\0';
-    strcat(fullname, name);
+/* how many clusters copy_in_file reserves at a time */
+#define ALLOC_RUN 64
 
-    /* append the extension if it's not a directory */
-    if ((dirent->deAttributes & ATTR_DIRECTORY) == 0) 
-    {
-	strcat(fullname, ".");
-	strcat(fullname, extension);
-    }
-}
+/* runs at least this long are copied out without passing through
+   user space */
+#define ZEROCOPY_MIN (64 * 1024)
 
 
-/* find_file seeks through the directories in the memory disk image,
-   until it finds the named file */
+/* find_file looks up the named file in the disk image, through the
+   volume's directory index.  In FIND_DIR mode it returns the first
+   entry of the directory the file is (or would be) in, which the
+   caller gives back with vol_release(). */
 
 /* flags, depending on whether we're searching for a file or a
    directory */
 #define FIND_FILE 0
 #define FIND_DIR 1
 
-struct direntry* find_file(char *infilename, uint16_t cluster,
-			   int find_mode,
-			   uint8_t *image_buf, struct bpb33* bpb)
+struct direntry* find_file(char *infilename, int find_mode,
+			   struct dosvol *vol)
 {
-    char buf[MAXPATHLEN];
-    char *seek_name, *next_name;
-    int d;
     struct direntry *dirent;
-    uint16_t dir_cluster;
-    char fullname[13];
+    uint32_t dir_cluster;
 
-    /* find the first dirent in this directory */
-    dirent = (struct direntry*)cluster_to_addr(cluster, image_buf, bpb);
+    dirent = path_lookup(infilename, &dir_cluster, vol);
+    if (find_mode == FIND_DIR) 
+    {
+	if (dir_cluster == CLUST_EOFE)
+	    return NULL;
+	return (struct direntry*)cluster_to_addr(dir_cluster, vol);
+    }
 
-    /* first we need to split the file name we're looking for into the
-       first part of the path, and the remainder.  We hunt through the
-       current directory for the first part.  If there's a remainder,
-       and what we find is a directory, then we recurse, and search
-       that directory for the remainder */
+    return dirent;
+}
 
-    strncpy(buf, infilename, MAXPATHLEN);
-    seek_name = buf;
 
-    /* trim leading slashes */
-    while (*seek_name == '/' || *seek_name == '\\') 
-    {
-	seek_name++;
-    }
+/* write_iov writes out a batch of buffers, picking up again where
+   writev stopped if it comes back short.  Returns -1 if the write
+   fails. */
+static int write_iov(int fd, struct iovec *iov, int niov)
+{
+    ssize_t written;
 
-    /* search for any more slashes - if so, it's a dirname */
-    next_name = seek_name;
-    while (1) 
+    while (niov > 0)
     {
-	if (*next_name == '/' || *next_name == '\\') 
+	written = writev(fd, iov, niov);
+	STATS_ADD(syscalls, 1);
+	if (written < 0)
 	{
-	    *next_name = '\0';
-	    next_name ++;
-	    break;
+	    if (errno == EINTR)
+		continue;
+	    fprintf(stderr, "Write failed: %s\n", strerror(errno));
+	    return -1;
 	}
-	if (*next_name == '\0') 
+	STATS_ADD(bytes_copied, written);
+	while (niov > 0 && (size_t)written >= iov[0].iov_len)
 	{
-	    /* end of name - no slashes found */
-	    next_name = NULL;
-	    if (find_mode == FIND_DIR) 
-	    {
-		return dirent;
-	    }
-	    break;
+	    written -= iov[0].iov_len;
+	    iov++;
+	    niov--;
+	}
+	if (niov > 0)
+	{
+	    iov[0].iov_base = (uint8_t *)iov[0].iov_base + written;
+	    iov[0].iov_len -= written;
 	}
-	next_name++;
     }
+    return 0;
+}
+
+
+/* copy_range asks the kernel to move len bytes at offset in the disk
+   image straight to fd, without them passing through user space.  It
+   returns how many bytes it moved, which is less than len if neither
+   copy_file_range nor sendfile can be used between these two files;
+   the caller copies the rest itself.  *unusable remembers, for the
+   file being copied, which calls have already failed. */
+#define NO_COPY_FILE_RANGE 1
+#define NO_SENDFILE 2
 
-    while (1) 
+static size_t copy_range(int fd, off_t offset, size_t len, int *unusable,
+			 struct dosvol *vol)
+{
+    size_t done = 0;
+#ifdef __linux__
+    ssize_t n;
+
+    while (done < len && !(*unusable & NO_COPY_FILE_RANGE))
     {
-	/* hunt a cluster for the relevant dirent.  If we reach the
-	   end of the cluster, we'll need to go to the next cluster
-	   for this directory */
-	for (d = 0; 
-	     d < bpb->bpbBytesPerSec * bpb->bpbSecPerClust; 
-	     d += sizeof(struct direntry)) 
-	{
-	    if (dirent->deName[0] == SLOT_EMPTY) 
-	    {
-		/* we failed to find the file */
-		return NULL;
-	    }
+	n = copy_file_range(vol->fd, &offset, fd, NULL, len - done, 0);
+	STATS_ADD(syscalls, 1);
+	if (n > 0)
+	    done += n;
+	else if (n < 0 && errno == EINTR)
+	    continue;
+	else
+	    *unusable |= NO_COPY_FILE_RANGE; /* e.g. EXDEV, or fd is a pipe */
+    }
 
-	    if (dirent->deName[0] == SLOT_DELETED) 
-	    {
-		/* skip over a deleted file */
-		dirent++;
-		continue;
-	    }
+    while (done < len && !(*unusable & NO_SENDFILE))
+    {
+	n = sendfile(fd, vol->fd, &offset, len - done);
+	STATS_ADD(syscalls, 1);
+	if (n > 0)
+	    done += n;
+	else if (n < 0 && errno == EINTR)
+	    continue;
+	else
+	    *unusable |= NO_SENDFILE;
+    }
+#endif
+    STATS_ADD(bytes_copied, done);
+    return done;
+}
 
-	    get_name(fullname, dirent);
-	    if (strcmp(fullname, seek_name)==0) 
-	    {
-		/* found it! */
-		if ((dirent->deAttributes & ATTR_DIRECTORY) != 0) 
-		{
-		    /* it's a directory */
-		    if (next_name == NULL) 
-		    {
-			fprintf(stderr, "Cannot copy out a directory\n");
-			exit(1);
-		    }
-		    dir_cluster = getushort(dirent->deStartCluster);
-		    return find_file(next_name, dir_cluster, 
-				     find_mode, image_buf, bpb);
-		} 
-		else if ((dirent->deAttributes & ATTR_VOLUME) != 0) 
-		{
-		    /* it's a volume */
-		    fprintf(stderr, "Cannot copy out a volume\n");
-		    exit(1);
-		} 
-		else 
-		{
-		    /* assume it's a file */
-		    return dirent;
-		}
-	    }
-	    dirent++;
-	}
 
-	/* we've reached the end of the cluster for this directory.
-	   Where's the next cluster? */
-	if (cluster == 0) 
-	{
-	    // root dir is special
-	    dirent++;
-	} 
-	else 
+/* copy_bounce copies len bytes of the image at offset to fd by way of
+   a buffer, for when the image isn't mapped.  Returns -1 if the copy
+   fails. */
+#define BOUNCE_SIZE (1024 * 1024)
+
+static int copy_bounce(int fd, off_t offset, size_t len, struct dosvol *vol)
+{
+    struct iovec iov;
+    uint8_t *buf;
+    size_t n;
+    int rv = 0;
+
+    buf = malloc(len < BOUNCE_SIZE ? len : BOUNCE_SIZE);
+    if (buf == NULL)
+    {
+	fprintf(stderr, "Out of memory\n");
+	return -1;
+    }
+    for (; len > 0 && rv == 0; len -= n, offset += n)
+    {
+	n = len < BOUNCE_SIZE ? len : BOUNCE_SIZE;
+	if (vol_read(vol, offset, buf, n) < 0)
 	{
-	    cluster = get_fat_entry(cluster, image_buf, bpb);
-	    dirent = (struct direntry*)cluster_to_addr(cluster, 
-						       image_buf, bpb);
+	    fprintf(stderr, "Can't read the disk image: %s\n", 
+		    strerror(errno));
+	    rv = -1;
+	    break;
 	}
+	iov.iov_base = buf;
+	iov.iov_len = n;
+	rv = write_iov(fd, &iov, 1);
     }
+    free(buf);
+    return rv;
 }
 
 
-/* copy_out_file actually does the work of copying, recursing through
-   the clusters of the memory disk image, and copying out a cluster at
-   a time */
+/* copy_extents copies bytes of a file out to fd, starting skip
+   clusters into the file's runs of clusters.  Runs of at least
+   ZEROCOPY_MIN bytes are moved by the kernel straight from the image
+   file; the fragments in between are gathered from the memory mapped
+   image and handed to writev() in batches, or copied through a buffer
+   if the image isn't mapped.  Returns -1 if the copy fails. */
 
-void copy_out_file(FILE *fd, uint16_t cluster, uint32_t bytes_remaining,
-		   uint8_t *image_buf, struct bpb33* bpb)
+static int copy_extents(int fd, struct extent *extents, int nextents,
+			uint32_t skip, size_t bytes_remaining,
+			struct dosvol *vol)
 {
-    int total_clusters, clust_size;
+    struct iovec iov[IOV_BATCH];
+    int e, niov = 0, unusable = 0;
+    uint32_t start, count;
+    size_t len, done;
+    off_t offset;
     uint8_t *p;
 
-    clust_size = bpb->bpbSecPerClust * bpb->bpbBytesPerSec;
-    total_clusters = bpb->bpbSectors / bpb->bpbSecPerClust;
+    for (e = 0; e < nextents && bytes_remaining > 0; e++)
+    {
+	/* pass over the runs before the part we want */
+	start = extents[e].start;
+	count = extents[e].count;
+	if (skip >= count)
+	{
+	    skip -= count;
+	    continue;
+	}
+	start += skip;
+	count -= skip;
+	skip = 0;
+
+	/* trim the last run to the file size */
+	len = (size_t)count * vol->cluster_size;
+	if (len > bytes_remaining)
+	    len = bytes_remaining;
+	bytes_remaining -= len;
+	offset = cluster_to_offset(start, vol);
+
+	if (len >= ZEROCOPY_MIN || vol->image == NULL)
+	{
+	    /* keep the output in order */
+	    if (write_iov(fd, iov, niov) < 0)
+		return -1;
+	    niov = 0;
+
+	    done = len >= ZEROCOPY_MIN 
+		? copy_range(fd, offset, len, &unusable, vol) : 0;
+	    offset += done;
+	    len -= done;
+	    if (len == 0)
+		continue;
+	    if (vol->image == NULL)
+	    {
+		if (copy_bounce(fd, offset, len, vol) < 0)
+		    return -1;
+		continue;
+	    }
+	}
+	p = vol->image + offset;
 
-    assert(cluster <= total_clusters);
+	iov[niov].iov_base = p;
+	iov[niov].iov_len = len;
+	niov++;
+	if (niov == IOV_BATCH)
+	{
+	    if (write_iov(fd, iov, niov) < 0)
+		return -1;
+	    niov = 0;
+	}
+    }
+    if (write_iov(fd, iov, niov) < 0)
+	return -1;
 
-    if (cluster == 0) 
+    if (bytes_remaining > 0)
     {
+	/* the chain ended before the file did */
 	fprintf(stderr, "Bad file termination\n");
-	return;
     }
-    else if (is_end_of_file(cluster)) 
-    {
-	return;	
-    } 
+    return 0;
+}
 
+/* copy_out_file actually does the work of copying.  It resolves the
+   file's cluster chain into runs of consecutive clusters up front, and
+   has copy_extents write them out.  Returns -1 if the copy fails. */
 
-    /* map the cluster number to the data location */
-    p = cluster_to_addr(cluster, image_buf, bpb);
+int copy_out_file(int fd, uint32_t cluster, uint32_t bytes_remaining,
+		  struct dosvol *vol)
+{
+    struct extent *extents;
+    int nextents, rv;
 
-    if (bytes_remaining <= clust_size) 
-    {
-	/* this is the last cluster */
-	fwrite(p, bytes_remaining, 1, fd);
-    } 
-    else 
+    nextents = get_extents(cluster, clusters_for_size(bytes_remaining, vol),
+			   vol, &extents);
+    if (nextents < 0)
     {
-	/* more clusters after this one */
-	fwrite(p, clust_size, 1, fd);
-
-	/* recurse, continuing to copy */
-	copy_out_file(fd, get_fat_entry(cluster, image_buf, bpb), 
-		      bytes_remaining - clust_size, image_buf, bpb);
+	fprintf(stderr, "Out of memory reading the FAT chain\n");
+	return -1;
     }
-    return;
+    rv = copy_extents(fd, extents, nextents, 0, bytes_remaining, vol);
+    free(extents);
+    return rv;
 }
 
 /* copyout copies a file from the FAT-12 memory disk image to a
-   regular file in the file system */
+   regular file in the file system.  Returns -1 if it couldn't. */
 
-void copyout(char *infilename, char* outfilename,
-	     uint8_t *image_buf, struct bpb33* bpb)
+int copyout(char *infilename, char* outfilename,
+	    struct dosvol *vol)
 {
     struct direntry *dirent = (void*)1;
-    FILE *fd;
-    uint16_t start_cluster;
+    int fd, rv;
+    uint32_t start_cluster;
     uint32_t size;
 
     /* skip the volume name */
@@ -252,244 +302,969 @@ void copyout(char *infilename, char* outfilename,
     infilename+=2;
 
     /* find the dirent of the file in the memory disk image */
-    dirent = find_file(infilename, 0, FIND_FILE, image_buf, bpb);
+    dirent = find_file(infilename, FIND_FILE, vol);
     if (dirent == NULL) 
     {
 	fprintf(stderr, "No file called %s exists in the disk image\n",
 		infilename);
-	exit(1);
+	return -1;
+    }
+    if ((dirent->deAttributes & ATTR_DIRECTORY) != 0) 
+    {
+	fprintf(stderr, "Cannot copy out a directory\n");
+	return -1;
+    }
+    if ((dirent->deAttributes & ATTR_VOLUME) != 0) 
+    {
+	fprintf(stderr, "Cannot copy out a volume\n");
+	return -1;
     }
 
     /* open the real file for writing */
-    fd = fopen(outfilename, "w");
-    if (fd == NULL) 
+    fd = open(outfilename, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd < 0) 
     {
 	fprintf(stderr, "Can't open file %s to copy data out\n",
 		outfilename);
-	exit(1);
+	return -1;
     }
 
     /* do the actual copy out*/
-    start_cluster = getushort(dirent->deStartCluster);
+    start_cluster = dirent_cluster(dirent, vol);
     size = getulong(dirent->deFileSize);
-    copy_out_file(fd, start_cluster, size, image_buf, bpb);
+    DOS_PROBE3(copy_start, vol, infilename, size);
+    rv = copy_out_file(fd, start_cluster, size, vol);
+    DOS_PROBE4(copy_end, vol, infilename, size, rv);
     
-    fclose(fd);
+    if (close(fd) < 0 && rv == 0)
+    {
+	fprintf(stderr, "Write failed: %s\n", strerror(errno));
+	rv = -1;
+    }
+    return rv;
 }
 
-/* copy_in_file actually does the copying of the file into the memory
-   image, updates the FAT, and returns the starting cluster of the
-   file */
+/* read_full reads len bytes from fd into buf, stopping early only at
+   end of file.  Returns the number of bytes read, or -1 if the read
+   fails. */
+static ssize_t read_full(int fd, uint8_t *buf, size_t len)
+{
+    size_t done = 0;
+    ssize_t n;
 
-uint16_t copy_in_file(FILE* fd, uint8_t *image_buf, struct bpb33* bpb, 
-		      uint32_t *size)
+    while (done < len)
+    {
+	n = read(fd, buf + done, len - done);
+	STATS_ADD(syscalls, 1);
+	if (n == 0)
+	    break;
+	if (n < 0)
+	{
+	    if (errno == EINTR)
+		continue;
+	    fprintf(stderr, "Read failed: %s\n", strerror(errno));
+	    return -1;
+	}
+	done += n;
+    }
+    STATS_ADD(bytes_copied, done);
+    return done;
+}
+
+
+/* free_chain gives back the clusters of a chain when a copy in fails
+   part way */
+static void free_chain(uint32_t cluster, struct dosvol *vol)
+{
+    uint32_t next;
+
+    while (is_valid_cluster(cluster, vol))
+    {
+	next = get_fat_entry(cluster, vol);
+	set_fat_entry(cluster, CLUST_FREE, vol);
+	cluster = next;
+    }
+}
+
+
+/* read_into_image reads up to len bytes from fd into the image at
+   offset: straight into the mapping with one read call if there is
+   one, or else a buffer at a time through vol_write().  Returns how
+   many bytes it read, which is short at end of file, or -1. */
+static ssize_t read_into_image(int fd, off_t offset, size_t len,
+			       struct dosvol *vol)
+{
+    uint8_t *buf;
+    ssize_t bytes, done = 0;
+    size_t n;
+
+    if (vol->image != NULL)
+	return read_full(fd, vol->image + offset, len);
+
+    buf = malloc(len < BOUNCE_SIZE ? len : BOUNCE_SIZE);
+    if (buf == NULL)
+    {
+	fprintf(stderr, "Out of memory\n");
+	return -1;
+    }
+    while ((size_t)done < len)
+    {
+	n = len - done < BOUNCE_SIZE ? len - done : BOUNCE_SIZE;
+	bytes = read_full(fd, buf, n);
+	if (bytes < 0)
+	{
+	    done = -1;
+	    break;
+	}
+	if (bytes > 0 && vol_write(vol, offset + done, buf, bytes) < 0)
+	{
+	    fprintf(stderr, "Can't write the disk image: %s\n", 
+		    strerror(errno));
+	    done = -1;
+	    break;
+	}
+	done += bytes;
+	if ((size_t)bytes < n)
+	    break;
+    }
+    free(buf);
+    return done;
+}
+
+
+/* copy_in_extents copies in a file whose length we know up front.  It
+   reserves the clusters for the whole file first, as few and as
+   contiguous runs as the free space allows, then reads each run's
+   worth of data straight into the memory mapped image with one read
+   call, and finally links the FAT chain in a single pass.  The chain
+   is stored in *start_cluster and *last_cluster.  Returns -1, having
+   given the space back, if the copy fails. */
+
+static int copy_in_extents(int fd, struct dosvol *vol, uint32_t length,
+			   uint32_t *size, uint32_t *start_cluster,
+			   uint32_t *last_cluster)
+{
+    struct extent *extents;
+    uint32_t want, got, start, used, i;
+    int nextents = 0, e;
+    size_t len;
+    ssize_t bytes;
+    off_t offset;
+
+    /* reserve the space */
+    want = clusters_for_size(length, vol);
+    extents = malloc(want * sizeof(struct extent));
+    if (extents == NULL)
+    {
+	fprintf(stderr, "Out of memory\n");
+	return -1;
+    }
+    while (want > 0)
+    {
+	start = alloc_extent(vol, want, &got);
+	if (start == 0)
+	{
+	    /* oops - we ran out of disk space */
+	    fprintf(stderr, "No more space in filesystem\n");
+	    goto fail;
+	}
+	extents[nextents].start = start;
+	extents[nextents].count = got;
+	nextents++;
+	want -= got;
+    }
+
+    /* fill it, one read per run */
+    for (e = 0; e < nextents && *size < length; e++)
+    {
+	len = (size_t)extents[e].count * vol->cluster_size;
+	if (len > length - *size)
+	    len = length - *size;
+	offset = cluster_to_offset(extents[e].start, vol);
+	bytes = read_into_image(fd, offset, len, vol);
+	if (bytes < 0)
+	    goto fail;
+	*size += bytes;
+
+	/* don't leave stale data in the slack of the last cluster */
+	if (*size % vol->cluster_size != 0)
+	{
+	    size_t slack = vol->cluster_size - *size % vol->cluster_size;
+	    uint8_t *zero = calloc(1, slack);
+
+	    if (zero == NULL || vol_write(vol, offset + bytes, zero, slack) < 0)
+	    {
+		free(zero);
+		goto fail;
+	    }
+	    free(zero);
+	}
+	if (bytes < len)
+	    break;		/* the file shrank under us */
+    }
+
+    /* link up the clusters we used, and give back any we didn't */
+    used = clusters_for_size(*size, vol);
+    for (e = 0; e < nextents; e++)
+    {
+	for (i = 0; i < extents[e].count; i++)
+	{
+	    if (used == 0)
+	    {
+		set_fat_entry(extents[e].start + i, CLUST_FREE, vol);
+		continue;
+	    }
+	    if (*last_cluster != 0)
+		set_fat_entry(*last_cluster, extents[e].start + i, vol);
+	    else
+		*start_cluster = extents[e].start + i;
+	    *last_cluster = extents[e].start + i;
+	    used--;
+	}
+    }
+    free(extents);
+    return 0;
+
+ fail:
+    for (e = 0; e < nextents; e++)
+	for (i = 0; i < extents[e].count; i++)
+	    set_fat_entry(extents[e].start + i, CLUST_FREE, vol);
+    free(extents);
+    return -1;
+}
+
+
+/* copy_in_stream copies in data a cluster at a time until end of
+   file, for when we can't tell the length in advance.  It carries on
+   the chain in *start_cluster and *last_cluster, if there is one.
+   Returns -1 if the copy fails; the chain is left for the caller to
+   give back. */
+
+static int copy_in_stream(int fd, struct dosvol *vol, uint32_t *size,
+			  uint32_t *start_cluster, uint32_t *last_cluster)
 {
-    uint32_t clust_size, total_clusters, i;
+    uint32_t clust_size, i;
     uint8_t *buf;
-    size_t bytes;
-    uint16_t start_cluster = 0;
-    uint16_t prev_cluster = 0;
+    ssize_t bytes;
+    uint32_t cluster;
+    uint32_t run_start = 0, run_len = 0, run_used = 0;
+    int rv = 0;
     
-    clust_size = bpb->bpbSecPerClust * bpb->bpbBytesPerSec;
-    total_clusters = bpb->bpbSectors / bpb->bpbSecPerClust;
+    clust_size = vol->cluster_size;
     buf = malloc(clust_size);
+    if (buf == NULL)
+    {
+	fprintf(stderr, "Out of memory\n");
+	return -1;
+    }
     while(1) 
     {
 	/* read a block of data, and store it */
-	bytes = fread(buf, 1, clust_size, fd);
+	bytes = read_full(fd, buf, clust_size);
+	if (bytes < 0)
+	{
+	    rv = -1;
+	    break;
+	}
 	if (bytes > 0) {
 	    *size += bytes;
 
-	    /* find a free cluster */
-	    for (i = 2; i < total_clusters; i++) 
+	    /* don't leave stale data in the slack of the last cluster */
+	    if ((size_t)bytes < clust_size)
+		memset(buf + bytes, 0, clust_size - bytes);
+
+	    /* take the next cluster from the run we reserved, or
+	       reserve another run if it's used up */
+	    if (run_used == run_len) 
 	    {
-		if (get_fat_entry(i, image_buf, bpb) == CLUST_FREE) 
+		run_start = alloc_run(vol, ALLOC_RUN, &run_len);
+		run_used = 0;
+		if (run_start == 0) 
 		{
+		    /* oops - we ran out of disk space */
+		    fprintf(stderr, "No more space in filesystem\n");
+		    run_len = 0;
+		    rv = -1;
 		    break;
 		}
 	    }
-
-	    if (i == total_clusters) 
-	    {
-		/* oops - we ran out of disk space */
-		fprintf(stderr, "No more space in filesystem\n");
-		/* we should clean up here, rather than just exit */ 
-		exit(1);
-	    }
+	    cluster = run_start + run_used;
+	    run_used++;
 
 	    /* remember the first cluster, as we need to store this in
 	       the dirent */
-	    if (start_cluster == 0) 
+	    if (*start_cluster == 0) 
 	    {
-		start_cluster = i;
+		*start_cluster = cluster;
 	    } 
 	    else 
 	    {
 		/* link the previous cluster to this one in the FAT */
-		assert(prev_cluster != 0);
-		set_fat_entry(prev_cluster, i, image_buf, bpb);
+		assert(*last_cluster != 0);
+		set_fat_entry(*last_cluster, cluster, vol);
 	    }
 
-	    /* make sure we've recorded this cluster as used */
-	    set_fat_entry(i, FAT12_MASK&CLUST_EOFS, image_buf, bpb);
-
-	    /* copy the data into the cluster */
-	    memcpy(cluster_to_addr(i, image_buf, bpb), buf, clust_size);
+	    /* alloc_run already marked the cluster as the end of the
+	       chain, so copy the data into the cluster */
+	    if (vol_write(vol, cluster_to_offset(cluster, vol), buf, 
+			  clust_size) < 0)
+	    {
+		fprintf(stderr, "Can't write the disk image: %s\n", 
+			strerror(errno));
+		rv = -1;
+		break;
+	    }
+	    *last_cluster = cluster;
 	}
 
 	if (bytes < clust_size) 
 	{
-	    /* We didn't real a full cluster, so we either got a read
-	       error, or reached end of file.  We exit anyway */
+	    /* We didn't real a full cluster, so we reached end of
+	       file */
 	    break;
 	}
-	prev_cluster = i;
     }
 
+    /* give back whatever we reserved but didn't need */
+    for (i = run_used; i < run_len; i++)
+	set_fat_entry(run_start + i, CLUST_FREE, vol);
+
     free(buf);
-    return start_cluster;
+    return rv;
 }
 
-/* write the values into a directory entry */
-void write_dirent(struct direntry *dirent, char *filename, 
-		  uint16_t start_cluster, uint32_t size)
-{
-    char *p, *p2;
-    char *uppername;
-    int len, i;
 
-    /* clean out anything old that used to be here */
-    memset(dirent, 0, sizeof(struct direntry));
+/* copy_in_file actually does the copying of the file into the memory
+   image and updates the FAT.  The starting cluster of the file goes
+   in *start_cluster and its length in *size.  Returns -1, with nothing
+   left allocated, if the copy fails. */
+
+int copy_in_file(int fd, struct dosvol *vol, uint32_t *start_cluster,
+		 uint32_t *size)
+{
+    struct stat statbuf;
+    uint32_t last_cluster = 0;
 
-    /* extract just the filename part */
-    uppername = strdup(filename);
-    p2 = uppername;
-    for (i = 0; i < strlen(filename); i++) 
+    *start_cluster = 0;
+    if (fstat(fd, &statbuf) == 0 && S_ISREG(statbuf.st_mode) 
+	&& statbuf.st_size > 0)
     {
-	if (p2[i] == '/' || p2[i] == '\\') 
+	if (statbuf.st_size > UINT32_MAX)
 	{
-	    uppername = p2+i+1;
+	    fprintf(stderr, "File is too big for a FAT filesystem\n");
+	    return -1;
 	}
+	if (copy_in_extents(fd, vol, statbuf.st_size, size, 
+			    start_cluster, &last_cluster) < 0)
+	    return -1;
+
+	/* if the file grew while we copied it, we can only append
+	   whole clusters to the chain */
+	if (*size % vol->cluster_size != 0)
+	    return 0;
     }
 
-    /* convert filename to upper case */
-    for (i = 0; i < strlen(uppername); i++) 
+    /* pick up anything we couldn't size in advance: a pipe, or a file
+       that grew after we looked at it */
+    if (copy_in_stream(fd, vol, size, start_cluster, &last_cluster) < 0)
     {
-	uppername[i] = toupper(uppername[i]);
+	free_chain(*start_cluster, vol);
+	*start_cluster = 0;
+	return -1;
     }
+    return 0;
+}
 
-    /* set the file name and extension */
-    memset(dirent->deName, ' ', 8);
-    p = strchr(uppername, '.');
-    memcpy(dirent->deExtension, "___", 3);
-    if (p == NULL) 
+/* copyin copies a file from a regular file on the filesystem into a
+   file in the FAT-12 memory disk image.  Returns -1 if it couldn't. */
+
+int copyin(char *infilename, char* outfilename,
+	   struct dosvol *vol)
+{
+    struct direntry *dirent = (void*)1;
+    int fd;
+    uint32_t start_cluster;
+    uint32_t size = 0;
+
+    assert(strncmp("a:", outfilename, 2)==0);
+    outfilename+=2;
+
+    /* check that the file doesn't already exist */
+    dirent = find_file(outfilename, FIND_FILE, vol);
+    if (dirent != NULL) 
     {
-	fprintf(stderr, "No filename extension given - defaulting to .___\n");
+	fprintf(stderr, "File %s already exists\n", outfilename);
+	return -1;
     }
-    else 
+
+    /* find the dirent of the directory to put the file in */
+    dirent = find_file(outfilename, FIND_DIR, vol);
+    if (dirent == NULL) 
     {
-	*p = '\0';
-	p++;
-	len = strlen(p);
-	if (len > 3) len = 3;
-	memcpy(dirent->deExtension, p, len);
+	fprintf(stderr, "Directory does not exists in the disk image\n");
+	return -1;
     }
 
-    if (strlen(uppername)>8) 
+    /* open the real file for reading */
+    fd = open(infilename, O_RDONLY);
+    if (fd < 0) 
     {
-	uppername[8]='\0';
+	fprintf(stderr, "Can't open file %s to copy data in\n",
+		infilename);
+	vol_release(vol, dirent);
+	return -1;
     }
-    memcpy(dirent->deName, uppername, strlen(uppername));
-    free(p2);
 
-    /* set the attributes and file size */
-    dirent->deAttributes = ATTR_NORMAL;
-    putushort(dirent->deStartCluster, start_cluster);
-    putulong(dirent->deFileSize, size);
+    /* do the actual copy in*/
+    DOS_PROBE3(copy_start, vol, outfilename, 0);
+    if (copy_in_file(fd, vol, &start_cluster, &size) < 0)
+    {
+	DOS_PROBE4(copy_end, vol, outfilename, size, -1);
+	close(fd);
+	vol_release(vol, dirent);
+	return -1;
+    }
+    DOS_PROBE4(copy_end, vol, outfilename, size, 0);
+    close(fd);
 
-    /* could also set time and date here if we really
-       cared... */
+    /* create the directory entry */
+    if (create_dirent(dirent, outfilename, start_cluster, size, vol) < 0)
+    {
+	vol_release(vol, dirent);
+	free_chain(start_cluster, vol);
+	return -1;
+    }
+    vol_release(vol, dirent);
+    return 0;
 }
 
+/* Recursive extraction.  The tree is walked once, on one thread,
+   making the host directories and queueing the files.  A file of more
+   than XPIECE bytes is queued as several pieces, written at their own
+   offsets, so that one big file is shared out between the workers
+   instead of holding up the end of the run.  Every worker has a queue
+   of its own, dealt out biggest piece first; a worker whose queue has
+   run dry steals the smallest pieces off the end of the others'. */
+
+#define XPIECE (16 * 1024 * 1024)
+
+/* in physical order, the kernel is asked to read this far ahead of
+   the pieces being copied */
+#define XWINDOW (64 * 1024 * 1024)
+
+struct xfile {
+    char *path;			/* where it goes on the host */
+    uint32_t cluster;		/* first cluster */
+    uint32_t size;
+    struct extent *extents;	/* resolved up front if it is in pieces */
+    int nextents;
+};
+
+struct xpiece {
+    struct xfile *file;
+    uint32_t skip;		/* clusters into the file the piece starts */
+    uint32_t bytes;		/* bytes in the piece */
+    off_t where;		/* where the piece starts in the image */
+};
+
+struct xqueue {
+    pthread_mutex_t lock;
+    struct xpiece *pieces;
+    int head, tail;
+};
+
+struct extract {
+    struct dosvol *vol;
+    char path[PATH_MAX];	/* host path of the entry being walked */
+    size_t baselen;		/* length of the directory extracted into */
+    struct xfile **files;
+    int nfiles, filespace;
+    struct xpiece *pieces;
+    int npieces, piecespace;
+    struct xqueue *queues;
+    int nqueues;
+    int physical;		/* one queue, in the order it is on disk */
+    int advised;		/* pieces of the queue advised so far */
+    size_t ahead;		/* bytes advised beyond the pieces taken */
+    int failed;
+    pthread_mutex_t lock;	/* protects failed once the workers start */
+};
+
+struct xworker {
+    pthread_t thread;
+    struct extract *x;
+    int id;
+};
+
+/* piece_offset works out where in the image the piece of file that
+   starts skip clusters in begins */
+static off_t piece_offset(struct xfile *file, uint32_t skip, 
+			  struct dosvol *vol)
+{
+    int e;
+
+    if (file->extents == NULL)
+	return is_valid_cluster(file->cluster, vol) 
+	    ? cluster_to_offset(file->cluster, vol) : 0;
+    for (e = 0; e < file->nextents; e++)
+    {
+	if (skip < file->extents[e].count)
+	    return cluster_to_offset(file->extents[e].start + skip, vol);
+	skip -= file->extents[e].count;
+    }
+    return 0;
+}
+
+static int add_piece(struct extract *x, struct xfile *file, uint32_t skip,
+		     uint32_t bytes)
+{
+    if (x->npieces == x->piecespace)
+    {
+	void *tmp;
+
+	x->piecespace = x->piecespace ? x->piecespace * 2 : 256;
+	tmp = realloc(x->pieces, x->piecespace * sizeof(struct xpiece));
+	if (tmp == NULL)
+	    return -1;
+	x->pieces = tmp;
+    }
+    x->pieces[x->npieces].file = file;
+    x->pieces[x->npieces].skip = skip;
+    x->pieces[x->npieces].bytes = bytes;
+    x->pieces[x->npieces].where = piece_offset(file, skip, x->vol);
+    x->npieces++;
+    return 0;
+}
+
+/* queue_file queues the file at x->path.  A file in pieces has its
+   chain resolved here, and is created at its full size so the pieces
+   can be written in any order. */
+static int queue_file(struct extract *x, struct direntry *dirent)
+{
+    struct dosvol *vol = x->vol;
+    struct xfile *file;
+    uint32_t skip, bytes, step;
+    int fd;
+
+    if (x->nfiles == x->filespace)
+    {
+	void *tmp;
+
+	x->filespace = x->filespace ? x->filespace * 2 : 256;
+	tmp = realloc(x->files, x->filespace * sizeof(struct xfile*));
+	if (tmp == NULL)
+	    return -1;
+	x->files = tmp;
+    }
+    file = calloc(1, sizeof(struct xfile));
+    if (file == NULL || (file->path = strdup(x->path)) == NULL)
+    {
+	free(file);
+	return -1;
+    }
+    x->files[x->nfiles++] = file;
+    file->cluster = dirent_cluster(dirent, vol);
+    file->size = getulong(dirent->deFileSize);
+
+    if (file->size <= XPIECE)
+	return add_piece(x, file, 0, file->size);
+
+    file->nextents = get_extents(file->cluster, 
+				 clusters_for_size(file->size, vol),
+				 vol, &file->extents);
+    if (file->nextents < 0)
+	return -1;
+    fd = open(file->path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd < 0 || ftruncate(fd, file->size) < 0)
+    {
+	fprintf(stderr, "Can't open file %s to copy data out\n", 
+		file->path);
+	if (fd >= 0)
+	    close(fd);
+	x->failed++;
+	return 0;
+    }
+    close(fd);
+
+    step = XPIECE / vol->cluster_size;
+    for (skip = 0, bytes = file->size; bytes > 0; skip += step)
+    {
+	uint32_t len = bytes > XPIECE ? XPIECE : bytes;
+
+	if (add_piece(x, file, skip, len) < 0)
+	    return -1;
+	bytes -= len;
+    }
+    return 0;
+}
 
-/* create_dirent finds a free slot in the directory, and write the
-   directory entry */
+/* safe_name is false for a name from the image that would lead out of
+   the directory it belongs in: "", "." and "..", or anything with a
+   separator in it.  Each entry is checked as the walk reaches it, and
+   a directory that fails isn't entered, so every component of every
+   path extracted has been checked. */
+static int safe_name(const char *name)
+{
+    if (name[0] == '\0' || strcmp(name, ".") == 0 || strcmp(name, "..") == 0)
+	return 0;
+    return strpbrk(name, "/\\") == NULL;
+}
 
-void create_dirent(struct direntry *dirent, char *filename, 
-		   uint16_t start_cluster, uint32_t size,
-		   uint8_t *image_buf, struct bpb33* bpb)
+/* extract_entry is the dir_walk() visitor: it makes the host
+   directory for a directory, and queues a file */
+static int extract_entry(struct walk_entry *e, void *arg)
 {
-    while (1) 
+    struct extract *x = arg;
+    size_t len = strlen(e->path);
+
+    if ((e->dirent->deAttributes & ATTR_VOLUME) != 0)
+	return 0;
+    if (!safe_name(e->name))
+    {
+	fprintf(stderr, "Skipping %s: not a safe file name\n", e->path);
+	x->failed++;
+	return WALK_PRUNE;
+    }
+    if (x->baselen + len >= sizeof(x->path))
+    {
+	fprintf(stderr, "Path too long under %s\n", x->path);
+	x->failed++;
+	return WALK_PRUNE;
+    }
+    memcpy(x->path + x->baselen, e->path, len + 1);
+
+    if ((e->dirent->deAttributes & ATTR_DIRECTORY) != 0)
     {
-	if (dirent->deName[0] == SLOT_EMPTY) 
+	if (mkdir(x->path, 0777) < 0 && errno != EEXIST)
 	{
-	    /* we found an empty slot at the end of the directory */
-	    write_dirent(dirent, filename, start_cluster, size);
-	    dirent++;
-
-	    /* make sure the next dirent is set to be empty, just in
-	       case it wasn't before */
-	    memset((uint8_t*)dirent, 0, sizeof(struct direntry));
-	    dirent->deName[0] = SLOT_EMPTY;
-	    return;
+	    fprintf(stderr, "Can't make directory %s: %s\n", x->path,
+		    strerror(errno));
+	    x->failed++;
+	    return WALK_PRUNE;
 	}
+	return 0;
+    }
+    if (queue_file(x, e->dirent) < 0)
+    {
+	fprintf(stderr, "Out of memory\n");
+	return -1;
+    }
+    return 0;
+}
+
+/* advise_ahead keeps XWINDOW bytes of the queue beyond the piece just
+   taken advised, when everything comes off the one queue in physical
+   order; called with the queue locked.  Each piece is taken to be
+   contiguous, which is only a hint if it isn't. */
+static void advise_ahead(struct extract *x, struct xqueue *q, 
+			 struct xpiece *taken)
+{
+    x->ahead = x->ahead > taken->bytes ? x->ahead - taken->bytes : 0;
+    if (x->advised < q->head)
+	x->advised = q->head;
+    while (x->advised < q->tail && x->ahead < XWINDOW)
+    {
+	struct xpiece *next = &q->pieces[x->advised++];
+
+	advise_image(next->where, next->bytes, MADV_WILLNEED, x->vol);
+	x->ahead += next->bytes;
+    }
+}
 
-	if (dirent->deName[0] == SLOT_DELETED) 
+/* take_piece gets the next piece for worker id: from the front of its
+   own queue, or else from the back of someone else's.  Returns 0 when
+   there is nothing left anywhere. */
+static int take_piece(struct extract *x, int id, struct xpiece *piece)
+{
+    int i;
+
+    for (i = 0; i < x->nqueues; i++)
+    {
+	struct xqueue *q = &x->queues[(id + i) % x->nqueues];
+	int found = 0;
+
+	pthread_mutex_lock(&q->lock);
+	if (q->head < q->tail)
 	{
-	    /* we found a deleted entry - we can just overwrite it */
-	    write_dirent(dirent, filename, start_cluster, size);
-	    return;
+	    if (i == 0)
+		*piece = q->pieces[q->head++];
+	    else
+		*piece = q->pieces[--q->tail];
+	    found = 1;
 	}
-	dirent++;
+	if (found && x->physical)
+	    advise_ahead(x, q, piece);
+	pthread_mutex_unlock(&q->lock);
+	if (found)
+	    return 1;
     }
+    return 0;
 }
 
-/* copyin copies a file from a regular file on the filesystem into a
-   file in the FAT-12 memory disk image  */
+static int extract_piece(struct extract *x, struct xpiece *piece)
+{
+    struct xfile *file = piece->file;
+    int fd, rv;
 
-void copyin(char *infilename, char* outfilename,
-	    uint8_t *image_buf, struct bpb33* bpb)
+    DOS_PROBE3(copy_start, x->vol, file->path, piece->bytes);
+    if (file->extents == NULL)
+    {
+	fd = open(file->path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	if (fd >= 0)
+	    rv = copy_out_file(fd, file->cluster, file->size, x->vol);
+    }
+    else
+    {
+	fd = open(file->path, O_WRONLY);
+	if (fd >= 0)
+	{
+	    rv = -1;
+	    if (lseek(fd, (off_t)piece->skip * x->vol->cluster_size, 
+		      SEEK_SET) >= 0)
+		rv = copy_extents(fd, file->extents, file->nextents, 
+				  piece->skip, piece->bytes, x->vol);
+	}
+    }
+    if (fd < 0)
+    {
+	fprintf(stderr, "Can't open file %s to copy data out\n",
+		file->path);
+	rv = -1;
+    }
+    else if (close(fd) < 0 && rv == 0)
+    {
+	fprintf(stderr, "Write failed: %s\n", strerror(errno));
+	rv = -1;
+    }
+    DOS_PROBE4(copy_end, x->vol, file->path, piece->bytes, rv);
+    return rv;
+}
+
+static void *extract_worker(void *arg)
 {
-    struct direntry *dirent = (void*)1;
-    FILE *fd;
-    uint16_t start_cluster;
-    uint32_t size = 0;
+    struct xworker *w = arg;
+    struct extract *x = w->x;
+    struct xpiece piece;
 
-    assert(strncmp("a:", outfilename, 2)==0);
-    outfilename+=2;
+    stats_thread();
+    while (take_piece(x, w->id, &piece))
+    {
+	if (extract_piece(x, &piece) < 0)
+	{
+	    pthread_mutex_lock(&x->lock);
+	    x->failed++;
+	    pthread_mutex_unlock(&x->lock);
+	}
+    }
+    return NULL;
+}
 
-    /* check that the file doesn't already exist */
-    dirent = find_file(outfilename, 0, FIND_FILE, image_buf, bpb);
-    if (dirent != NULL) 
+static int bigger_piece(const void *a, const void *b)
+{
+    const struct xpiece *pa = a, *pb = b;
+
+    if (pa->bytes != pb->bytes)
+	return pa->bytes > pb->bytes ? -1 : 1;
+    return 0;
+}
+
+static int earlier_piece(const void *a, const void *b)
+{
+    const struct xpiece *pa = a, *pb = b;
+
+    if (pa->where != pb->where)
+	return pa->where < pb->where ? -1 : 1;
+    return 0;
+}
+
+/* extract copies everything under the directory infilename in the
+   image into the host directory outdir, on nthreads workers.  If
+   physical is set, the directories are read in physical order and
+   the workers all take pieces off one queue in the order they are in
+   the image, so the copy is one forward sweep.  Returns -1 if
+   anything failed. */
+
+int extract(char *infilename, char *outdir, int nthreads, int physical,
+	    struct dosvol *vol)
+{
+    struct extract x;
+    struct xworker *workers;
+    struct direntry *dirent;
+    uint32_t cluster = vol->root_cluster;
+    int i, n;
+
+    assert(strncmp("a:", infilename, 2)==0);
+    infilename+=2;
+
+    /* find the directory to extract; nothing but slashes is the root */
+    if (infilename[strspn(infilename, "/\\")] != '\0')
     {
-	fprintf(stderr, "File %s already exists\n", outfilename);
-	exit(1);
+	dirent = find_file(infilename, FIND_FILE, vol);
+	if (dirent == NULL || (dirent->deAttributes & ATTR_DIRECTORY) == 0)
+	{
+	    fprintf(stderr, "No directory called %s exists in the disk image\n",
+		    infilename);
+	    return -1;
+	}
+	cluster = dirent_cluster(dirent, vol);
     }
 
-    /* find the dirent of the directory to put the file in */
-    dirent = find_file(outfilename, 0, FIND_DIR, image_buf, bpb);
-    if (dirent == NULL) 
+    memset(&x, 0, sizeof(x));
+    x.vol = vol;
+    if (strlen(outdir) >= sizeof(x.path))
     {
-	fprintf(stderr, "Directory does not exists in the disk image\n");
-	exit(1);
+	fprintf(stderr, "Path too long: %s\n", outdir);
+	return -1;
+    }
+    strcpy(x.path, outdir);
+    x.baselen = strlen(outdir);
+    while (x.baselen > 1 && x.path[x.baselen - 1] == '/')
+	x.path[--x.baselen] = '\0';
+    if (mkdir(x.path, 0777) < 0 && errno != EEXIST)
+    {
+	fprintf(stderr, "Can't make directory %s: %s\n", x.path,
+		strerror(errno));
+	return -1;
     }
 
-    /* open the real file for reading */
-    fd = fopen(infilename, "r");
-    if (fd == NULL) 
+    /* walk the tree once, queueing the work */
+    if (dir_walk(cluster, 
+		 physical ? WALK_PHYSICAL | WALK_CLUSTER_ORDER : 0,
+		 extract_entry, &x, vol) < 0)
+	x.failed++;
+
+    /* deal the pieces out, biggest first, or all onto one queue in
+       physical order */
+    x.physical = physical;
+    qsort(x.pieces, x.npieces, sizeof(struct xpiece), 
+	  physical ? earlier_piece : bigger_piece);
+    if (nthreads > x.npieces)
+	nthreads = x.npieces > 0 ? x.npieces : 1;
+    x.nqueues = physical ? 1 : nthreads;
+    x.queues = calloc(x.nqueues, sizeof(struct xqueue));
+    workers = calloc(nthreads, sizeof(struct xworker));
+    if (x.queues == NULL || workers == NULL)
     {
-	fprintf(stderr, "Can't open file %s to copy data in\n",
-		infilename);
+	fprintf(stderr, "Out of memory\n");
 	exit(1);
     }
+    for (i = 0; i < x.nqueues; i++)
+    {
+	pthread_mutex_init(&x.queues[i].lock, NULL);
+	x.queues[i].pieces = malloc(((x.npieces + x.nqueues - 1) / x.nqueues 
+				     + 1) * sizeof(struct xpiece));
+	if (x.queues[i].pieces == NULL)
+	{
+	    fprintf(stderr, "Out of memory\n");
+	    exit(1);
+	}
+    }
+    for (n = 0; n < x.npieces; n++)
+    {
+	struct xqueue *q = &x.queues[n % x.nqueues];
 
-    /* do the actual copy in*/
-    start_cluster = copy_in_file(fd, image_buf, bpb, &size);
+	q->pieces[q->tail++] = x.pieces[n];
+    }
 
-    /* create the directory entry */
-    create_dirent(dirent, outfilename, start_cluster, size, image_buf, bpb);
-    
-    fclose(fd);
+    /* the calling thread is worker 0 */
+    pthread_mutex_init(&x.lock, NULL);
+    for (i = 0; i < nthreads; i++)
+    {
+	workers[i].x = &x;
+	workers[i].id = i;
+    }
+    for (i = 1; i < nthreads; i++)
+    {
+	if (pthread_create(&workers[i].thread, NULL, extract_worker, 
+			   &workers[i]) != 0)
+	{
+	    fprintf(stderr, "Can't start worker thread\n");
+	    exit(1);
+	}
+    }
+    extract_worker(&workers[0]);
+    for (i = 1; i < nthreads; i++)
+	pthread_join(workers[i].thread, NULL);
+    pthread_mutex_destroy(&x.lock);
+
+    for (i = 0; i < x.nqueues; i++)
+    {
+	pthread_mutex_destroy(&x.queues[i].lock);
+	free(x.queues[i].pieces);
+    }
+    for (n = 0; n < x.nfiles; n++)
+    {
+	free(x.files[n]->path);
+	free(x.files[n]->extents);
+	free(x.files[n]);
+    }
+    free(x.files);
+    free(x.pieces);
+    free(x.queues);
+    free(workers);
+
+    if (x.failed > 0)
+    {
+	fprintf(stderr, "%d files could not be extracted\n", x.failed);
+	return -1;
+    }
+    return 0;
+}
+
+/* run_manifest carries out each "a:src dst" or "src a:dst" line of a
+   manifest against the one open image, so the image is mapped, its
+   directories indexed and its FAT written back once for the whole
+   batch.  Blank lines and lines starting with '#' are skipped.
+   Returns the number of lines that failed. */
+
+static int run_manifest(FILE *manifest, struct dosvol *vol)
+{
+    char *line = NULL;
+    size_t space = 0;
+    int lineno = 0, copies = 0, failed = 0, rv;
+    char *src, *dst;
+
+    while (getline(&line, &space, manifest) >= 0)
+    {
+	lineno++;
+	src = strtok(line, " \t\r\n");
+	if (src == NULL || src[0] == '#')
+	    continue;
+	dst = strtok(NULL, " \t\r\n");
+	copies++;
+
+	if (dst == NULL || strtok(NULL, " \t\r\n") != NULL)
+	{
+	    fprintf(stderr, "Line %d: expected a source and a destination\n",
+		    lineno);
+	    rv = -1;
+	}
+	else if (strncmp("a:", src, 2)==0) 
+	{
+	    rv = copyout(src, dst, vol);
+	}
+	else if (strncmp("a:", dst, 2)==0) 
+	{
+	    rv = copyin(src, dst, vol);
+	}
+	else 
+	{
+	    fprintf(stderr, "Line %d: one of the names must start with a:\n",
+		    lineno);
+	    rv = -1;
+	}
+
+	if (rv < 0)
+	{
+	    fprintf(stderr, "Line %d: copy failed\n", lineno);
+	    failed++;
+	}
+    }
+    free(line);
+
+    if (failed > 0)
+	fprintf(stderr, "%d of %d copies failed\n", failed, copies);
+    return failed;
 }
 
 void usage(char *progname)
@@ -498,38 +1273,106 @@ void usage(char *progname)
     fprintf(stderr, "\tcopies file called filename1 from disk image to a normal file\n");
     fprintf(stderr, "usage: %s <imagename> <filename3> a:<filename4>\n", progname);
     fprintf(stderr, "\tcopies normal file called filename3 into disk image as filename4\n");
+    fprintf(stderr, "usage: %s <imagename> -b <manifest>\n", progname);
+    fprintf(stderr, "\tmakes every copy listed in manifest, one pair of names a line\n");
+    fprintf(stderr, "\t(- reads the list from standard input)\n");
+    fprintf(stderr, "usage: %s -j <threads> [-p] <imagename> a:<directory> <hostdir>\n", progname);
+    fprintf(stderr, "\textracts everything under directory (a: for the whole image)\n");
+    fprintf(stderr, "\tinto hostdir, on the given number of threads\n");
+    fprintf(stderr, "\t(-p copies in the order the data is on disk)\n");
+    fprintf(stderr, "--stats before the image name reports counters and "
+	    "timings on stderr\n");
     exit(1);
 }
 
 int main(int argc, char** argv)
 {
-    int fd;
-    uint8_t *image_buf;
-    struct bpb33* bpb;
+    static const struct option options[] = {
+	{ "stats", no_argument, NULL, 'S' },
+	{ NULL, 0, NULL, 0 }
+    };
+    struct dosvol *vol;
+    FILE *manifest;
+    int nthreads = 0, physical = 0;
+    int opt, rv;
+
+    /* options only come before the image name; "-b" comes after it */
+    while ((opt = getopt_long(argc, argv, "+j:p", options, NULL)) != -1)
+    {
+	if (opt == 'j' && atoi(optarg) > 0)
+	    nthreads = atoi(optarg);
+	else if (opt == 'p')
+	    physical = 1;
+	else if (opt == 'S')
+	    stats_start("dos_cp");
+	else
+	    usage(argv[0]);
+    }
+    if (physical && nthreads == 0)
+	usage(argv[0]);
+    argc -= optind - 1;
+    argv += optind - 1;
     if (argc < 4 || argc > 4) 
     {
 	usage(argv[0]);
     }
 
-    image_buf = mmap_file(argv[1], &fd);
-    bpb = check_bootsector(image_buf);
+    /* copying out only reads the image, so it can be shared with
+       other readers, or be on read only media */
+    stats_phase("open");
+    if (nthreads > 0 || (strcmp(argv[2], "-b") != 0 
+			 && strncmp("a:", argv[2], 2) == 0))
+	vol = open_volume_rdonly(argv[1]);
+    else
+	vol = open_volume(argv[1]);
+    if (vol == NULL)
+	exit(1);
 
     /* use the "a:" bit to determine whether we're copying in or out */
-    if (strncmp("a:", argv[2], 2)==0) 
+    if (nthreads > 0)
+    {
+	/* extract a whole directory tree */
+	if (strncmp("a:", argv[2], 2) != 0)
+	    usage(argv[0]);
+	stats_phase("extract");
+	rv = extract(argv[2], argv[3], nthreads, physical, vol);
+    }
+    else if (strcmp(argv[2], "-b") == 0 && strncmp("a:", argv[3], 2) != 0)
+    {
+	/* a whole batch of copies */
+	if (strcmp(argv[3], "-") == 0)
+	    manifest = stdin;
+	else
+	    manifest = fopen(argv[3], "r");
+	if (manifest == NULL)
+	{
+	    fprintf(stderr, "Can't open manifest %s\n", argv[3]);
+	    close_volume(vol);
+	    exit(1);
+	}
+	stats_phase("manifest");
+	rv = run_manifest(manifest, vol) > 0 ? -1 : 0;
+	if (manifest != stdin)
+	    fclose(manifest);
+    }
+    else if (strncmp("a:", argv[2], 2)==0) 
     {
 	/* copy from FAT-12 disk image to external filesystem */
-	copyout(argv[2], argv[3], image_buf, bpb);
+	stats_phase("copy_out");
+	rv = copyout(argv[2], argv[3], vol);
     }
     else if (strncmp("a:", argv[3], 2)==0) 
     {
 	/* copy from external filesystem to FAT-12 disk image */
-	copyin(argv[2], argv[3], image_buf, bpb);
+	stats_phase("copy_in");
+	rv = copyin(argv[2], argv[3], vol);
     } 
     else 
     {
 	usage(argv[0]);
     }
 
-    unmmap_file(image_buf, &fd);
-    return 0;
+    stats_phase("close");
+    close_volume(vol);
+    return rv < 0 ? 1 : 0;
 }
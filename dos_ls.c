@@ -7,6 +7,8 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <string.h>
+#include <stdarg.h>
+#include <getopt.h>
 
 #include "bootsect.h"
 #include "bpb.h"
@@ -15,23 +17,98 @@
 #include "dos.h"
 
 
+/* Listings are formatted into one big buffer and written out a chunk
+   at a time, rather than with a printf() or two per entry.  stdout is
+   flushed before each chunk, which keeps the listing in order with
+   anything else printed there. */
+
+#ifndef OUT_BUFSIZE		/* make check builds it small */
+#define OUT_BUFSIZE (256 * 1024)
+#endif
+
+static struct {
+    char buf[OUT_BUFSIZE];
+    size_t len;
+} out;
+
+void out_flush(void)
+{
+    size_t done = 0;
+    ssize_t n;
+
+    if (out.len > 0)
+        fflush(stdout);
+    while (done < out.len)
+    {
+        n = write(STDOUT_FILENO, out.buf + done, out.len - done);
+        STATS_ADD(syscalls, 1);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            break;              /* nowhere to put it; as fwrite() would */
+        }
+        done += n;
+    }
+    out.len = 0;
+}
+
+/* out_reserve makes room for at least n more bytes in the buffer; n
+   is a handful of bytes, never more than OUT_BUFSIZE */
+static char *out_reserve(size_t n)
+{
+    if (out.len + n > OUT_BUFSIZE)
+        out_flush();
+    return out.buf + out.len;
+}
+
+void out_printf(const char *fmt, ...)
+{
+    va_list ap;
+    int n;
+
+    va_start(ap, fmt);
+    n = vsnprintf(out.buf + out.len, OUT_BUFSIZE - out.len, fmt, ap);
+    va_end(ap);
+    if (n >= 0 && out.len + n >= OUT_BUFSIZE)
+    {
+        /* didn't fit; try again with the buffer empty */
+        out_flush();
+        va_start(ap, fmt);
+        n = vsnprintf(out.buf, OUT_BUFSIZE, fmt, ap);
+        va_end(ap);
+        if (n >= OUT_BUFSIZE)
+            n = OUT_BUFSIZE - 1;
+    }
+    if (n > 0)
+        out.len += n;
+}
+
+/* print_indent adds four spaces a level; a deep tree can need more
+   than the buffer holds, so they go in a buffer's worth at a time */
 void print_indent(int indent)
 {
-    int i;
-    for (i = 0; i < indent*4; i++)
-	printf(" ");
+    size_t left = (size_t)indent * 4, n;
+
+    while (left > 0)
+    {
+        n = left < OUT_BUFSIZE ? left : OUT_BUFSIZE;
+        memset(out_reserve(n), ' ', n);
+        out.len += n;
+        left -= n;
+    }
 }
 
 
-uint16_t print_dirent(struct direntry *dirent, int indent)
+uint32_t print_dirent(struct direntry *dirent, int indent, struct dosvol *vol)
 {
-    uint16_t followclust = 0;
+    uint32_t followclust = 0;
 
     int i;
     char name[9];
     char extension[4];
     uint32_t size;
-    uint16_t file_cluster;
+    uint32_t file_cluster;
     name[8] = ' ';
     extension[3] = ' ';
     memcpy(name, &(dirent->deName[0]), 8);
@@ -80,7 +157,7 @@ uint16_t print_dirent(struct direntry *dirent, int indent)
     }
     else if ((dirent->deAttributes & ATTR_VOLUME) != 0) 
     {
-	printf("Volume: %s\n", name);
+	out_printf("Volume: %s\n", name);
     } 
     else if ((dirent->deAttributes & ATTR_DIRECTORY) != 0) 
     {
@@ -89,8 +166,8 @@ uint16_t print_dirent(struct direntry *dirent, int indent)
 	if ((dirent->deAttributes & ATTR_HIDDEN) != ATTR_HIDDEN)
         {
 	    print_indent(indent);
-    	    printf("%s/ (directory)\n", name);
-            file_cluster = getushort(dirent->deStartCluster);
+    	    out_printf("%s/ (directory)\n", name);
+            file_cluster = dirent_cluster(dirent, vol);
             followclust = file_cluster;
         }
     }
@@ -107,8 +184,8 @@ uint16_t print_dirent(struct direntry *dirent, int indent)
 
 	size = getulong(dirent->deFileSize);
 	print_indent(indent);
-	printf("%s.%s (%u bytes %d clusters) (starting cluster %d) %c%c%c%c\n", 
-               name, extension, size, ((size + 512 - 1) / 512),  getushort(dirent->deStartCluster),
+	out_printf("%s.%s (%u bytes %d clusters) (starting cluster %d) %c%c%c%c\n", 
+               name, extension, size, clusters_for_size(size, vol),  dirent_cluster(dirent, vol),
                ro?'r':' ', 
                    hidden?'h':' ', 
                    sys?'s':' ', 
@@ -119,69 +196,265 @@ uint16_t print_dirent(struct direntry *dirent, int indent)
 }
 
 
-void follow_dir(uint16_t cluster, int indent,
-		uint8_t *image_buf, struct bpb33* bpb)
+/* tree_entry is the dir_walk() visitor for the indented listing */
+static int tree_entry(struct walk_entry *e, void *arg)
 {
-    while (is_valid_cluster(cluster, bpb))
-    {
-        struct direntry *dirent = (struct direntry*)cluster_to_addr(cluster, image_buf, bpb);
+    struct dosvol *vol = arg;
 
-        int numDirEntries = (bpb->bpbBytesPerSec * bpb->bpbSecPerClust) / sizeof(struct direntry);
-        int i = 0;
-	for ( ; i < numDirEntries; i++)
-	{
-            
-            uint16_t followclust = print_dirent(dirent, indent);
-            if (followclust)
-                follow_dir(followclust, indent+1, image_buf, bpb);
-            dirent++;
-	}
+    if (print_dirent(e->dirent, e->depth, vol) == 0)
+        return WALK_PRUNE;
+    return 0;
+}
 
-	cluster = get_fat_entry(cluster, image_buf, bpb);
+
+void traverse_root(int flags, struct dosvol *vol)
+{
+    if (dir_walk(MSDOSFSROOT, flags, tree_entry, vol, vol) < 0)
+        fprintf(stderr, "Out of memory\n");
+}
+
+
+/* The structured listings: one record per file or directory, with its
+   full path (using the long name where there is one), size, starting
+   cluster, attributes, timestamps and how many pieces it is in. */
+
+enum { FORMAT_TREE, FORMAT_JSON, FORMAT_CSV };
+
+struct listing {
+    struct dosvol *vol;
+    int format;
+};
+
+/* out_string adds a string to the output, quoted for the format.  A
+   path has no limit on its length, so room is made a character at a
+   time: at most six bytes escaped, and the NUL sprintf() leaves. */
+static void out_string(const char *str, int format)
+{
+    const unsigned char *s = (const unsigned char *)str;
+    char *p;
+    size_t n;
+
+    *out_reserve(1) = '"';
+    out.len++;
+    for (; *s; s++)
+    {
+        p = out_reserve(7);
+        n = 0;
+        if (*s == '"')
+        {
+            p[n++] = format == FORMAT_JSON ? '\\' : '"';
+            p[n++] = '"';
+        }
+        else if (format == FORMAT_JSON && *s == '\\')
+        {
+            p[n++] = '\\';
+            p[n++] = '\\';
+        }
+        else if (format == FORMAT_JSON && *s < 0x20)
+        {
+            n += sprintf(p + n, "\\u%04x", *s);
+        }
+        else
+        {
+            p[n++] = *s;
+        }
+        out.len += n;
     }
+    *out_reserve(1) = '"';
+    out.len++;
 }
 
+/* out_time adds a FAT date and time, or null (nothing, in a CSV) if
+   the date was never set.  A date with no time is just a date. */
+static void out_time(uint8_t *date, uint8_t *time, int format)
+{
+    uint16_t d = getushort(date);
+    uint16_t t;
 
-void traverse_root(uint8_t *image_buf, struct bpb33* bpb)
+    if (d == 0)
+    {
+        if (format == FORMAT_JSON)
+            out_printf("null");
+        return;
+    }
+    out_printf(format == FORMAT_JSON ? "\"%04d-%02d-%02d" : "%04d-%02d-%02d",
+               1980 + ((d & DD_YEAR_MASK) >> DD_YEAR_SHIFT),
+               (d & DD_MONTH_MASK) >> DD_MONTH_SHIFT,
+               (d & DD_DAY_MASK) >> DD_DAY_SHIFT);
+    if (time != NULL)
+    {
+        t = getushort(time);
+        out_printf("T%02d:%02d:%02d",
+                   (t & DT_HOURS_MASK) >> DT_HOURS_SHIFT,
+                   (t & DT_MINUTES_MASK) >> DT_MINUTES_SHIFT,
+                   ((t & DT_2SECONDS_MASK) >> DT_2SECONDS_SHIFT) * 2);
+    }
+    if (format == FORMAT_JSON)
+        out_printf("\"");
+}
+
+/* count_fragments counts the runs of consecutive clusters in a chain,
+   following it no further than max_clusters (0 for the whole chain) */
+static uint32_t count_fragments(uint32_t cluster, uint32_t max_clusters,
+                                struct dosvol *vol)
 {
-    uint16_t cluster = 0;
+    uint32_t fragments = 0, found = 0, prev = 0;
 
-    struct direntry *dirent = (struct direntry*)cluster_to_addr(cluster, image_buf, bpb);
+    if (max_clusters == 0 || max_clusters > vol->max_cluster)
+        max_clusters = vol->max_cluster;
 
-    int i = 0;
-    for ( ; i < bpb->bpbRootDirEnts; i++)
+    while (is_valid_cluster(cluster, vol) && found < max_clusters)
     {
-        uint16_t followclust = print_dirent(dirent, 0);
-        if (is_valid_cluster(followclust, bpb))
-            follow_dir(followclust, 1, image_buf, bpb);
+        if (found == 0 || cluster != prev + 1)
+            fragments++;
+        prev = cluster;
+        found++;
+        cluster = get_fat_entry(cluster, vol);
+    }
+    return fragments;
+}
+
+static void print_record(struct direntry *dirent, const char *path,
+                         struct listing *l)
+{
+    struct dosvol *vol = l->vol;
+    uint32_t size = getulong(dirent->deFileSize);
+    uint32_t cluster = dirent_cluster(dirent, vol);
+    int dir = (dirent->deAttributes & ATTR_DIRECTORY) != 0;
+    char attrs[6];
+    int n = 0;
 
-        dirent++;
+    if (dirent->deAttributes & ATTR_READONLY)
+        attrs[n++] = 'r';
+    if (dirent->deAttributes & ATTR_HIDDEN)
+        attrs[n++] = 'h';
+    if (dirent->deAttributes & ATTR_SYSTEM)
+        attrs[n++] = 's';
+    if (dir)
+        attrs[n++] = 'd';
+    if (dirent->deAttributes & ATTR_ARCHIVE)
+        attrs[n++] = 'a';
+    attrs[n] = '\0';
+
+    if (l->format == FORMAT_JSON)
+    {
+        out_printf("{\"path\":");
+        out_string(path, l->format);
+        out_printf(",\"type\":\"%s\",\"size\":%u,\"cluster\":%u,"
+                   "\"attributes\":\"%s\",\"created\":", 
+                   dir ? "dir" : "file", dir ? 0 : size, cluster, attrs);
+        out_time(dirent->deCDate, dirent->deCTime, l->format);
+        out_printf(",\"modified\":");
+        out_time(dirent->deMDate, dirent->deMTime, l->format);
+        out_printf(",\"accessed\":");
+        out_time(dirent->deADate, NULL, l->format);
+        out_printf(",\"fragments\":%u}\n", 
+                   count_fragments(cluster, 
+                                   dir ? 0 : clusters_for_size(size, vol),
+                                   vol));
     }
+    else
+    {
+        out_string(path, l->format);
+        out_printf(",%s,%u,%u,%s,", dir ? "dir" : "file", 
+                   dir ? 0 : size, cluster, attrs);
+        out_time(dirent->deCDate, dirent->deCTime, l->format);
+        out_printf(",");
+        out_time(dirent->deMDate, dirent->deMTime, l->format);
+        out_printf(",");
+        out_time(dirent->deADate, NULL, l->format);
+        out_printf(",%u\n",
+                   count_fragments(cluster, 
+                                   dir ? 0 : clusters_for_size(size, vol),
+                                   vol));
+    }
+}
+
+/* list_entry is the dir_walk() visitor for the structured listings */
+static int list_entry(struct walk_entry *e, void *arg)
+{
+    if ((e->dirent->deAttributes & ATTR_VOLUME) == 0)
+        print_record(e->dirent, e->path, arg);
+    return 0;
+}
+
+void list_root(int format, int flags, struct dosvol *vol)
+{
+    struct listing l;
+
+    l.vol = vol;
+    l.format = format;
+    if (format == FORMAT_CSV)
+        out_printf("path,type,size,cluster,attributes,"
+                   "created,modified,accessed,fragments\n");
+    if (dir_walk(MSDOSFSROOT, flags, list_entry, &l, vol) < 0)
+        fprintf(stderr, "Out of memory\n");
 }
 
 
 void usage(char *progname)
 {
-    fprintf(stderr, "usage: %s <imagename>\n", progname);
+    fprintf(stderr, "usage: %s [--format=tree|json|csv] [--physical] "
+            "[--stats] <imagename>\n", progname);
+    fprintf(stderr, "\t--physical reads the directories in the order they "
+            "are on disk first\n");
     exit(1);
 }
 
 
 int main(int argc, char** argv)
 {
-    uint8_t *image_buf;
-    int fd;
-    struct bpb33* bpb;
-    if (argc != 2)
+    static const struct option options[] = {
+        { "format", required_argument, NULL, 'f' },
+        { "physical", no_argument, NULL, 'p' },
+        { "stats", no_argument, NULL, 'S' },
+        { NULL, 0, NULL, 0 }
+    };
+    struct dosvol *vol;
+    int format = FORMAT_TREE, flags = 0;
+    int opt;
+
+    while ((opt = getopt_long(argc, argv, "f:p", options, NULL)) != -1)
+    {
+        if (opt == 'p')
+        {
+            flags |= WALK_PHYSICAL;
+            continue;
+        }
+        if (opt == 'S')
+        {
+            stats_start("dos_ls");
+            continue;
+        }
+        if (opt != 'f')
+            usage(argv[0]);
+        if (strcmp(optarg, "tree") == 0)
+            format = FORMAT_TREE;
+        else if (strcmp(optarg, "json") == 0)
+            format = FORMAT_JSON;
+        else if (strcmp(optarg, "csv") == 0)
+            format = FORMAT_CSV;
+        else
+            usage(argv[0]);
+    }
+    if (argc - optind != 1)
     {
 	usage(argv[0]);
     }
 
-    image_buf = mmap_file(argv[1], &fd);
-    bpb = check_bootsector(image_buf);
-    traverse_root(image_buf, bpb);
+    stats_phase("open");
+    vol = open_volume_rdonly(argv[optind]);
+    if (vol == NULL)
+	exit(1);
+    stats_phase("list");
+    if (format == FORMAT_TREE)
+        traverse_root(flags, vol);
+    else
+        list_root(format, flags, vol);
+    out_flush();
 
-    unmmap_file(image_buf, &fd);
+    stats_phase("close");
+    close_volume(vol);
 
     return 0;
 }
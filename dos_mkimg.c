@@ -0,0 +1,692 @@
+/* dos_mkimg makes FAT disk images for testing and benchmarking: any
+   size and FAT type, a tree of directories and files with sizes drawn
+   from a range, some of the files fragmented, and, if asked, damage of
+   the kinds scandisk looks for.  Everything random comes from --seed,
+   so the same options always make the same image.  The damage done is
+   listed on standard output, one JSON line per item, so a test can
+   check a checker against it. */
+
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <stdint.h>
+#include <string.h>
+#include <getopt.h>
+
+#include "bootsect.h"
+#include "bpb.h"
+#include "direntry.h"
+#include "fat.h"
+#include "dos.h"
+
+#define MAX_SPC 128		/* sectors per cluster */
+
+/* a directory being filled; entries go in at the next free slot */
+struct gendir {
+    uint32_t cluster;		/* first cluster, or MSDOSFSROOT */
+    uint32_t last;		/* last cluster of its chain */
+    uint32_t slot;		/* next free slot */
+    uint32_t capacity;		/* slots in the chain so far */
+    int parent;			/* index in gen.dirs, -1 for the root */
+    int num;			/* the number in its name */
+};
+
+/* a file that has been made, for the damage to pick from */
+struct genfile {
+    uint32_t first, last;	/* ends of its chain, 0 if empty */
+    uint32_t clusters;
+    int dir;			/* index in gen.dirs */
+    int num;
+    int damaged;		/* only one kind of damage to a file */
+};
+
+struct gen {
+    struct dosvol *vol;
+    uint64_t rng;
+    struct gendir *dirs;
+    int ndirs;
+    struct genfile *files;
+    int nfiles;
+    uint32_t *gaps;		/* clusters held apart to fragment files */
+    uint32_t ngaps, maxgaps;
+    int sparse;			/* leave file contents as holes */
+    uint8_t *buf;		/* one cluster of file contents */
+};
+
+
+/* xorshift64*, which is small, quick and plenty random for this */
+static uint64_t next_random(uint64_t *state)
+{
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return *state * 0x2545f4914f6cdd1dULL;
+}
+
+static uint64_t random_below(struct gen *g, uint64_t n)
+{
+    return n == 0 ? 0 : next_random(&g->rng) % n;
+}
+
+static void seed_random(uint64_t *state, uint64_t seed)
+{
+    /* xorshift can't start from zero */
+    *state = seed * 0x9e3779b97f4a7c15ULL + 1;
+    next_random(state);
+}
+
+/* random_size picks a size between min and max, evenly over the powers
+   of two in between rather than evenly over the bytes, so there are
+   lots of small files and a few big ones */
+static uint32_t random_size(struct gen *g, uint32_t min, uint32_t max)
+{
+    int lo = 0, hi = 0, bits;
+    uint64_t base, size;
+
+    if (min >= max)
+	return min;
+    while (lo < 32 && (1ULL << lo) <= min)
+	lo++;
+    while (hi < 32 && (1ULL << hi) <= max)
+	hi++;
+    bits = lo + random_below(g, hi - lo + 1);
+    base = bits == 0 ? 0 : 1ULL << (bits - 1);
+    size = base + random_below(g, base == 0 ? 1 : base);
+    if (size < min)
+	size = min;
+    if (size > max)
+	size = max;
+    return size;
+}
+
+
+/* dir_path writes the path of directory d into path, which has room
+   for MAXPATHLEN characters */
+static void dir_path(struct gen *g, int d, char *path)
+{
+    char name[16];
+
+    if (d < 0 || g->dirs[d].parent < 0)
+    {
+	path[0] = '\0';
+	return;
+    }
+    dir_path(g, g->dirs[d].parent, path);
+    sprintf(name, "D%05d/", g->dirs[d].num);
+    strncat(path, name, MAXPATHLEN - strlen(path));
+}
+
+static void file_path(struct gen *g, struct genfile *f, char *path)
+{
+    char name[16];
+
+    dir_path(g, f->dir, path);
+    sprintf(name, "F%07d.DAT", f->num);
+    strncat(path, name, MAXPATHLEN - strlen(path));
+}
+
+
+/* new_cluster allocates one cluster at the end of chain last (0 for a
+   new chain), and returns it, or 0 if the volume is full */
+static uint32_t new_cluster(struct gen *g, uint32_t last)
+{
+    uint32_t cluster, got;
+
+    cluster = alloc_run(g->vol, 1, &got);
+    if (got == 0)
+    {
+	fprintf(stderr, "The image is full\n");
+	return 0;
+    }
+    if (last != 0)
+	set_fat_entry(last, cluster, g->vol);
+    return cluster;
+}
+
+/* hold_gap takes the next free cluster out of the way until the tree is
+   made, so that the file being written skips over it */
+static int hold_gap(struct gen *g)
+{
+    uint32_t got, cluster;
+
+    if (g->ngaps == g->maxgaps)
+    {
+	uint32_t *more;
+
+	g->maxgaps = g->maxgaps ? 2 * g->maxgaps : 1024;
+	more = realloc(g->gaps, g->maxgaps * sizeof(uint32_t));
+	if (more == NULL)
+	{
+	    fprintf(stderr, "Out of memory\n");
+	    return -1;
+	}
+	g->gaps = more;
+    }
+    cluster = alloc_run(g->vol, 1, &got);
+    if (got == 0)
+	return 0;		/* nothing left to skip over */
+    g->gaps[g->ngaps++] = cluster;
+    return 0;
+}
+
+/* new_entry returns the next free slot of directory d, growing it if it
+   is full; the FAT-12 and FAT-16 root can't grow, so NULL then */
+static struct direntry *new_entry(struct gen *g, int d)
+{
+    struct gendir *dir = &g->dirs[d];
+    struct dosvol *vol = g->vol;
+    uint32_t per_cluster = vol->cluster_size / sizeof(struct direntry);
+    uint32_t cluster;
+
+    if (dir->slot == dir->capacity)
+    {
+	if (dir->cluster == MSDOSFSROOT)
+	{
+	    fprintf(stderr, "The root directory is full\n");
+	    return NULL;
+	}
+	cluster = new_cluster(g, dir->last);
+	if (cluster == 0)
+	    return NULL;
+	memset(cluster_to_addr(cluster, vol), 0, vol->cluster_size);
+	dir->last = cluster;
+	dir->capacity += per_cluster;
+    }
+
+    if (dir->cluster == MSDOSFSROOT)
+	return (struct direntry *)root_dir_addr(vol) + dir->slot++;
+    cluster = dir->slot < per_cluster ? dir->cluster
+	: dir->slot >= dir->capacity - per_cluster ? dir->last
+	: chain_seek(dir->cluster, dir->slot / per_cluster, vol);
+    return (struct direntry *)cluster_to_addr(cluster, vol)
+	+ dir->slot++ % per_cluster;
+}
+
+/* put_entry fills in a directory entry */
+static void put_entry(struct direntry *dirent, const char *name,
+		      const char *ext, int attr, uint32_t cluster,
+		      uint32_t size)
+{
+    uint16_t date = (40 << 9) | (1 << 5) | 1;	/* 1 January 2020 */
+    uint16_t time = 12 << 11;			/* noon */
+
+    memset(dirent, 0, sizeof(*dirent));
+    memset(dirent->deName, ' ', sizeof(dirent->deName));
+    memset(dirent->deExtension, ' ', sizeof(dirent->deExtension));
+    memcpy(dirent->deName, name, strlen(name));
+    memcpy(dirent->deExtension, ext, strlen(ext));
+    dirent->deAttributes = attr;
+    set_dirent_cluster(dirent, cluster);
+    putulong(dirent->deFileSize, size);
+    putushort(dirent->deMDate, date);
+    putushort(dirent->deMTime, time);
+}
+
+/* make_dir adds directory number num to directory parent */
+static int make_dir(struct gen *g, int parent, int num)
+{
+    struct gendir *dir = &g->dirs[g->ndirs];
+    struct direntry *dirent;
+    uint32_t cluster;
+    char name[16];
+
+    sprintf(name, "D%05d", num);
+    dirent = new_entry(g, parent);
+    cluster = dirent == NULL ? 0 : new_cluster(g, 0);
+    if (cluster == 0)
+	return -1;
+    memset(cluster_to_addr(cluster, g->vol), 0, g->vol->cluster_size);
+    put_entry(dirent, name, "", ATTR_DIRECTORY, cluster, 0);
+
+    dir->cluster = dir->last = cluster;
+    dir->capacity = g->vol->cluster_size / sizeof(struct direntry);
+    dir->slot = 0;
+    dir->parent = parent;
+    dir->num = num;
+    put_entry(new_entry(g, g->ndirs), ".", "", ATTR_DIRECTORY, cluster, 0);
+    put_entry(new_entry(g, g->ndirs), "..", "", ATTR_DIRECTORY,
+	      g->dirs[parent].cluster == g->vol->root_cluster
+	      ? MSDOSFSROOT : g->dirs[parent].cluster, 0);
+    g->ndirs++;
+    return 0;
+}
+
+/* fill writes the contents of file number num, cluster by cluster, from
+   a stream of its own so that a file's contents don't depend on what
+   was made before it */
+static void fill(struct gen *g, uint32_t cluster, uint64_t *stream,
+		 uint32_t bytes)
+{
+    uint32_t i;
+    uint64_t word;
+
+    for (i = 0; i < bytes; i += sizeof(word))
+    {
+	word = next_random(stream);
+	memcpy(g->buf + i, &word,
+	       bytes - i < sizeof(word) ? bytes - i : sizeof(word));
+    }
+    vol_write(g->vol, cluster_to_offset(cluster, g->vol), g->buf, bytes);
+}
+
+/* make_file adds file num of size bytes to directory d.  A fragmented
+   file is written in runs of one to four clusters, with a cluster held
+   back after each run. */
+static int make_file(struct gen *g, int d, int num, uint32_t size,
+		     int fragmented, uint64_t seed)
+{
+    struct genfile *f = &g->files[g->nfiles];
+    struct direntry *dirent;
+    uint32_t i, run = 0, cluster, bytes;
+    uint64_t stream;
+    char name[16];
+
+    dirent = new_entry(g, d);
+    if (dirent == NULL)
+	return -1;
+    memset(f, 0, sizeof(*f));
+    f->dir = d;
+    f->num = num;
+    f->clusters = clusters_for_size(size, g->vol);
+    seed_random(&stream, seed ^ ((uint64_t)num << 32));
+
+    for (i = 0; i < f->clusters; i++)
+    {
+	if (fragmented && i > 0 && run-- == 0)
+	{
+	    if (hold_gap(g) < 0)
+		return -1;
+	    run = random_below(g, 4);
+	}
+	cluster = new_cluster(g, f->last);
+	if (cluster == 0)
+	    return -1;
+	if (f->first == 0)
+	    f->first = cluster;
+	f->last = cluster;
+
+	if (!g->sparse)
+	{
+	    bytes = size - i * g->vol->cluster_size;
+	    if (bytes > g->vol->cluster_size)
+		bytes = g->vol->cluster_size;
+	    fill(g, cluster, &stream, bytes);
+	}
+    }
+
+    sprintf(name, "F%07d", num);
+    put_entry(dirent, name, "DAT", ATTR_ARCHIVE, f->first, size);
+    g->nfiles++;
+    return 0;
+}
+
+
+/* The damage.  Each kind is what scandisk is meant to find: clusters in
+   use that no file owns, chains that end before the file does, two
+   files sharing clusters, and chains that loop. */
+
+/* pick_file picks an undamaged file of at least min clusters, or
+   returns NULL if a few tries don't find one */
+static struct genfile *pick_file(struct gen *g, uint32_t min)
+{
+    struct genfile *f;
+    int tries;
+
+    for (tries = 0; tries < 64 && g->nfiles > 0; tries++)
+    {
+	f = &g->files[random_below(g, g->nfiles)];
+	if (!f->damaged && f->clusters >= min)
+	{
+	    f->damaged = 1;
+	    return f;
+	}
+    }
+    return NULL;
+}
+
+static void report(const char *kind, struct gen *g, struct genfile *f,
+		   const char *fmt, uint32_t a, uint32_t b)
+{
+    char path[MAXPATHLEN + 1];
+
+    printf("{\"damage\":\"%s\"", kind);
+    if (f != NULL)
+    {
+	file_path(g, f, path);
+	printf(",\"path\":\"%s\"", path);
+    }
+    printf(fmt, a, b);
+    printf("}\n");
+}
+
+static int make_orphan(struct gen *g)
+{
+    uint32_t n = 1 + random_below(g, 4), first = 0, last = 0, i;
+
+    for (i = 0; i < n; i++)
+    {
+	last = new_cluster(g, last);
+	if (last == 0)
+	    return -1;
+	if (first == 0)
+	    first = last;
+    }
+    report("orphan", g, NULL, ",\"cluster\":%u,\"clusters\":%u", first, n);
+    return 0;
+}
+
+static int truncate_chain(struct gen *g)
+{
+    struct genfile *f = pick_file(g, 2);
+    uint32_t keep, cluster, next, i;
+
+    if (f == NULL)
+	return -1;
+    keep = 1 + random_below(g, f->clusters - 1);
+    cluster = chain_seek(f->first, keep - 1, g->vol);
+    next = get_fat_entry(cluster, g->vol);
+    set_fat_entry(cluster, CLUST_EOFE, g->vol);
+    for (i = keep; i < f->clusters; i++)
+    {
+	cluster = next;
+	next = get_fat_entry(cluster, g->vol);
+	set_fat_entry(cluster, CLUST_FREE, g->vol);
+    }
+    report("truncated", g, f, ",\"clusters\":%u,\"of\":%u", keep, f->clusters);
+    return 0;
+}
+
+static int cross_link(struct gen *g)
+{
+    struct genfile *a = pick_file(g, 1), *b = pick_file(g, 1);
+    uint32_t into, cluster;
+
+    if (a == NULL || b == NULL)
+	return -1;
+    into = random_below(g, b->clusters);
+    cluster = chain_seek(b->first, into, g->vol);
+    set_fat_entry(a->last, cluster, g->vol);
+    report("crosslink", g, a, ",\"cluster\":%u,\"into_cluster\":%u",
+	   a->last, cluster);
+    return 0;
+}
+
+static int make_cycle(struct gen *g)
+{
+    struct genfile *f = pick_file(g, 1);
+    uint32_t back, cluster;
+
+    if (f == NULL)
+	return -1;
+    back = random_below(g, f->clusters);
+    cluster = chain_seek(f->first, back, g->vol);
+    set_fat_entry(f->last, cluster, g->vol);
+    report("cycle", g, f, ",\"cluster\":%u,\"back_to\":%u", f->last, cluster);
+    return 0;
+}
+
+
+/* parse_size reads a byte count, with an optional K, M or G */
+static int parse_size(const char *arg, uint64_t *bytes)
+{
+    unsigned long long n;
+    char *end;
+
+    errno = 0;
+    n = strtoull(arg, &end, 0);
+    if (end == arg || arg[0] == '-' || errno == ERANGE)
+	return -1;
+    switch (*end)
+    {
+    case 'G': case 'g': n <<= 10;	/* fall through */
+    case 'M': case 'm': n <<= 10;	/* fall through */
+    case 'K': case 'k': n <<= 10; end++;
+    }
+    if (*end != '\0')
+	return -1;
+    *bytes = n;
+    return 0;
+}
+
+/* pick_geometry fills in whichever of the FAT type and sectors per
+   cluster weren't given, the way the usual formatters would */
+static int pick_geometry(uint64_t sectors, int *fat_type, int *spc)
+{
+    if (*fat_type == 0)
+	*fat_type = sectors <= 32768 ? 12 : sectors <= 1048576 ? 16 : 32;
+    if (*spc != 0)
+	return 0;
+
+    switch (*fat_type)
+    {
+    case 12:
+    case 16:
+	/* the smallest clusters that keep under the cluster limit */
+	for (*spc = 1; *spc < MAX_SPC; *spc *= 2)
+	    if (sectors / *spc < (*fat_type == 12 ? 4000 : 65000))
+		break;
+	break;
+    default:
+	/* 4K clusters, unless that leaves too few for FAT32 */
+	for (*spc = 8; *spc > 1; *spc /= 2)
+	    if (sectors / *spc > 66000)
+		break;
+	break;
+    }
+    return 0;
+}
+
+
+void usage(char *progname)
+{
+    fprintf(stderr, "usage: %s [options] <imagename>\n", progname);
+    fprintf(stderr,
+	    "\t--size=bytes       image size, with K, M or G (1440K)\n"
+	    "\t--fat=12|16|32     FAT type (from the size)\n"
+	    "\t--cluster=bytes    cluster size (from the size)\n"
+	    "\t--label=name       volume label\n"
+	    "\t--files=n          number of files (100)\n"
+	    "\t--depth=n          levels of directories below the root (2)\n"
+	    "\t--fanout=n         subdirectories in each directory (4)\n"
+	    "\t--min-size=bytes   smallest file (0)\n"
+	    "\t--max-size=bytes   biggest file (64K)\n"
+	    "\t--big=bytes        also one file this big in the root\n"
+	    "\t--fragment=percent files that are fragmented (0)\n"
+	    "\t--sparse           leave file contents as holes\n"
+	    "\t--seed=n           seed for everything random (1)\n"
+	    "\t--orphans=n        chains that no file owns\n"
+	    "\t--truncate=n       files whose chain is too short\n"
+	    "\t--crosslink=n      files whose chain runs into another's\n"
+	    "\t--cycles=n         files whose chain loops\n"
+	    "\t--stats            report counters and timings on stderr\n");
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    enum { O_SIZE = 256, O_FAT, O_CLUSTER, O_LABEL, O_FILES, O_DEPTH,
+	   O_FANOUT, O_MIN, O_MAX, O_BIG, O_FRAGMENT, O_SPARSE, O_SEED,
+	   O_ORPHANS, O_TRUNCATE, O_CROSSLINK, O_CYCLES, O_STATS };
+    static const struct option options[] = {
+	{ "size", required_argument, NULL, O_SIZE },
+	{ "fat", required_argument, NULL, O_FAT },
+	{ "cluster", required_argument, NULL, O_CLUSTER },
+	{ "label", required_argument, NULL, O_LABEL },
+	{ "files", required_argument, NULL, O_FILES },
+	{ "depth", required_argument, NULL, O_DEPTH },
+	{ "fanout", required_argument, NULL, O_FANOUT },
+	{ "min-size", required_argument, NULL, O_MIN },
+	{ "max-size", required_argument, NULL, O_MAX },
+	{ "big", required_argument, NULL, O_BIG },
+	{ "fragment", required_argument, NULL, O_FRAGMENT },
+	{ "sparse", no_argument, NULL, O_SPARSE },
+	{ "seed", required_argument, NULL, O_SEED },
+	{ "orphans", required_argument, NULL, O_ORPHANS },
+	{ "truncate", required_argument, NULL, O_TRUNCATE },
+	{ "crosslink", required_argument, NULL, O_CROSSLINK },
+	{ "cycles", required_argument, NULL, O_CYCLES },
+	{ "stats", no_argument, NULL, O_STATS },
+	{ NULL, 0, NULL, 0 }
+    };
+    uint64_t size = 1440 * 1024, cluster = 0, min = 0, max = 64 * 1024;
+    uint64_t big = 0, seed = 1, n = 0, room;
+    int fat_type = 0, spc = 0, files = 100, depth = 2, fanout = 4;
+    int fragment = 0, orphans = 0, truncated = 0, crosslinks = 0;
+    int cycles = 0, opt, i, d, level, first, end, rv = 1;
+    char *label = NULL;
+    struct gen g;
+
+    memset(&g, 0, sizeof(g));
+    while ((opt = getopt_long(argc, argv, "", options, NULL)) != -1)
+    {
+	if (opt != O_LABEL && opt != O_SPARSE && opt != O_STATS && opt != '?'
+	    && parse_size(optarg, &n) < 0)
+	    usage(argv[0]);
+	switch (opt)
+	{
+	case O_SIZE: size = n; break;
+	case O_FAT: fat_type = n; break;
+	case O_CLUSTER: cluster = n; break;
+	case O_LABEL: label = optarg; break;
+	case O_FILES: files = n; break;
+	case O_DEPTH: depth = n; break;
+	case O_FANOUT: fanout = n; break;
+	case O_MIN: min = n; break;
+	case O_MAX: max = n; break;
+	case O_BIG: big = n; break;
+	case O_FRAGMENT: fragment = n; break;
+	case O_SPARSE: g.sparse = 1; break;
+	case O_SEED: seed = n; break;
+	case O_ORPHANS: orphans = n; break;
+	case O_TRUNCATE: truncated = n; break;
+	case O_CROSSLINK: crosslinks = n; break;
+	case O_CYCLES: cycles = n; break;
+	case O_STATS: stats_start("dos_mkimg"); break;
+	default:
+	    usage(argv[0]);
+	}
+    }
+    if (argc - optind != 1 || max > UINT32_MAX || big > UINT32_MAX
+	|| min > max || size / 512 > UINT32_MAX || fragment > 100
+	|| (fat_type != 0 && fat_type != 12 && fat_type != 16
+	    && fat_type != 32)
+	|| (cluster != 0 && (cluster < 512 || cluster > 512 * MAX_SPC)))
+	usage(argv[0]);
+
+    spc = cluster / 512;
+    pick_geometry(size / 512, &fat_type, &spc);
+    stats_phase("format");
+    if (format_volume(argv[optind], fat_type, size / 512, spc, label) < 0)
+	exit(1);
+    g.vol = open_volume(argv[optind]);
+    if (g.vol == NULL)
+	exit(1);
+
+    /* a file bigger than the data area would run the image out of
+       clusters half way through */
+    room = (uint64_t)(g.vol->max_cluster - CLUST_FIRST) 
+	* g.vol->cluster_size;
+    if (big > room || max > room)
+    {
+	fprintf(stderr, "--%s=%llu is more than the image holds "
+		"(%llu bytes)\n", big > room ? "big" : "max-size",
+		(unsigned long long)(big > room ? big : max),
+		(unsigned long long)room);
+	close_volume(g.vol);
+	exit(1);
+    }
+
+    /* the root, then each level of the tree below it in turn */
+    for (n = 1, i = 0, level = 1; i < depth; i++)
+    {
+	level *= fanout;
+	n += level;
+    }
+    g.dirs = calloc(n, sizeof(struct gendir));
+    g.files = calloc(files + 1, sizeof(struct genfile));
+    g.buf = malloc(g.vol->cluster_size);
+    if (g.dirs == NULL || g.files == NULL || g.buf == NULL)
+    {
+	fprintf(stderr, "Out of memory\n");
+	goto out;
+    }
+    seed_random(&g.rng, seed);
+    stats_phase("tree");
+
+    g.dirs[0].cluster = g.dirs[0].last = g.vol->root_cluster;
+    g.dirs[0].parent = -1;
+    if (g.vol->root_cluster == MSDOSFSROOT)
+	g.dirs[0].capacity = g.vol->bpb.bpbRootDirEnts;
+    else
+	g.dirs[0].capacity = g.vol->cluster_size / sizeof(struct direntry);
+    if (label != NULL && *label != '\0')
+	g.dirs[0].slot = 1;	/* format_volume() put the label there */
+    g.ndirs = 1;
+
+    /* with no directories below it, the files all go in the root, and
+       the FAT-12 and FAT-16 root can't grow */
+    if (g.vol->root_cluster == MSDOSFSROOT && (depth == 0 || fanout == 0)
+	&& (uint64_t)files + (big > 0) > g.dirs[0].capacity - g.dirs[0].slot)
+    {
+	fprintf(stderr, "The root directory only holds %u files; "
+		"use --depth to put the rest in directories\n",
+		g.dirs[0].capacity - g.dirs[0].slot);
+	goto out;
+    }
+
+    for (first = 0, end = 1, level = 0; level < depth; level++)
+    {
+	for (d = first; d < end; d++)
+	    for (i = 0; i < fanout; i++)
+		if (make_dir(&g, d, i) < 0)
+		    goto out;
+	first = end;
+	end = g.ndirs;
+    }
+
+    if (big > 0 && make_file(&g, 0, 0, big, 0, seed) < 0)
+	goto out;
+    for (i = 0; i < files; i++)
+    {
+	/* anywhere in the tree; if that's the full FAT-16 root, the
+	   first directory below it */
+	d = random_below(&g, g.ndirs);
+	if (d == 0 && g.dirs[0].cluster == MSDOSFSROOT
+	    && g.dirs[0].slot == g.dirs[0].capacity && g.ndirs > 1)
+	    d = 1;
+	if (make_file(&g, d, i + 1, random_size(&g, min, max),
+		      random_below(&g, 100) < fragment, seed) < 0)
+	    goto out;
+    }
+
+    /* let go of the clusters that fragmented the files; they are the
+       holes a real volume would have from files that were deleted */
+    for (n = 0; n < g.ngaps; n++)
+	set_fat_entry(g.gaps[n], CLUST_FREE, g.vol);
+
+    stats_phase("damage");
+    for (i = 0; i < orphans; i++)
+	if (make_orphan(&g) < 0)
+	    goto out;
+    for (i = 0; i < truncated; i++)
+	if (truncate_chain(&g) < 0)
+	    fprintf(stderr, "No file is long enough to truncate\n");
+    for (i = 0; i < crosslinks; i++)
+	if (cross_link(&g) < 0)
+	    fprintf(stderr, "No files left to cross link\n");
+    for (i = 0; i < cycles; i++)
+	if (make_cycle(&g) < 0)
+	    fprintf(stderr, "No files left to make a cycle in\n");
+    rv = 0;
+
+out:
+    stats_phase("close");
+    close_volume(g.vol);
+    free(g.dirs);
+    free(g.files);
+    free(g.gaps);
+    free(g.buf);
+    return rv;
+}
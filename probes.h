@@ -0,0 +1,53 @@
+#ifndef __PROBES_H__
+#define __PROBES_H__
+
+/* Static tracepoints for perf and bpftrace, under the provider
+   "dosvol".  Where <sys/sdt.h> is installed each probe is a single
+   nop in the code plus a note in the ELF file, so they are always
+   compiled in; list them with
+
+	perf list sdt_dosvol:*		(after perf buildid-cache --add)
+	bpftrace -l 'usdt:./scandisk:dosvol:*'
+
+   Without <sys/sdt.h>, or with NO_PROBES defined, the probes compile
+   to nothing.  Volumes are identified by the struct dosvol pointer
+   that volume_open hands out.
+
+	volume_open(vol, filename, size, fat_type)
+	volume_close(vol)
+	chain_start(vol, cluster)		a chain is about to be followed
+	chain_end(vol, cluster, clusters)	... and was this long
+	dir_start(vol, cluster)			a directory is about to be read
+	dir_end(vol, cluster, rv)
+	copy_start(vol, name, bytes)		a file is about to be copied;
+						bytes is 0 if not yet known
+	copy_end(vol, name, bytes, rv)
+	repair(vol, kind, cluster)		scandisk changed something:
+						"defect", "loop", "too_big",
+						"broken", "size", "orphan"
+						or "orphan_end" */
+
+#if defined(__has_include) && !defined(NO_PROBES)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define HAVE_PROBES 1
+#endif
+#endif
+
+#ifdef HAVE_PROBES
+#define DOS_PROBE1(name, a) DTRACE_PROBE1(dosvol, name, a)
+#define DOS_PROBE2(name, a, b) DTRACE_PROBE2(dosvol, name, a, b)
+#define DOS_PROBE3(name, a, b, c) DTRACE_PROBE3(dosvol, name, a, b, c)
+#define DOS_PROBE4(name, a, b, c, d) DTRACE_PROBE4(dosvol, name, a, b, c, d)
+#else
+/* the arguments are still used, so nothing computed only for a probe
+   is left unused */
+#define DOS_PROBE1(name, a) do { (void)(a); } while (0)
+#define DOS_PROBE2(name, a, b) do { (void)(a); (void)(b); } while (0)
+#define DOS_PROBE3(name, a, b, c) \
+    do { (void)(a); (void)(b); (void)(c); } while (0)
+#define DOS_PROBE4(name, a, b, c, d) \
+    do { (void)(a); (void)(b); (void)(c); (void)(d); } while (0)
+#endif
+
+#endif // __PROBES_H__
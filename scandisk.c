@@ -7,18 +7,89 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <string.h>
+#include <stdarg.h>
+#include <dirent.h>
+#include <time.h>
 #include <assert.h>
+#include <pthread.h>
+#include <getopt.h>
 
 #include "bootsect.h"
 #include "bpb.h"
 #include "direntry.h"
 #include "fat.h"
 #include "dos.h"
-
-// cc: histogram of length 2848. tells you how many times a cluster is refered to by the fat
-
-int cc[4096] = {0}; //from 2^12
-static int id = 0;
+#include "probes.h"
+
+// refs: one counter per cluster, telling how many times a cluster is
+// referred to by a directory entry or a FAT chain.  Each worker of the
+// walk keeps its own map; they are summed into scan.refs afterwards.
+// Counts stop at 255, which is plenty to tell 0, 1 and "more".
+
+// how a FAT chain ended when the walk followed it
+#define CHAIN_EOF 0
+#define CHAIN_BAD 1       // ran into a cluster marked bad
+#define CHAIN_BROKEN 2    // ran into a free or out of range cluster
+#define CHAIN_LOOP 3      // longer than the volume: it loops back on itself
+
+// a file or volume label that needs reporting.  The workers only look;
+// the findings are replayed, and the repairs made, on one thread in
+// directory order once the walk is over.
+struct finding {
+    uint64_t order;       // root entry << 32 | position in its subtree
+    struct direntry *dirent;
+    uint32_t count;       // clusters in the FAT chain
+    uint32_t last;        // last cluster walked
+    int end;              // CHAIN_*
+    char *path;           // for the JSON records, or NULL
+};
+
+struct scan;
+
+struct worker {
+    pthread_t thread;
+    struct scan *scan;
+    uint8_t *refs;
+    struct finding *found;
+    size_t nfound;
+    size_t space;
+    uint64_t order;
+    char top[MAXFILENAME];        // the root entry being walked
+    const char *path;             // and where under it, or NULL
+};
+
+struct scan {
+    struct dosvol *vol;
+    uint8_t *refs;                // merged reference counts
+    struct direntry **roots;      // root directory entries, one work item each
+    uint32_t nroots;
+    uint32_t next_root;
+    pthread_mutex_t lock;
+
+    int rdonly;                   // -n: report what is wrong, change nothing
+    int json;                     // fleet mode: JSON records, no text
+    const char *image;            // path of the image, for the records
+    char label[MAXFILENAME];      // volume label, if the walk found one
+    int fat_type;
+    uint32_t nclusters;
+    uint32_t nfindings;
+    uint32_t norphans;
+    uint32_t ncrosslinks;
+    double open_s, check_s, orphan_s, close_s;
+};
+
+// a JSON record being put together, so that it goes out in one piece
+// even with several images being checked at once
+struct record {
+    FILE *f;
+    char *buf;
+    size_t len;
+};
+
+static void add_ref(uint8_t *refs, uint32_t cluster) {
+    if (refs[cluster] != 255)
+        refs[cluster]++;
+}
 
 #define FIND_FILE 0
 #define FIND_DIR 1
@@ -102,19 +173,19 @@ void get_name(char *fullname, struct direntry *dirent) {
 }
 
 
-struct direntry* find_file(char *infilename, uint16_t cluster,
+struct direntry* find_file(char *infilename, uint32_t cluster,
                int find_mode,
-               uint8_t *image_buf, struct bpb33* bpb)
+               struct dosvol *vol)
 {
     char buf[MAXPATHLEN];
     char *seek_name, *next_name;
     int d;
     struct direntry *dirent;
-    uint16_t dir_cluster;
+    uint32_t dir_cluster;
     char fullname[13];
 
     /* find the first dirent in this directory */
-    dirent = (struct direntry*)cluster_to_addr(cluster, image_buf, bpb);
+    dirent = (struct direntry*)cluster_to_addr(cluster, vol);
 
     /* first we need to split the file name we're looking for into the
        first part of the path, and the remainder.  We hunt through the
@@ -122,7 +193,8 @@ struct direntry* find_file(char *infilename, uint16_t cluster,
        and what we find is a directory, then we recurse, and search
        that directory for the remainder */
 
-    strncpy(buf, infilename, MAXPATHLEN);
+    strncpy(buf, infilename, MAXPATHLEN - 1);
+    buf[MAXPATHLEN - 1] = '\0';
     seek_name = buf;
 
     /* trim leading slashes */
@@ -160,7 +232,7 @@ struct direntry* find_file(char *infilename, uint16_t cluster,
        end of the cluster, we'll need to go to the next cluster
        for this directory */
     for (d = 0; 
-         d < bpb->bpbBytesPerSec * bpb->bpbSecPerClust; 
+         d < vol->cluster_size; 
          d += sizeof(struct direntry)) 
     {
         if (dirent->deName[0] == SLOT_EMPTY) 
@@ -188,9 +260,9 @@ struct direntry* find_file(char *infilename, uint16_t cluster,
             fprintf(stderr, "Cannot copy out a directory\n");
             exit(1);
             }
-            dir_cluster = getushort(dirent->deStartCluster);
+            dir_cluster = dirent_cluster(dirent, vol);
             return find_file(next_name, dir_cluster, 
-                     find_mode, image_buf, bpb);
+                     find_mode, vol);
         } 
         else if ((dirent->deAttributes & ATTR_VOLUME) != 0) 
         {
@@ -216,24 +288,30 @@ struct direntry* find_file(char *infilename, uint16_t cluster,
     } 
     else 
     {
-        cluster = get_fat_entry(cluster, image_buf, bpb);
+        cluster = get_fat_entry(cluster, vol);
+        STATS_ADD(cluster_hops, 1);
+        if (!is_valid_cluster(cluster, vol))
+        {
+            /* ran off the end of the directory */
+            return NULL;
+        }
         dirent = (struct direntry*)cluster_to_addr(cluster, 
-                               image_buf, bpb);
+                               vol);
     }
     }
 }
 
-uint16_t copy_in_file(FILE* fd, uint8_t *image_buf, struct bpb33* bpb, 
+uint32_t copy_in_file(FILE* fd, struct dosvol *vol, 
               uint32_t *size)
 {
     uint32_t clust_size, total_clusters, i;
     uint8_t *buf;
     size_t bytes;
-    uint16_t start_cluster = 0;
-    uint16_t prev_cluster = 0;
+    uint32_t start_cluster = 0;
+    uint32_t prev_cluster = 0;
     
-    clust_size = bpb->bpbSecPerClust * bpb->bpbBytesPerSec;
-    total_clusters = bpb->bpbSectors / bpb->bpbSecPerClust;
+    clust_size = vol->cluster_size;
+    total_clusters = vol->max_cluster;
     buf = malloc(clust_size);
     while(1) 
     {
@@ -245,7 +323,7 @@ uint16_t copy_in_file(FILE* fd, uint8_t *image_buf, struct bpb33* bpb,
         /* find a free cluster */
         for (i = 2; i < total_clusters; i++) 
         {
-        if (get_fat_entry(i, image_buf, bpb) == CLUST_FREE) 
+        if (get_fat_entry(i, vol) == CLUST_FREE) 
         {
             break;
         }
@@ -269,14 +347,14 @@ uint16_t copy_in_file(FILE* fd, uint8_t *image_buf, struct bpb33* bpb,
         {
         /* link the previous cluster to this one in the FAT */
         assert(prev_cluster != 0);
-        set_fat_entry(prev_cluster, i, image_buf, bpb);
+        set_fat_entry(prev_cluster, i, vol);
         }
 
         /* make sure we've recorded this cluster as used */
-        set_fat_entry(i, FAT12_MASK&CLUST_EOFS, image_buf, bpb);
+        set_fat_entry(i, (vol->fat_mask & CLUST_EOFS), vol);
 
         /* copy the data into the cluster */
-        memcpy(cluster_to_addr(i, image_buf, bpb), buf, clust_size);
+        memcpy(cluster_to_addr(i, vol), buf, clust_size);
     }
 
     if (bytes < clust_size) 
@@ -292,108 +370,19 @@ uint16_t copy_in_file(FILE* fd, uint8_t *image_buf, struct bpb33* bpb,
     return start_cluster;
 }
 
-void write_dirent(struct direntry *dirent, char *filename, 
-          uint16_t start_cluster, uint32_t size)
-{
-    char *p, *p2;
-    char *uppername;
-    int len, i;
-
-    /* clean out anything old that used to be here */
-    memset(dirent, 0, sizeof(struct direntry));
-
-    /* extract just the filename part */
-    uppername = strdup(filename);
-    p2 = uppername;
-    for (i = 0; i < strlen(filename); i++) 
-    {
-        if (p2[i] == '/' || p2[i] == '\\') 
-        {
-            uppername = p2+i+1;
-        }
-    }
-
-    /* convert filename to upper case */
-    for (i = 0; i < strlen(uppername); i++) 
-    {
-    uppername[i] = toupper(uppername[i]);
-    }
-
-    /* set the file name and extension */
-    memset(dirent->deName, ' ', 8);
-    p = strchr(uppername, '.');
-    memcpy(dirent->deExtension, "___", 3);
-    if (p == NULL) 
-    {
-    fprintf(stderr, "No filename extension given - defaulting to .___\n");
-    }
-    else 
-    {
-    *p = '\0';
-    p++;
-    len = strlen(p);
-    if (len > 3) len = 3;
-    memcpy(dirent->deExtension, p, len);
-    }
-
-    if (strlen(uppername)>8) 
-    {
-    uppername[8]='\0';
-    }
-    memcpy(dirent->deName, uppername, strlen(uppername));
-    free(p2);
-
-    /* set the attributes and file size */
-    dirent->deAttributes = ATTR_NORMAL;
-    putushort(dirent->deStartCluster, start_cluster);
-    putulong(dirent->deFileSize, size);
-
-    /* could also set time and date here if we really
-       cared... */
-}
-
-void create_dirent(struct direntry *dirent, char *filename, 
-           uint16_t start_cluster, uint32_t size,
-           uint8_t *image_buf, struct bpb33* bpb)
-{
-    while (1) 
-    {
-    if (dirent->deName[0] == SLOT_EMPTY) 
-    {
-        /* we found an empty slot at the end of the directory */
-        write_dirent(dirent, filename, start_cluster, size);
-        dirent++;
-
-        /* make sure the next dirent is set to be empty, just in
-           case it wasn't before */
-        memset((uint8_t*)dirent, 0, sizeof(struct direntry));
-        dirent->deName[0] = SLOT_EMPTY;
-        return;
-    }
-
-    if (dirent->deName[0] == SLOT_DELETED) 
-    {
-        /* we found a deleted entry - we can just overwrite it */
-        write_dirent(dirent, filename, start_cluster, size);
-        return;
-    }
-    dirent++;
-    }
-}
-
 void copyin(char *infilename, char* outfilename,
-        uint8_t *image_buf, struct bpb33* bpb)
+        struct dosvol *vol)
 {
     struct direntry *dirent = (void*)1;
     FILE *fd;
-    uint16_t start_cluster;
+    uint32_t start_cluster;
     uint32_t size = 0;
 
     assert(strncmp("a:", outfilename, 2)==0);
     outfilename+=2;
 
     /* check that the file doesn't already exist */
-    dirent = find_file(outfilename, 0, FIND_FILE, image_buf, bpb);
+    dirent = find_file(outfilename, vol->root_cluster, FIND_FILE, vol);
     if (dirent != NULL) 
     {
     fprintf(stderr, "File %s already exists\n", outfilename);
@@ -401,7 +390,7 @@ void copyin(char *infilename, char* outfilename,
     }
 
     /* find the dirent of the directory to put the file in */
-    dirent = find_file(outfilename, 0, FIND_DIR, image_buf, bpb);
+    dirent = find_file(outfilename, vol->root_cluster, FIND_DIR, vol);
     if (dirent == NULL) 
     {
     fprintf(stderr, "Directory does not exists in the disk image\n");
@@ -418,45 +407,162 @@ void copyin(char *infilename, char* outfilename,
     }
 
     /* do the actual copy in*/
-    start_cluster = copy_in_file(fd, image_buf, bpb, &size);
+    start_cluster = copy_in_file(fd, vol, &size);
 
     /* create the directory entry */
-    create_dirent(dirent, outfilename, start_cluster, size, image_buf, bpb);
+    create_dirent(dirent, outfilename, start_cluster, size, vol);
     
     fclose(fd);
 }
 
 void usage(char *progname) {
-    fprintf(stderr, "usage: %s <imagename>\n", progname);
+    fprintf(stderr, "usage: %s [-j threads] [-p] [-n] [--stats] <imagename>\n", progname);
+    fprintf(stderr, "       %s --fleet [-P images] [-j threads] [-p] [-n] [--stats] <image or directory>...\n", progname);
+    fprintf(stderr, "\t-p reads the directories in the order they are on disk first\n");
+    fprintf(stderr, "\t-n, --report-only opens the images read only and repairs nothing\n");
+    fprintf(stderr, "\t--fleet checks many images, -P at a time, reporting in JSON lines\n");
+    fprintf(stderr, "\t--stats reports counters and timings on stderr\n");
     exit(1);
 }
 
-int count_clusters(int start_orphan, uint8_t *image_buf, struct bpb33* bpb){
-    id++;
-    uint16_t fat_entry = get_fat_entry(start_orphan, image_buf, bpb);
-    uint16_t prev_fat = start_orphan;
+// say prints the usual free-form report; in fleet mode the JSON
+// records take its place
+static void say(struct scan *scan, const char *fmt, ...)
+{
+    va_list ap;
+
+    if (scan->json)
+        return;
+    va_start(ap, fmt);
+    vprintf(fmt, ap);
+    va_end(ap);
+}
+
+// json_string writes s as a JSON string.  Bytes from 0x80 up are
+// passed through, as names are UTF-8 if anything.
+static void json_string(FILE *f, const char *s)
+{
+    putc('"', f);
+    for (; *s != '\0'; s++) {
+        unsigned char c = *s;
+
+        if (c == '"' || c == '\\')
+            fprintf(f, "\\%c", c);
+        else if (c < 0x20 || c == 0x7f)
+            fprintf(f, "\\u%04x", c);
+        else
+            putc(c, f);
+    }
+    putc('"', f);
+}
+
+// record_start begins a record of the given type, about the image the
+// scan is checking, if any
+static void record_start(struct record *r, const char *type, 
+                         struct scan *scan)
+{
+    r->f = open_memstream(&r->buf, &r->len);
+    if (r->f == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+    fprintf(r->f, "{\"type\":\"%s\"", type);
+    if (scan != NULL) {
+        fprintf(r->f, ",\"image\":");
+        json_string(r->f, scan->image);
+    }
+}
+
+// record_end writes the record out as one line
+static void record_end(struct record *r)
+{
+    fputs("}\n", r->f);
+    if (fclose(r->f) != 0) {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+    flockfile(stdout);
+    fwrite(r->buf, 1, r->len, stdout);
+    fflush(stdout);
+    funlockfile(stdout);
+    free(r->buf);
+}
 
-    int count = 1;
+// finding_start counts a finding and, in fleet mode, starts its record
+// for the caller to add to; repaired says whether it has been fixed.  Returns NULL if there is no record.
+static FILE *finding_start(struct record *r, struct scan *scan, 
+                           const char *kind, uint32_t cluster, int repaired)
+{
+    scan->nfindings++;
+    if (!scan->json)
+        return NULL;
+    record_start(r, "finding", scan);
+    fprintf(r->f, ",\"kind\":\"%s\",\"cluster\":%u,\"repaired\":%s", 
+            kind, cluster, repaired ? "true" : "false");
+    return r->f;
+}
 
-    while (!(is_end_of_file(fat_entry))){
-		//printf("%i\n", fat_entry);
-        //this bad entry thing might not even work!!!
-        if (fat_entry == (FAT12_MASK & CLUST_BAD)){
-            printf("Defect in cluster %i\n", prev_fat);
-            cc[prev_fat] = -1;
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// count_clusters claims an orphan chain, walking it exactly once.  The
+// chain is ended where it would run into a bad or free cluster, off the
+// FAT, or into clusters that are already accounted for; with -n it is
+// only counted.
+int count_clusters(uint32_t start_orphan, struct scan *scan){
+    struct dosvol *vol = scan->vol;
+    uint32_t cluster = start_orphan;
+    int count = 0;
+
+    for (;;) {
+        uint32_t fat_entry = get_fat_entry(cluster, vol);
+
+        STATS_ADD(cluster_hops, 1);
+        add_ref(scan->refs, cluster);
+        count++;
+        if (is_end_of_file(fat_entry, vol))
+            break;
+        if (fat_entry == (vol->fat_mask & CLUST_BAD))
+            say(scan, "Defect in cluster %u\n", cluster);
+        if (!is_valid_cluster(fat_entry, vol) || scan->refs[fat_entry] != 0) {
+            if (!scan->rdonly) {
+                DOS_PROBE3(repair, vol, "orphan_end", cluster);
+                set_fat_entry(cluster, (vol->fat_mask & CLUST_EOFS), vol);
+            }
+            break;
         }
-        else{
-			cc[prev_fat] = id;
-		}
-        prev_fat = fat_entry;
-        fat_entry = get_fat_entry(fat_entry, image_buf, bpb);
-        count ++;
+        cluster = fat_entry;
     }
-	cc[prev_fat]=id;
     return count;
 }
 
-void fix_orphan(int start_orphan, uint8_t *image_buf, struct bpb33* bpb, int count){
+// claim_root counts any clusters the root directory has grown by, so
+// that the orphan search doesn't take them for another orphan
+static void claim_root(struct scan *scan)
+{
+    struct dosvol *vol = scan->vol;
+    uint32_t cluster = vol->root_cluster;
+    uint32_t walked = 0;
+
+    while (is_valid_cluster(cluster, vol) && walked++ < vol->max_cluster) {
+        if (scan->refs[cluster] == 0)
+            add_ref(scan->refs, cluster);
+        cluster = get_fat_entry(cluster, vol);
+        STATS_ADD(cluster_hops, 1);
+    }
+}
+
+// fix_orphan gives an orphan chain a name, foundN.dat, in the root
+// directory.  On FAT32 the root gets another cluster if it is full.
+void fix_orphan(uint32_t start_orphan, struct scan *scan, int count){
+    struct dosvol *vol = scan->vol;
+    struct record r;
+    int fixed = 0;
 	char str[32];
 	char orphan_file[32];
 	sprintf(str, "%d",count);
@@ -464,124 +570,392 @@ void fix_orphan(int start_orphan, uint8_t *image_buf, struct bpb33* bpb, int cou
     strcat(orphan_file, str);
     strcat(orphan_file, ".dat");
 
-    int size_of_orphan_cluster = count_clusters(start_orphan, image_buf, bpb);
-	//printf("Found orphan at cluster: %i with size: %i\n",start_orphan, size_of_orphan_cluster);
-
-    printf(str);
-    printf("\n");
+    int size_of_orphan_cluster = count_clusters(start_orphan, scan);
 
-    //uint8_t root_dir = root_dir_addr(image_buf, bpb);
-    uint16_t cluster = 0; // should be free cluster number
+    say(scan, "%s\n", str);
+    scan->norphans++;
+    if (!scan->rdonly) {
+        struct direntry *dirent = (struct direntry*)cluster_to_addr(vol->root_cluster, vol);
 
-    struct direntry *dirent = (struct direntry*)cluster_to_addr(cluster, image_buf, bpb);
+        DOS_PROBE3(repair, vol, "orphan", start_orphan);
+        fixed = create_dirent(dirent, orphan_file, start_orphan, 
+                              size_of_orphan_cluster*vol->cluster_size, vol) == 0;
+        vol_release(vol, dirent);
+        claim_root(scan);
+    }
+    if (finding_start(&r, scan, "orphan", start_orphan, fixed) != NULL) {
+        fprintf(r.f, ",\"count\":%d", size_of_orphan_cluster);
+        if (fixed) {
+            fprintf(r.f, ",\"path\":");
+            json_string(r.f, orphan_file);
+        }
+        record_end(&r);
+    }
+    if (fixed)
+        say(scan, "Should be fixed now\n");
+}
 
-    create_dirent(dirent, orphan_file, start_orphan, size_of_orphan_cluster*512, image_buf, bpb);
+// is_orphan is true for a cluster that is part of some chain but that
+// nothing found by the directory walk refers to
+static int is_orphan(uint32_t cluster, struct scan *scan)
+{
+    uint32_t fat_entry;
 
-    //write_dirent(dirent, orphan_file, start_orphan, size_of_orphan_cluster*512); //i don't think this is the right file size?
-    
-    id++;
-    cc[start_orphan] = id;
-    return;
+    if (scan->refs[cluster] != 0)
+        return 0;
+    fat_entry = get_fat_entry(cluster, scan->vol);
+    return is_valid_cluster(fat_entry, scan->vol) || 
+           is_end_of_file(fat_entry, scan->vol);
 }
 
-int find_orphan(uint8_t *image_buf, struct bpb33* bpb){
+// find_orphan recovers the chains no directory entry reaches.  One pass
+// over the FAT counts the links pointing at each cluster; an orphan
+// cluster with no links into it is the head of a chain, and each chain
+// is then walked once from its head.  Whatever is still unclaimed after
+// that can only be chains that loop back on themselves, which are
+// broken open at their lowest cluster.
+int find_orphan(struct scan *scan){
+    struct dosvol *vol = scan->vol;
+    uint8_t *indegree;
+    uint32_t c;
     int count=0;
-    uint16_t cluster = 0;
-    struct direntry *dirent = (struct direntry*)cluster_to_addr(cluster, image_buf, bpb);
-
-    for (int i = 5; i<2848; i++){ // for each cluster 2848, we never go through 0-4 from the directory search?
-        if (cc[i]==0){
-			int fat_entry = get_fat_entry(i,image_buf,bpb);
-			if (fat_entry==(FAT12_MASK&CLUST_BAD)){
-				set_fat_entry(i,(FAT12_MASK & CLUST_EOFS),image_buf,bpb);
-				printf("Errorrrrr...\n");
-			}
-            if (is_valid_cluster(fat_entry,bpb)|| is_end_of_file(fat_entry)) {
-			//if (fat_entry!= (FAT12_MASK&CLUST_FREE)){
-                //printf("orphan found: %i, %i\n",i ,fat_entry);
-			
-                fix_orphan(i, image_buf, bpb, count);
-                count++;
-				printf("Should be fixed now\n");
 
-            }
+    indegree = calloc(vol->max_cluster, 1);
+    if (indegree == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+    for (c = CLUST_FIRST; c < vol->max_cluster; c++) {
+        uint32_t fat_entry = get_fat_entry(c, vol);
+
+        if (is_valid_cluster(fat_entry, vol))
+            add_ref(indegree, fat_entry);
+    }
+
+    for (c = CLUST_FIRST; c < vol->max_cluster; c++) {
+        if (indegree[c] == 0 && is_orphan(c, scan)) {
+            fix_orphan(c, scan, count);
+            count++;
         }
     }
+    for (c = CLUST_FIRST; c < vol->max_cluster; c++) {
+        if (is_orphan(c, scan)) {
+            fix_orphan(c, scan, count);
+            count++;
+        }
+    }
+
+    free(indegree);
 	return count;
 }
 
-int traverse_fat(struct direntry *dirent, uint8_t *image_buf, struct bpb33* bpb){
-    id++;
-    uint16_t start_cluster = getushort(dirent->deStartCluster);
-    uint32_t size = getulong(dirent->deFileSize);
-    size = ((size+511)/512);
-    uint16_t fat_entry = get_fat_entry(start_cluster, image_buf, bpb);
-    uint16_t prev_fat = start_cluster;
-    int count = 1;
-
-
-    while (!(is_end_of_file(fat_entry))){
-        //this bad entry thing might not even work!!!
-        if (fat_entry == (FAT12_MASK & CLUST_BAD)){
-            printf("Defect in cluster %i\n", count);
-            cc[prev_fat] = -1;
-			set_fat_entry(fat_entry,(FAT12_MASK&CLUST_EOFS), image_buf, bpb);
-			return count;
-        }
-        if (count >= size){
-            uint16_t tmp = get_fat_entry(fat_entry, image_buf, bpb);
-
-            //unlink the previous entry with this entry.
-            if (count==size){
-                printf("FAT tooo big:\n");
-                fflush(stdout);
-                set_fat_entry(prev_fat, (FAT12_MASK&CLUST_EOFS), image_buf, bpb);
-                assert(get_fat_entry(prev_fat,image_buf,bpb)==(FAT12_MASK&CLUST_EOFS));
-				cc[prev_fat] = id;
-            }
+static void add_finding(struct worker *w, struct direntry *dirent,
+                        uint32_t count, uint32_t last, int end)
+{
+    struct finding *f;
 
-            //set the current cluster to free
-            set_fat_entry(fat_entry, (FAT12_MASK&CLUST_FREE), image_buf, bpb);
-            assert(get_fat_entry(fat_entry, image_buf, bpb)==0);
-            //prev_fat = fat_entry;
-            fat_entry = tmp;
-            count++;
+    if (w->nfound == w->space) {
+        w->space = w->space ? w->space * 2 : 64;
+        w->found = realloc(w->found, w->space * sizeof(struct finding));
+        if (w->found == NULL) {
+            fprintf(stderr, "Out of memory\n");
+            exit(1);
+        }
+    }
+    f = &w->found[w->nfound++];
+    f->order = w->order++;
+    f->dirent = dirent;
+    vol_hold(w->scan->vol, dirent);     // past the end of the walk
+    f->count = count;
+    f->last = last;
+    f->end = end;
+    f->path = NULL;
+
+    // the JSON records name the file by its path from the root
+    if (w->scan->json) {
+        size_t len = strlen(w->top) + (w->path ? strlen(w->path) : 0) + 2;
+
+        f->path = malloc(len);
+        if (f->path == NULL) {
+            fprintf(stderr, "Out of memory\n");
+            exit(1);
+        }
+        if (w->path != NULL)
+            snprintf(f->path, len, "/%s%s", w->top, w->path);
+        else
+            snprintf(f->path, len, "/%s", w->top);
+    }
+}
 
+// walk_file follows the FAT chain of one file without changing
+// anything.  The clusters the file gets to keep are counted in the
+// worker's map; anything past its size is left unreferenced, since the
+// repair will free it.
+static void walk_file(struct worker *w, struct direntry *dirent)
+{
+    struct dosvol *vol = w->scan->vol;
+    uint32_t want = clusters_for_size(getulong(dirent->deFileSize), vol);
+    uint32_t keep = want ? want : 1;
+    uint32_t cluster = dirent_cluster(dirent, vol);
+    uint32_t last = cluster;
+    uint32_t count = 0;
+    int end = CHAIN_EOF;
+
+    DOS_PROBE2(chain_start, vol, cluster);
+    while (is_valid_cluster(cluster, vol)) {
+        uint32_t next;
+
+        if (count < keep)
+            add_ref(w->refs, cluster);
+        last = cluster;
+        if (++count >= vol->max_cluster) {
+            end = CHAIN_LOOP;
+            break;
         }
-        else {
-            //go to next entry
-            cc[prev_fat] = id;
-            prev_fat = fat_entry;
-            fat_entry = get_fat_entry(fat_entry, image_buf, bpb);
-            count ++;
+        next = get_fat_entry(cluster, vol);
+        STATS_ADD(cluster_hops, 1);
+        if (is_end_of_file(next, vol))
+            break;
+        if (next == (vol->fat_mask & CLUST_BAD)) {
+            end = CHAIN_BAD;
+            break;
         }
+        if (!is_valid_cluster(next, vol)) {
+            end = CHAIN_BROKEN;
+            break;
+        }
+        cluster = next;
     }
-    //count++;
-    if (size>count){
-        printf("Metadata is bigger than cluster data: \n");
-        putulong(dirent->deFileSize, count*512);
+    DOS_PROBE3(chain_end, vol, dirent_cluster(dirent, vol), count);
+
+    if (end != CHAIN_EOF || count != want)
+        add_finding(w, dirent, count, last, end);
+}
+
+// count_dir counts a directory's clusters in the worker's map.  It
+// stops at a cluster this worker has already counted, and returns 0 if
+// the directory was counted before, so a directory that contains
+// itself is only walked once.
+static int count_dir(struct worker *w, uint32_t cluster)
+{
+    struct dosvol *vol = w->scan->vol;
+    int counted = 0;
+
+    while (is_valid_cluster(cluster, vol) && w->refs[cluster] == 0) {
+        add_ref(w->refs, cluster);
+        counted = 1;
+        cluster = get_fat_entry(cluster, vol);
+        STATS_ADD(cluster_hops, 1);
+    }
+    return counted;
+}
+
+// walk_dirent checks one entry.  It returns WALK_PRUNE for a directory
+// that shouldn't be walked.
+static int walk_dirent(struct worker *w, struct direntry *dirent)
+{
+    uint8_t first = dirent->deName[0];
+
+    if (first == SLOT_EMPTY || first == SLOT_DELETED || first == 0x2E)
+        return WALK_PRUNE;
+    if ((dirent->deAttributes & ATTR_WIN95LFN) == ATTR_WIN95LFN)
+        return WALK_PRUNE;
+    if ((dirent->deAttributes & ATTR_VOLUME) != 0) {
+        add_finding(w, dirent, 0, 0, CHAIN_EOF);
+        return WALK_PRUNE;
+    }
+    if ((dirent->deAttributes & ATTR_DIRECTORY) != 0) {
+        // don't deal with hidden directories; MacOS makes these
+        // for trash directories and such; just ignore them.
+        if ((dirent->deAttributes & ATTR_HIDDEN) == ATTR_HIDDEN)
+            return WALK_PRUNE;
+        if (!count_dir(w, dirent_cluster(dirent, w->scan->vol)))
+            return WALK_PRUNE;
+        return 0;
+    }
+    walk_file(w, dirent);
+    return 0;
+}
+
+// check_entry is the dir_walk() visitor for everything under the root
+// entries
+static int check_entry(struct walk_entry *e, void *arg)
+{
+    struct worker *w = arg;
+    int rv;
+
+    w->path = e->path;
+    rv = walk_dirent(w, e->dirent);
+    w->path = NULL;
+    return rv;
+}
+
+// walk_root checks a root entry and, if it is a directory, the tree
+// under it.  The walker keeps its stack on the heap, so a deep or
+// looping tree can't run a worker thread out of stack.
+static void walk_root(struct worker *w, struct direntry *dirent)
+{
+    struct dosvol *vol = w->scan->vol;
+
+    STATS_ADD(dirents, 1);    // root entries don't come through dir_read
+    if (w->scan->json)
+        get_name(w->top, dirent);
+    if (walk_dirent(w, dirent) == 0 
+        && (dirent->deAttributes & ATTR_DIRECTORY) != 0) {
+        if (dir_walk(dirent_cluster(dirent, vol), 0, check_entry, w, vol) < 0) {
+            fprintf(stderr, "Out of memory\n");
+            exit(1);
+        }
+    }
+}
+
+// each worker takes the next unclaimed root entry and walks everything
+// under it
+static void *walk_worker(void *arg)
+{
+    struct worker *w = arg;
+    struct scan *scan = w->scan;
+
+    stats_thread();
+    for (;;) {
+        uint32_t root;
+
+        pthread_mutex_lock(&scan->lock);
+        root = scan->next_root++;
+        pthread_mutex_unlock(&scan->lock);
+        if (root >= scan->nroots)
+            break;
+        w->order = (uint64_t)root << 32;
+        walk_root(w, scan->roots[root]);
+    }
+    return NULL;
+}
+
+// collect_roots lists the root directory entries.  On FAT32 the root
+// is a cluster chain, which is counted in the merged map directly.
+static void collect_roots(struct scan *scan)
+{
+    struct dosvol *vol = scan->vol;
+    uint32_t entries = vol->cluster_size / sizeof(struct direntry);
+    uint32_t cluster = vol->root_cluster;
+    uint32_t i;
+
+    if (cluster == MSDOSFSROOT) {
+        struct direntry *dirent = (struct direntry*)root_dir_addr(vol);
+
+        scan->nroots = vol->bpb.bpbRootDirEnts;
+        scan->roots = malloc(scan->nroots * sizeof(struct direntry*));
+        if (scan->roots == NULL) {
+            fprintf(stderr, "Out of memory\n");
+            exit(1);
+        }
+        for (i = 0; i < scan->nroots; i++)
+            scan->roots[i] = dirent + i;
+        return;
+    }
+
+    scan->nroots = 0;
+    scan->roots = NULL;
+    while (is_valid_cluster(cluster, vol) && scan->refs[cluster] == 0) {
+        struct direntry *dirent = (struct direntry*)cluster_to_addr(cluster, vol);
+
+        add_ref(scan->refs, cluster);
+        scan->roots = realloc(scan->roots, 
+                              (scan->nroots + entries) * sizeof(struct direntry*));
+        if (scan->roots == NULL) {
+            fprintf(stderr, "Out of memory\n");
+            exit(1);
+        }
+        for (i = 0; i < entries; i++)
+            scan->roots[scan->nroots++] = dirent + i;
+        cluster = get_fat_entry(cluster, vol);
+        STATS_ADD(cluster_hops, 1);
     }
-	cc[prev_fat]=id;
+}
+
+// release_roots gives back the root directory collect_roots mapped
+static void release_roots(struct scan *scan)
+{
+    struct dosvol *vol = scan->vol;
+    uint32_t entries = vol->cluster_size / sizeof(struct direntry);
+    uint32_t i;
+
+    if (vol->root_cluster == MSDOSFSROOT) {
+        if (scan->nroots > 0)
+            vol_release(vol, scan->roots[0]);
+    }
+    else {
+        for (i = 0; i < scan->nroots; i += entries)
+            vol_release(vol, scan->roots[i]);
+    }
+    free(scan->roots);
+    scan->roots = NULL;
+}
+
+static int compare_findings(const void *a, const void *b)
+{
+    const struct finding *fa = a, *fb = b;
+
+    if (fa->order != fb->order)
+        return fa->order < fb->order ? -1 : 1;
+    return 0;
+}
+
+// chain_length counts the clusters in a chain, giving up after as many
+// clusters as the volume holds
+static uint32_t chain_length(uint32_t cluster, struct dosvol *vol)
+{
+    uint32_t count = 0;
+
+    while (is_valid_cluster(cluster, vol) && count < vol->max_cluster) {
+        count++;
+        cluster = get_fat_entry(cluster, vol);
+    }
+    STATS_ADD(cluster_hops, count);
     return count;
 }
 
-uint16_t build_cc(struct direntry *dirent, struct bpb33 *bpb, uint8_t *image_buf){
-    uint16_t followclust = 0;
+// cut_chain ends a chain after keep clusters and frees what hung off
+// it, stopping at anything the walk found referenced.  With -n the
+// chain is left as it is and what would have been freed is counted as
+// referenced instead, so find_orphan() doesn't report it again.
+static void cut_chain(struct scan *scan, uint32_t cluster, uint32_t keep)
+{
+    struct dosvol *vol = scan->vol;
+    uint32_t next;
 
-    int i;
-    char name[9];
-    char extension[4];
-    uint32_t size;
-    uint16_t file_cluster;
-    name[8] = ' ';
-    extension[3] = ' ';
-    memcpy(name, &(dirent->deName[0]), 8);
-    memcpy(extension, dirent->deExtension, 3);
+    while (--keep > 0 && is_valid_cluster(get_fat_entry(cluster, vol), vol)) {
+        cluster = get_fat_entry(cluster, vol);
+        STATS_ADD(cluster_hops, 1);
+    }
+    next = get_fat_entry(cluster, vol);
+    if (!scan->rdonly)
+        set_fat_entry(cluster, (vol->fat_mask & CLUST_EOFS), vol);
 
-    if (name[0] == SLOT_EMPTY || ((uint8_t)name[0]) == SLOT_DELETED || ((uint8_t)name[0]) == 0x2E )
-    {
-        return followclust;
+    while (is_valid_cluster(next, vol) && scan->refs[next] == 0) {
+        uint32_t fat_entry = get_fat_entry(next, vol);
+
+        if (fat_entry == (vol->fat_mask & CLUST_FREE) ||
+            fat_entry == (vol->fat_mask & CLUST_BAD))
+            break;
+        if (scan->rdonly)
+            add_ref(scan->refs, next);
+        else
+            set_fat_entry(next, (vol->fat_mask & CLUST_FREE), vol);
+        next = fat_entry;
+        STATS_ADD(cluster_hops, 1);
     }
+}
+
+// print_volume reports the volume label; fleet mode keeps it for the
+// image's summary
+static void print_volume(struct scan *scan, struct direntry *dirent)
+{
+    char name[9];
+    int i;
+
+    memcpy(name, &(dirent->deName[0]), 8);
+    name[8] = ' ';
 
     /* names are space padded - remove the spaces */
     for (i = 8; i > 0; i--) 
@@ -591,147 +965,525 @@ uint16_t build_cc(struct direntry *dirent, struct bpb33 *bpb, uint8_t *image_buf
         else 
             break;
     }
+    if (scan->json)
+        snprintf(scan->label, sizeof(scan->label), "%s", name);
+    say(scan, "Volume: %s\n", name);
+}
 
-    /* remove the spaces from extensions */
-    for (i = 3; i > 0; i--) 
-    {
-        if (extension[i] == ' ') 
-            extension[i] = '\0';
-        else 
-            break;
+// repair_file makes the fixes for one file the walk flagged, and
+// reports them the way the single threaded scandisk always has.  With
+// -n it only reports them.
+static void repair_file(struct scan *scan, struct finding *f)
+{
+    struct dosvol *vol = scan->vol;
+    struct direntry *dirent = f->dirent;
+    uint32_t size = getulong(dirent->deFileSize);
+    uint32_t want = clusters_for_size(size, vol);
+    uint32_t start = dirent_cluster(dirent, vol);
+    uint32_t count = f->count;
+    int fix = !scan->rdonly;
+    const char *kind = NULL;
+    struct record r;
+    char name[MAXFILENAME];
+
+    if (f->end == CHAIN_BAD) {
+        kind = "defect";
+        say(scan, "Defect in cluster %u\n", count);
+        if (fix) {
+            DOS_PROBE3(repair, vol, kind, f->last);
+            set_fat_entry(f->last, (vol->fat_mask & CLUST_EOFS), vol);
+        }
     }
-    if ((dirent->deAttributes & ATTR_WIN95LFN) == ATTR_WIN95LFN){
+    else if (f->end == CHAIN_LOOP) {
+        kind = "loop";
+        say(scan, "FAT chain loops back on itself:\n");
+        if (fix)
+            DOS_PROBE3(repair, vol, kind, start);
+        cut_chain(scan, start, want ? want : 1);
+        if (fix) {
+            count = chain_length(start, vol);
+            if (want > count)
+                putulong(dirent->deFileSize, (uint64_t)count*vol->cluster_size);
+        }
     }
-    
-    else if ((dirent->deAttributes & ATTR_VOLUME) != 0) {
-        printf("Volume: %s\n", name);
-    } 
-
-    else if ((dirent->deAttributes & ATTR_DIRECTORY) != 0) 
-        {
-        // don't deal with hidden directories; MacOS makes these
-        // for trash directories and such; just ignore them.
-        if ((dirent->deAttributes & ATTR_HIDDEN) != ATTR_HIDDEN)
-            {
-                file_cluster = getushort(dirent->deStartCluster);
-                followclust = file_cluster;
+    else if (count > want) {
+        kind = "too_big";
+        say(scan, "FAT tooo big:\n");
+        if (fix)
+            DOS_PROBE3(repair, vol, kind, start);
+        cut_chain(scan, start, want ? want : 1);
+    }
+    else {
+        if (f->end == CHAIN_BROKEN) {
+            kind = "broken";
+            say(scan, "Broken FAT chain:\n");
+            if (fix) {
+                DOS_PROBE3(repair, vol, kind, f->last);
+                set_fat_entry(f->last, (vol->fat_mask & CLUST_EOFS), vol);
+            }
+        }
+        if (want > count) {
+            if (kind == NULL)
+                kind = "size";
+            say(scan, "Metadata is bigger than cluster data: \n");
+            if (fix) {
+                DOS_PROBE3(repair, vol, "size", start);
+                putulong(dirent->deFileSize, (uint64_t)count*vol->cluster_size);
             }
+        }
     }
 
-    else 
-    {
-        /*
-         * a "regular" file entry
-         * print attributes, size, starting cluster, etc.
-         */
-    int ro = (dirent->deAttributes & ATTR_READONLY) == ATTR_READONLY;
-    int hidden = (dirent->deAttributes & ATTR_HIDDEN) == ATTR_HIDDEN;
-    int sys = (dirent->deAttributes & ATTR_SYSTEM) == ATTR_SYSTEM;
-    int arch = (dirent->deAttributes & ATTR_ARCHIVE) == ATTR_ARCHIVE;
-
-    size = getulong(dirent->deFileSize);
-    int count = traverse_fat(dirent, image_buf, bpb);
-    if (count!=((size+511)/512)){
-        printf("\t%s.%s (%u bytes %d clusters) (starting cluster %d) %c%c%c%c\n", 
-               name, extension, size, ((size + 512 - 1) / 512),  getushort(dirent->deStartCluster),
-               ro?'r':' ', 
-                   hidden?'h':' ', 
-                   sys?'s':' ', 
-                   arch?'a':' ');
-        printf ("********Discrepancy: %i metadata clusters != %i FAT clusters\n", (size + 511)/512, count);
-		printf("Should be Fixed Now!\n");
-    }
-            
+    if (kind != NULL && finding_start(&r, scan, kind, start, fix) != NULL) {
+        fprintf(r.f, ",\"path\":");
+        json_string(r.f, f->path);
+        fprintf(r.f, ",\"size\":%u,\"want\":%u,\"count\":%u,\"last\":%u", 
+                size, want, f->count, f->last);
+        record_end(&r);
     }
-    return followclust;
-}
 
-void follow_dir(uint16_t cluster, uint8_t *image_buf, struct bpb33* bpb)
-{
-    while (is_valid_cluster(cluster, bpb))
-    {
-        struct direntry *dirent = (struct direntry*)cluster_to_addr(cluster, image_buf, bpb);
+    if (count != want && !scan->json) {
+        int ro = (dirent->deAttributes & ATTR_READONLY) == ATTR_READONLY;
+        int hidden = (dirent->deAttributes & ATTR_HIDDEN) == ATTR_HIDDEN;
+        int sys = (dirent->deAttributes & ATTR_SYSTEM) == ATTR_SYSTEM;
+        int arch = (dirent->deAttributes & ATTR_ARCHIVE) == ATTR_ARCHIVE;
 
-        int numDirEntries = (bpb->bpbBytesPerSec * bpb->bpbSecPerClust) / sizeof(struct direntry);
-        int i = 0;
-    for ( ; i < numDirEntries; i++)
-    {
-            
-            uint16_t followclust = build_cc(dirent, bpb, image_buf);
-            if (followclust)
-                follow_dir(followclust, image_buf, bpb);
-            dirent++;
-    }
-
-    cluster = get_fat_entry(cluster, image_buf, bpb);
+        get_name(name, dirent);
+        printf("\t%s (%u bytes %u clusters) (starting cluster %u) %c%c%c%c\n", 
+               name, size, want, start,
+               ro?'r':' ', 
+               hidden?'h':' ', 
+               sys?'s':' ', 
+               arch?'a':' ');
+        printf ("********Discrepancy: %u metadata clusters != %u FAT clusters\n", want, count);
+        if (fix)
+            printf("Should be Fixed Now!\n");
     }
 }
 
-void traverse_root(uint8_t *image_buf, struct bpb33* bpb)
+// check_tree walks the directory tree on up to nthreads workers, each
+// counting references into its own map, then sums the maps and replays
+// what the workers found in directory order
+void check_tree(struct scan *scan, int nthreads)
 {
-    uint16_t cluster = 0;
+    struct dosvol *vol = scan->vol;
+    struct worker *workers;
+    struct finding *found;
+    size_t nfound = 0;
+    uint32_t c;
+    int i;
 
-    struct direntry *dirent = (struct direntry*)cluster_to_addr(cluster, image_buf, bpb);
-    int i = 0;
-    for ( ; i < bpb->bpbRootDirEnts; i++)
-    {
-        //printf("traverse root\n");
-        uint16_t followclust = build_cc(dirent, bpb, image_buf);
-        if (is_valid_cluster(followclust, bpb))
-            follow_dir(followclust, image_buf, bpb);
+    collect_roots(scan);
+    if (nthreads > (int)scan->nroots)
+        nthreads = scan->nroots ? scan->nroots : 1;
 
-        dirent++;
+    workers = calloc(nthreads, sizeof(struct worker));
+    if (workers == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+    pthread_mutex_init(&scan->lock, NULL);
+    scan->next_root = 0;
+    for (i = 0; i < nthreads; i++) {
+        workers[i].scan = scan;
+        workers[i].refs = calloc(vol->max_cluster, 1);
+        if (workers[i].refs == NULL) {
+            fprintf(stderr, "Out of memory\n");
+            exit(1);
+        }
+    }
+
+    // the calling thread is worker 0
+    for (i = 1; i < nthreads; i++) {
+        if (pthread_create(&workers[i].thread, NULL, walk_worker, &workers[i]) != 0) {
+            fprintf(stderr, "Can't start worker thread\n");
+            exit(1);
+        }
+    }
+    walk_worker(&workers[0]);
+    for (i = 1; i < nthreads; i++)
+        pthread_join(workers[i].thread, NULL);
+    pthread_mutex_destroy(&scan->lock);
+
+    // the reduction: sum the maps and gather the findings
+    for (i = 0; i < nthreads; i++) {
+        uint8_t *refs = workers[i].refs;
+
+        for (c = CLUST_FIRST; c < vol->max_cluster; c++) {
+            unsigned sum = scan->refs[c] + refs[c];
+            scan->refs[c] = sum > 255 ? 255 : sum;
+        }
+        free(refs);
+        nfound += workers[i].nfound;
+    }
+    found = malloc((nfound ? nfound : 1) * sizeof(struct finding));
+    if (found == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+    nfound = 0;
+    for (i = 0; i < nthreads; i++) {
+        memcpy(found + nfound, workers[i].found, 
+               workers[i].nfound * sizeof(struct finding));
+        nfound += workers[i].nfound;
+        free(workers[i].found);
+    }
+    free(workers);
+    qsort(found, nfound, sizeof(struct finding), compare_findings);
+
+    for (size_t n = 0; n < nfound; n++) {
+        if ((found[n].dirent->deAttributes & ATTR_VOLUME) != 0)
+            print_volume(scan, found[n].dirent);
+        else
+            repair_file(scan, &found[n]);
+        vol_release(vol, found[n].dirent);
+        free(found[n].path);
+    }
+    free(found);
+    release_roots(scan);
+
+    for (c = CLUST_FIRST; c < vol->max_cluster; c++) {
+        if (scan->refs[c] > 1) {
+            struct record r;
+
+            say(scan, "Cross-linked cluster %u\n", c);
+            scan->ncrosslinks++;
+            if (finding_start(&r, scan, "crosslink", c, 0) != NULL) {
+                fprintf(r.f, ",\"refs\":%u", scan->refs[c]);
+                record_end(&r);
+            }
+        }
     }
-    
 }
 
-// uint8_t* find_free_root_dir(uint8_t *image_buf, struct bpb33* bpb)
+// uint8_t* find_free_root_dir(struct dosvol *vol)
 // {
-//     uint16_t cluster = 0;
+//     uint32_t cluster = 0;
 
-//     struct direntry *dirent = (struct direntry*)cluster_to_addr(cluster, image_buf, bpb);
+//     struct direntry *dirent = (struct direntry*)cluster_to_addr(cluster, vol);
     
-//     for (int i = 0; i < bpb->bpbRootDirEnts; i++)
+//     for (int i = 0; i < vol->bpb.bpbRootDirEnts; i++)
 //     {
-//         // uint16_t followclust = build_cc(dirent, bpb, image_buf);
+//         // uint32_t followclust = build_cc(dirent, vol);
 
-//         // if (is_valid_cluster(followclust, bpb))
-//         //     follow_dir(followclust, image_buf, bpb);
+//         // if (is_valid_cluster(followclust, vol))
+//         //     follow_dir(followclust, vol);
 
 //         // dirent++;
 //     }
 // }
 
-
-int main(int argc, char** argv) {
-    uint8_t *image_buf;
-    int fd;
-    struct bpb33* bpb;
-    if (argc < 2) {
-    usage(argv[0]);
+// check_image checks one image: walk the tree making the repairs, then
+// claim the orphans.  scan has the image's path and the options; the
+// rest of it is filled in here, timings included.  Returns -1 if the
+// image couldn't be opened.
+static int check_image(struct scan *scan, int nthreads, int physical)
+{
+    struct dosvol *vol;
+    double t = now(), t2;
+
+    if (!scan->json)
+        stats_phase("open");
+    if (scan->rdonly)
+        vol = open_volume_rdonly((char *)scan->image);
+    else
+        vol = open_volume((char *)scan->image);
+    if (vol == NULL)
+        return -1;
+    scan->vol = vol;
+    scan->fat_type = vol->fat_type;
+    scan->nclusters = vol->max_cluster - CLUST_FIRST;
+    scan->refs = calloc(vol->max_cluster, 1);
+    if (scan->refs == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
     }
+    t2 = now();
+    scan->open_s = t2 - t;
+    t = t2;
 
-    image_buf = mmap_file(argv[1], &fd);
-    bpb = check_bootsector(image_buf);
-    // your code should start here...
-
-    // 1) Traverse Root - For each Directory Entry:
-    //      a) Traverse FAT Entries to make sure directory size matches FAT linked-list_length.
+    // 1) Walk the tree - for each directory entry:
+    //      a) Traverse FAT entries to make sure the file size matches the chain length.
     //      b) Fix any discrepencies, and print which ones they are.
-    // 2) Traverse Through Data Area:
+    // 2) Traverse through the data area:
     //      a) Make sure everything has a proper labeling
-    traverse_root(image_buf, bpb);
+    // with -p, bring the directories in with one forward sweep first
+    if (physical) {
+        if (!scan->json)
+            stats_phase("dir_sweep");
+        dir_sweep(MSDOSFSROOT, vol);
+    }
+    if (!scan->json)
+        stats_phase("check_tree");
+    check_tree(scan, nthreads);
+    t2 = now();
+    scan->check_s = t2 - t;
+    t = t2;
+
+    if (!scan->json)
+        stats_phase("find_orphan");
+    find_orphan(scan);
+    t2 = now();
+    scan->orphan_s = t2 - t;
+    t = t2;
+
+    say(scan, "Done!\n");
+    fflush(stdout);
 
-    // set up
-    uint16_t cluster = 0;
-    //struct direntry *dirent = (struct direntry*)cluster_to_addr(cluster, image_buf, bpb);
-    find_orphan(image_buf, bpb);
+    if (!scan->json)
+        stats_phase("close");
+    close_volume(vol);
+    free(scan->refs);
+    scan->close_s = now() - t;
+    return 0;
+}
 
-    printf("Done!\n");
-    fflush(stdout);
-    //print_cc();
+// Fleet mode checks many images, each on its own struct scan and
+// volume, a bounded number at a time.  Every finding is a JSON line,
+// and each image ends with a summary line:
+//
+//   {"type":"finding","image":...,"kind":...,"cluster":...,"repaired":...}
+//   {"type":"image","image":...,"status":"clean"|"damaged"|"error",...}
+//   {"type":"fleet","images":...,...}     once, at the end
+//
+// The lines of different images interleave as they are checked.
+struct fleet {
+    char **images;
+    size_t nimages;
+    size_t space;
+    size_t next;
+    pthread_mutex_t lock;
+    int nthreads;                 // -j, walk threads for each image
+    int physical;
+    int rdonly;
+    size_t clean, damaged, failed;
+};
+
+static void add_image(struct fleet *fleet, char *path)
+{
+    if (fleet->nimages == fleet->space) {
+        fleet->space = fleet->space ? fleet->space * 2 : 64;
+        fleet->images = realloc(fleet->images, fleet->space * sizeof(char *));
+        if (fleet->images == NULL) {
+            fprintf(stderr, "Out of memory\n");
+            exit(1);
+        }
+    }
+    fleet->images[fleet->nimages++] = path;
+}
+
+static int compare_paths(const void *a, const void *b)
+{
+    return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+// add_operand adds an image, or every regular file in a directory (not
+// its subdirectories), in name order.  Returns -1 if it isn't there.
+static int add_operand(struct fleet *fleet, char *path)
+{
+    struct stat st;
+    struct dirent *de;
+    size_t first = fleet->nimages;
+    DIR *dir;
+
+    if (stat(path, &st) < 0) {
+        fprintf(stderr, "%s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    if (!S_ISDIR(st.st_mode)) {
+        add_image(fleet, path);
+        return 0;
+    }
+    dir = opendir(path);
+    if (dir == NULL) {
+        fprintf(stderr, "%s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    while ((de = readdir(dir)) != NULL) {
+        size_t len = strlen(path) + strlen(de->d_name) + 2;
+        char *image;
+
+        if (de->d_name[0] == '.')
+            continue;
+        image = malloc(len);
+        if (image == NULL) {
+            fprintf(stderr, "Out of memory\n");
+            exit(1);
+        }
+        snprintf(image, len, "%s/%s", path, de->d_name);
+        if (stat(image, &st) < 0 || !S_ISREG(st.st_mode)) {
+            free(image);
+            continue;
+        }
+        add_image(fleet, image);
+    }
+    closedir(dir);
+    qsort(fleet->images + first, fleet->nimages - first, sizeof(char *), 
+          compare_paths);
+    return 0;
+}
+
+// report_image writes an image's summary record
+static void report_image(struct scan *scan, int rv, double wall_s)
+{
+    struct record r;
+
+    record_start(&r, "image", scan);
+    if (rv < 0) {
+        fprintf(r.f, ",\"status\":\"error\",\"error\":\"can't open the image\"");
+    }
+    else {
+        fprintf(r.f, ",\"status\":\"%s\",\"fat_type\":%d,\"clusters\":%u", 
+                scan->nfindings ? "damaged" : "clean", 
+                scan->fat_type, scan->nclusters);
+        if (scan->label[0] != '\0') {
+            fprintf(r.f, ",\"label\":");
+            json_string(r.f, scan->label);
+        }
+        fprintf(r.f, ",\"findings\":%u,\"orphans\":%u,\"crosslinks\":%u", 
+                scan->nfindings, scan->norphans, scan->ncrosslinks);
+        fprintf(r.f, ",\"open_s\":%.6f,\"check_s\":%.6f,\"orphan_s\":%.6f"
+                ",\"close_s\":%.6f", 
+                scan->open_s, scan->check_s, scan->orphan_s, scan->close_s);
+    }
+    fprintf(r.f, ",\"wall_s\":%.6f", wall_s);
+    record_end(&r);
+}
+
+// each fleet worker checks the next image nobody has taken yet
+static void *fleet_worker(void *arg)
+{
+    struct fleet *fleet = arg;
+
+    stats_thread();
+    for (;;) {
+        struct scan scan;
+        size_t n;
+        double t;
+        int rv;
+
+        pthread_mutex_lock(&fleet->lock);
+        n = fleet->next++;
+        pthread_mutex_unlock(&fleet->lock);
+        if (n >= fleet->nimages)
+            break;
+
+        memset(&scan, 0, sizeof(scan));
+        scan.image = fleet->images[n];
+        scan.json = 1;
+        scan.rdonly = fleet->rdonly;
+        t = now();
+        rv = check_image(&scan, fleet->nthreads, fleet->physical);
+        report_image(&scan, rv, now() - t);
+
+        pthread_mutex_lock(&fleet->lock);
+        if (rv < 0)
+            fleet->failed++;
+        else if (scan.nfindings)
+            fleet->damaged++;
+        else
+            fleet->clean++;
+        pthread_mutex_unlock(&fleet->lock);
+    }
+    return NULL;
+}
 
-    unmmap_file(image_buf, &fd);
+// run_fleet checks the images on nworkers threads and returns the exit
+// status: 1 if any image couldn't be checked
+static int run_fleet(struct fleet *fleet, int nworkers)
+{
+    pthread_t *threads;
+    struct record r;
+    double t = now();
+    int i;
+
+    if (nworkers > (int)fleet->nimages)
+        nworkers = fleet->nimages ? fleet->nimages : 1;
+    threads = calloc(nworkers, sizeof(pthread_t));
+    if (threads == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+    pthread_mutex_init(&fleet->lock, NULL);
+    stats_phase("fleet");
+    // the calling thread is worker 0
+    for (i = 1; i < nworkers; i++) {
+        if (pthread_create(&threads[i], NULL, fleet_worker, fleet) != 0) {
+            fprintf(stderr, "Can't start worker thread\n");
+            exit(1);
+        }
+    }
+    fleet_worker(fleet);
+    for (i = 1; i < nworkers; i++)
+        pthread_join(threads[i], NULL);
+    pthread_mutex_destroy(&fleet->lock);
+    free(threads);
+
+    record_start(&r, "fleet", NULL);
+    fprintf(r.f, ",\"images\":%zu,\"clean\":%zu,\"damaged\":%zu,\"failed\":%zu"
+            ",\"workers\":%d,\"report_only\":%s,\"wall_s\":%.6f", 
+            fleet->nimages, fleet->clean, fleet->damaged, fleet->failed,
+            nworkers, fleet->rdonly ? "true" : "false", now() - t);
+    record_end(&r);
+    return fleet->failed ? 1 : 0;
+}
+
+int main(int argc, char** argv) {
+    static const struct option options[] = {
+        { "stats", no_argument, NULL, 'S' },
+        { "fleet", no_argument, NULL, 'F' },
+        { "images", required_argument, NULL, 'P' },
+        { "report-only", no_argument, NULL, 'n' },
+        { NULL, 0, NULL, 0 }
+    };
+    struct scan scan;
+    struct fleet fleet;
+    int nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+    int nimages = nthreads;
+    int physical = 0, rdonly = 0, fleet_mode = 0, set_threads = 0;
+    int opt, i;
+
+    while ((opt = getopt_long(argc, argv, "j:pnP:", options, NULL)) != -1) {
+        if (opt == 'j') {
+            nthreads = atoi(optarg);
+            set_threads = 1;
+        }
+        else if (opt == 'p')
+            physical = 1;
+        else if (opt == 'n')
+            rdonly = 1;
+        else if (opt == 'F')
+            fleet_mode = 1;
+        else if (opt == 'P')
+            nimages = atoi(optarg);
+        else if (opt == 'S')
+            stats_start("scandisk");
+        else
+            usage(argv[0]);
+    }
+    if (optind >= argc) {
+    usage(argv[0]);
+    }
+    if (nthreads < 1)
+        nthreads = 1;
+
+    if (fleet_mode) {
+        // the images are the parallelism; one walk thread each unless
+        // -j says otherwise
+        memset(&fleet, 0, sizeof(fleet));
+        fleet.nthreads = set_threads ? nthreads : 1;
+        fleet.physical = physical;
+        fleet.rdonly = rdonly;
+        for (i = optind; i < argc; i++) {
+            if (add_operand(&fleet, argv[i]) < 0)
+                exit(1);
+        }
+        return run_fleet(&fleet, nimages < 1 ? 1 : nimages);
+    }
+    memset(&scan, 0, sizeof(scan));
+    scan.image = argv[optind];
+    scan.rdonly = rdonly;
+    if (check_image(&scan, nthreads, physical) < 0)
+        exit(1);
     return 0;
 
 }
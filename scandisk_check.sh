@@ -0,0 +1,104 @@
+#!/bin/sh
+# scandisk_check.sh: make images with each kind of damage dos_mkimg
+# knows, and check that scandisk --fleet -n reports what dos_mkimg says
+# it did, and leaves the images as they were.  Then list a tree deep
+# enough that its paths and indents run past dos_ls_check's small output
+# buffer.  Run by "make check".
+
+dir=$(mktemp -d) || exit 1
+trap 'rm -rf "$dir"' EXIT
+failed=0
+
+# field name: the value of "name" in each JSON line on stdin
+field()
+{
+    sed -n "s/.*\"$1\":\"\{0,1\}\([^\",}]*\).*/\1/p"
+}
+
+# expected: what scandisk should report for each line of a manifest
+expected()
+{
+    while read -r line; do
+	case "$line" in
+	*'"damage":"orphan"'*)
+	    echo "orphan $(echo "$line" | field cluster)" \
+		"$(echo "$line" | field clusters)" ;;
+	*'"damage":"truncated"'*)
+	    echo "size /$(echo "$line" | field path)" \
+		"$(echo "$line" | field clusters)" ;;
+	*'"damage":"crosslink"'*)
+	    echo "too_big /$(echo "$line" | field path)" ;;
+	*'"damage":"cycle"'*)
+	    echo "loop /$(echo "$line" | field path)" ;;
+	esac
+    done
+}
+
+# found: the same, from scandisk's finding records
+found()
+{
+    grep '"type":"finding"' | while read -r line; do
+	case "$line" in
+	*'"kind":"orphan"'*)
+	    echo "orphan $(echo "$line" | field cluster)" \
+		"$(echo "$line" | field count)" ;;
+	*'"kind":"size"'*)
+	    echo "size $(echo "$line" | field path)" \
+		"$(echo "$line" | field count)" ;;
+	*)
+	    echo "$(echo "$line" | field kind) $(echo "$line" | field path)" ;;
+	esac
+    done
+}
+
+for geometry in "" "--fat=32 --size=40M --cluster=512"; do
+    for damage in orphans truncate crosslink cycles; do
+	name="$damage${geometry:+ $geometry}"
+	img="$dir/$damage.img"
+	./dos_mkimg $geometry --files=60 --$damage=3 "$img" \
+	    > "$dir/manifest" 2> /dev/null || {
+	    echo "FAIL $name: dos_mkimg failed"
+	    failed=1
+	    continue
+	}
+	before=$(md5sum < "$img")
+	./scandisk --fleet -n "$img" > "$dir/report" 2> /dev/null
+	after=$(md5sum < "$img")
+
+	expected < "$dir/manifest" | sort > "$dir/want"
+	found < "$dir/report" | sort > "$dir/got"
+	if [ ! -s "$dir/want" ]; then
+	    echo "FAIL $name: no damage in the manifest"
+	    failed=1
+	elif ! cmp -s "$dir/want" "$dir/got"; then
+	    echo "FAIL $name: findings differ from the manifest"
+	    diff "$dir/want" "$dir/got"
+	    failed=1
+	elif [ "$before" != "$after" ]; then
+	    echo "FAIL $name: scandisk -n changed the image"
+	    failed=1
+	else
+	    echo "ok   $name"
+	fi
+    done
+done
+
+# a path of some 10K bytes, and an indent of 6000 spaces
+img="$dir/deep.img"
+if ./dos_mkimg --fat=32 --size=64M --cluster=512 --depth=1500 --fanout=1 \
+	--files=1 "$img" > /dev/null 2>&1; then
+    for format in tree json csv; do
+	./dos_ls --format=$format "$img" > "$dir/want" 2> /dev/null &&
+	./dos_ls_check --format=$format "$img" > "$dir/got" 2> /dev/null
+	if [ $? -ne 0 ] || ! cmp -s "$dir/want" "$dir/got"; then
+	    echo "FAIL deep tree: dos_ls --format=$format"
+	    failed=1
+	else
+	    echo "ok   deep tree --format=$format"
+	fi
+    done
+else
+    echo "FAIL deep tree: dos_mkimg failed"
+    failed=1
+fi
+exit $failed